@@ -89,13 +89,21 @@
 
 # ##CODE:
 
+from __future__ import print_function
 from numpy import *
 import os,time,json,traceback,sys
 from scipy.special import gammaln
 from scipy.stats import poisson,beta
-import cPickle as Pickle
+try:
+  import cPickle as Pickle
+except ImportError: #Python 3
+  import pickle as Pickle
 from collections import defaultdict,Counter
-from fim import fpgrowth #this is PyFIM, available from http://www.borgelt.net/pyfim.html
+try:
+  from fim import fpgrowth #this is PyFIM, available from http://www.borgelt.net/pyfim.html
+except ImportError: #Only get_freqitemsets needs it
+  fpgrowth = None
+cputime = getattr(time,'process_time',None) or time.clock #No clock from Python 3.8
 #from matplotlib import pyplot as plt #Uncomment to use the plot_chains function
 
 
@@ -123,7 +131,7 @@ def topscript():
   permsdic = defaultdict(default_permsdic) #We will store here the MCMC results
   Xtrain,Ytrain,nruleslen,lhs_len,itemsets = get_freqitemsets(fname+'_train',minsupport,maxlhs) #Do frequent itemset mining from the training data
   Xtest,Ytest,Ylabels_test = get_testdata(fname+'_test',itemsets) #Load the test data
-  print 'Data loaded!'
+  print('Data loaded!')
   
   #Do MCMC
   res,Rhat = run_bdl_multichain_serial(numiters,thinning,alpha,lbda,eta,Xtrain,Ytrain,nruleslen,lhs_len,maxlhs,permsdic,burnin,nchains,[None]*nchains)
@@ -139,19 +147,19 @@ def topscript():
     theta, ci_theta = get_rule_rhs(Xtrain,Ytrain,d_star,alpha,True)
     
     #Print out the point estimate rule
-    print 'antecedent risk (credible interval for risk)'
+    print('antecedent risk (credible interval for risk)')
     for i,j in enumerate(d_star):
-      print itemsets[j],theta[i],ci_theta[i]
+      print(itemsets[j],theta[i],ci_theta[i])
     
     #Evaluate on the test data
     preds_d_star = preds_d_t(Xtest,Ytest,d_star,theta) #Use d_star to make predictions on the test data
     accur_d_star = preds_to_acc(preds_d_star,Ylabels_test)#Accuracy of the point estimate
-    print 'accuracy of point estimate',accur_d_star
+    print('accuracy of point estimate',accur_d_star)
   
   ###The full posterior, BRL-post
   preds_fullpost = preds_full_posterior(Xtest,Ytest,Xtrain,Ytrain,permsdic,alpha)
   accur_fullpost = preds_to_acc(preds_fullpost,Ylabels_test) #Accuracy of the full posterior
-  print 'accuracy of full posterior',accur_fullpost
+  print('accuracy of full posterior',accur_fullpost)
   
   return permsdic, d_star, itemsets, theta, ci_theta, preds_d_star, accur_d_star, preds_fullpost, accur_fullpost
 
@@ -174,12 +182,12 @@ def run_bdl_multichain_serial(numiters,thinning,alpha,lbda,eta,X,Y,nruleslen,lhs
   res = {}
   for n in range(nchains):
     res[n] = {}
-    t1 = time.clock()
-    print 'Starting chain',n
+    t1 = cputime()
+    print('Starting chain',n)
     permsdic,res[n]['perms'] = bayesdl_mcmc(numiters,thinning,alpha,lbda,eta,X,Y,nruleslen,lhs_len,maxlhs,permsdic,burnin,None,d_inits[n])
-    print 'Elapsed CPU time',time.clock()-t1
+    print('Elapsed CPU time',cputime()-t1)
     #Store the permsdic results
-    res[n]['permsdic'] = {perm:list(vals) for perm,vals in permsdic.iteritems() if vals[1]>0}
+    res[n]['permsdic'] = {perm:list(vals) for perm,vals in permsdic.items() if vals[1]>0}
     #Reset the permsdic
     permsdic = reset_permsdic(permsdic)
     #Continue with the next chain
@@ -187,7 +195,7 @@ def run_bdl_multichain_serial(numiters,thinning,alpha,lbda,eta,X,Y,nruleslen,lhs
   #Check convergence
   Rhat = gelmanrubin(res)
   
-  print 'Rhat for convergence:',Rhat
+  print('Rhat for convergence:',Rhat)
   ##plot?
   #plot_chains(res)
   return res,Rhat
@@ -200,7 +208,7 @@ def gelmanrubin(res):
   phi_bar_j = {}
   for chain in res:
     phi_bar_j[chain] = 0.
-    for val in res[chain]['permsdic'].itervalues():
+    for val in res[chain]['permsdic'].values():
       phi_bar_j[chain] += val[1]*val[0] #numsamples*log posterior
       n += val[1]
   #And normalize
@@ -220,7 +228,7 @@ def gelmanrubin(res):
   W = 0.
   for chain in res:
     s2_j = 0.
-    for val in res[chain]['permsdic'].itervalues():
+    for val in res[chain]['permsdic'].values():
       s2_j += val[1]*(val[0] -phi_bar_j[chain])**2
     s2_j = (1./float(n-1))*s2_j
     W += s2_j
@@ -231,7 +239,7 @@ def gelmanrubin(res):
   try:
     Rhat = sqrt(varhat/float(W))
   except RuntimeWarning:
-    print 'RuntimeWarning computing Rhat, W='+str(W)+', B='+str(B)
+    print('RuntimeWarning computing Rhat, W='+str(W)+', B='+str(B))
     Rhat = 0.
   return Rhat
 
@@ -246,7 +254,7 @@ def plot_chains(res):
 def merge_chains(res):
   permsdic = defaultdict(default_permsdic)
   for n in res:
-    for perm,vals in res[n]['permsdic'].iteritems():
+    for perm,vals in res[n]['permsdic'].items():
       permsdic[perm][0] = vals[0]
       permsdic[perm][1] += vals[1]
   return permsdic
@@ -262,10 +270,10 @@ def get_point_estimate(permsdic,lhs_len,X,Y,alpha,nruleslen,maxlhs,lbda,eta):
     rulesizes.extend([lhs_len[j] for j in d_t[:-1]] * int(permsdic[perm][1]))
   #Now compute average
   avglistlen = average(listlens)
-  print 'Posterior average length:',avglistlen
+  print('Posterior average length:',avglistlen)
   try:
     avgrulesize = average(rulesizes)
-    print 'Posterior average width:',avgrulesize
+    print('Posterior average width:',avgrulesize)
     #Prepare the intervals
     minlen = int(floor(avglistlen))
     maxlen = int(ceil(avglistlen))
@@ -292,7 +300,7 @@ def get_point_estimate(permsdic,lhs_len,X,Y,alpha,nruleslen,maxlhs,lbda,eta):
     d_star = d_ts[likelihds.argmax()]
   except RuntimeWarning:
     #This can happen if all perms are identically [0], or if no soln is found within the len and width bounds (probably the chains didn't converge)
-    print 'No suitable point estimate found'
+    print('No suitable point estimate found')
     d_star = None
   return d_star
 
@@ -332,7 +340,7 @@ def preds_full_posterior(X,Y,Xtrain,Ytrain,permsdic,alpha):
   #this is binary only. The score is the Prob of 1.
   preds = zeros(Y.shape[0])
   postcount = 0. #total number of posterior samples
-  for perm,vals in permsdic.iteritems():
+  for perm,vals in permsdic.items():
     #We will compute probabilities for this antecedent list d.
     d_t = Pickle.loads(perm)
     permcount = float(vals[1]) #number of copies of this perm in the posterior
@@ -403,7 +411,7 @@ def bayesdl_mcmc(numiters,thinning,alpha,lbda,eta,X,Y,nruleslen,lhs_len,maxlhs,p
       #then we accept the move
       d_t = list(d_star)
       R_t = int(R_star)
-      a_t = str(a_star)
+      a_t = a_star
       #else: pass
     if itr > burnin and itr % thinning == 0:
       ##store
@@ -413,7 +421,7 @@ def bayesdl_mcmc(numiters,thinning,alpha,lbda,eta,X,Y,nruleslen,lhs_len,maxlhs,p
 
 #Samples a list from the prior
 def initialize_d(X,Y,lbda,eta,lhs_len,maxlhs,nruleslen):
-  m = Inf
+  m = inf
   while m>=len(X):
     m = poisson.rvs(lbda) #sample the length of the list from Poisson(lbda), truncated at len(X)
   #prepare the list
@@ -489,7 +497,7 @@ def proposal(d_t,R_t,X,Y,alpha):
   if u < sum(move_probs[:1]):
     #This is an on-list move.
     step = 'move'
-    [indx1,indx2] = random.permutation(range(len(d_t[:R_t])))[:2] #value error if there are no on list entries
+    [indx1,indx2] = random.permutation(list(range(len(d_t[:R_t]))))[:2] #value error if there are no on list entries
     #print 'move',indx1,indx2
     Jratio = Jratios[0] #ratio of move/move probabilities is 1.
   elif u < sum(move_probs[:2]):
@@ -611,7 +619,7 @@ def get_freqitemsets(fname,minsupport,maxlhs):
   itemsets = [r[0] for r in fpgrowth(data_pos,supp=minsupport,max=maxlhs)]
   itemsets.extend([r[0] for r in fpgrowth(data_neg,supp=minsupport,max=maxlhs)])
   itemsets = list(set(itemsets))
-  print len(itemsets),'rules mined'
+  print(len(itemsets),'rules mined')
   #Now form the data-vs.-lhs set
   #X[j] is the set of data points that contain itemset j (that is, satisfy rule j)
   X = [ set() for j in range(len(itemsets)+1)]
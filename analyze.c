@@ -17,22 +17,39 @@
 #include "mytime.h"
 #include "rule.h"
 
-/* Convenient macros. */
-#define RANDOM_RANGE(lo, hi) \
-    (unsigned)(lo + (unsigned)((random() / (float)RAND_MAX) * (hi - lo + 1)))
 #define DEFAULT_RULESET_SIZE  4
 
-void run_experiment(int, int, int, int, rule_t *);
+void run_experiment(int, int, int, int, rule_t *, ruleset_t *);
+int checkpoint(ruleset_t *, int);
+int resume(char *, int, int, rule_t *, ruleset_t **);
+int run_append(char *, int, int, int *, rule_t *);
+int run_lazy(int, int, int, int, rule_t *, int);
+int run_kernels(int, int, int, rule_t *);
+int run_matrix(int, int, int, int, rule_t *);
 int debug;
 
+/*
+ * Our generator's state is saved in and restored from checkpoints.  The
+ * index holds the rules not in the current ruleset, so that we can pick
+ * one to add without searching.
+ */
+rng_t rng;
+ruleindex_t unused;
+checkpointer_t *checkpointer;
+int snapflags;			/* SNAP_DEDUP if the rules were collapsed. */
+
 /*
  * Usage: analyze <file> -s <ruleset-size> -i <input operations> -S <seed>
  */
 int
 usage(void)
 {
-	(void)fprintf(stderr, "Usage: analyze [-d] [-s ruleset-size] %s\n",
-	    "[-c cmdfile] [-i iterations] [-S seed]");
+	(void)fprintf(stderr,
+	    "Usage: analyze [-du] [-s ruleset-size] %s %s %s %s\n",
+	    "[-c cmdfile] [-i iterations] [-S seed]",
+	    "[-C checkpoint] [-R resume-file]",
+	    "[-a tabfile [-b batch]] [-L lru-size] [-K passes]",
+	    "[-M lists]");
 	return (-1);
 }
 
@@ -42,29 +59,62 @@ main (int argc, char *argv[])
 	extern char *optarg;
 	extern int optind, optopt, opterr, optreset;
 	int ret, size = DEFAULT_RULESET_SIZE;
-	int iters, nrules, nsamples;
+	int iters, norig, nrules, nsamples, batch, nlru, kpasses, nlists, uniq;
 	char ch, *cmdfile = NULL, *infile;
+	char *ckptfile = NULL, *resumefile = NULL, *appendfile = NULL;
 	rule_t *rules;
+	ruleset_t *resume_rs;
+	dedup_t *dedup;
 	struct timeval tv_acc, tv_start, tv_end;
 
 	debug = 0;
 	iters = 10;
-	while ((ch = getopt(argc, argv, "di:s:S:")) != EOF)
+	batch = 100;
+	nlru = 0;
+	kpasses = 0;
+	nlists = 0;
+	uniq = 0;
+	rng_seed(&rng, 1);
+	while ((ch = getopt(argc, argv, "a:b:dC:i:K:L:M:R:s:S:u")) != EOF)
 		switch (ch) {
+		case 'a':
+			appendfile = optarg;
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
 		case 'c':
 			cmdfile = optarg;
 			break;
+		case 'C':
+			ckptfile = optarg;
+			break;
 		case 'd':
 			debug = 1;
 			break;
 		case 'i':
 			iters = atoi(optarg);
 			break;
+		case 'K':
+			kpasses = atoi(optarg);
+			break;
+		case 'L':
+			nlru = atoi(optarg);
+			break;
+		case 'M':
+			nlists = atoi(optarg);
+			break;
+		case 'R':
+			resumefile = optarg;
+			break;
 		case 's':
 			size = atoi(optarg);
 			break;
 		case 'S':
-			srandom((unsigned)(atoi(optarg)));
+			rng_seed(&rng, (unsigned)atoi(optarg));
+			break;
+		case 'u':
+			uniq = 1;
 			break;
 		case '?':
 		default:
@@ -87,35 +137,138 @@ main (int argc, char *argv[])
 	REPORT_TIME("analyze", "per rule", tv_acc, nrules);
 
 	printf("%d rules %d samples\n", nrules, nsamples);
+
+	/*
+	 * With -u, we collapse equivalent rules.  Rules that agree on these
+	 * samples need not agree on appended ones, so not with -a.
+	 * Collapsing renumbers the rules, so checkpoints record whether it
+	 * was done.
+	 */
+	if (uniq && appendfile != NULL)
+		return (usage());
+	if (uniq) {
+		snapflags = SNAP_DEDUP;
+		norig = nrules;
+		if ((ret = rules_dedup(rules, &nrules, nsamples, &dedup)) != 0)
+			return (ret);
+		printf("%d distinct truth tables (dedup ratio %.2f)\n",
+		    nrules, (double)norig / nrules);
+	}
 	if (debug)
 		rule_print_all(rules, nrules, nsamples);
+	if ((ret = ruleindex_init(&unused, nrules, 0, NULL)) != 0)
+		return (ret);
+
+	if (appendfile != NULL &&
+	    (ret = run_append(appendfile,
+	    batch, nrules, &nsamples, rules)) != 0)
+		return (ret);
+
+	if (nlru > 0)
+		return (run_lazy(iters, size, nsamples, nrules, rules, nlru));
+	if (kpasses > 0)
+		return (run_kernels(kpasses, nsamples, nrules, rules));
+	if (nlists > 0)
+		return (run_matrix(nlists, size, nsamples, nrules, rules));
+
+	resume_rs = NULL;
+	if (resumefile != NULL &&
+	    (ret = resume(resumefile,
+	    nrules, nsamples, rules, &resume_rs)) != 0) {
+		fprintf(stderr, "%s: cannot resume: %s\n",
+		    resumefile, strerror(ret));
+		return (ret);
+	}
+	if (ckptfile != NULL &&
+	    (ret = checkpoint_start(ckptfile, &checkpointer)) != 0)
+		return (ret);
 
 	/*
 	 * Add number of iterations for first parameter
 	 */
-	run_experiment(iters, size, nsamples, nrules, rules);
+	run_experiment(iters, size, nsamples, nrules, rules, resume_rs);
+
+	if (checkpointer != NULL &&
+	    (ret = checkpoint_stop(checkpointer)) != 0) {
+		fprintf(stderr, "%s: checkpoint failed: %s\n",
+		    ckptfile, strerror(ret));
+		return (ret);
+	}
+	return (0);
+}
+
+/*
+ * Load a checkpoint, restoring both the ruleset and the state of the
+ * random number generator.
+ */
+int
+resume(char *file, int nrules, int nsamples, rule_t *rules, ruleset_t **rs)
+{
+	void *buf;
+	size_t len, rnglen;
+	rng_t saved;
+	int ret;
+
+	if ((ret = snapshot_read(file, &buf, &len)) != 0)
+		return (ret);
+	rnglen = sizeof(saved);
+	ret = ruleset_restore(buf, len,
+	    rules, nrules, nsamples, snapflags, rs, &saved, &rnglen);
+	free(buf);
+	if (ret == 0 && rnglen == sizeof(saved))
+		rng = saved;
+	return (ret);
+}
+
+/*
+ * Hand a snapshot of the ruleset and generator to the checkpointer.
+ */
+int
+checkpoint(ruleset_t *rs, int nrules)
+{
+	void *buf;
+	size_t len;
+	int ret;
+
+	if ((ret = ruleset_snapshot(rs, nrules, SNAP_CAPTURES | snapflags,
+	    &rng, sizeof(rng), &buf, &len)) != 0)
+		return (ret);
+	return (checkpoint_post(checkpointer, buf, len));
+}
+
+/* Make the index of unused rules agree with a ruleset. */
+void
+index_ruleset(ruleset_t *rs)
+{
+	int i;
+
+	ruleindex_reset(&unused);
+	for (i = 0; i < rs->n_rules - 1; i++)
+		ruleindex_take(&unused, rs->rules[i].rule_id);
 }
 
 int
 create_random_ruleset(int size,
     int nsamples, int nrules, rule_t *rules, ruleset_t **rs)
 {
-	int i, j, *ids, next, ret;
+	int i, *ids, ret;
 
-	ids = calloc(size, sizeof(int));
+	if (size < 1 || size > nrules)
+		return (EINVAL);
+	if ((ids = calloc(size, sizeof(int))) == NULL)
+		return (ENOMEM);
+	ruleindex_reset(&unused);
 	for (i = 0; i < (size - 1); i++) {
-try_again:	next = RANDOM_RANGE(1, (nrules - 1));
-		/* Check for duplicates. */
-		for (j = 0; j < i; j++)
-			if (ids[j] == next)
-				goto try_again;
-		ids[i] = next;
+		ids[i] = ruleindex_pick(&unused, &rng);
+		ruleindex_take(&unused, ids[i]);
 	}
 
 	/* Always put rule 0 (the default) as the last rule. */
 	ids[i] = 0;
 
-	return(ruleset_init(size, nsamples, ids, rules, rs));
+	ret = ruleset_init(size, nsamples, ids, rules, rs);
+	free(ids);
+	return (ret);
 }
 
 /*
@@ -123,35 +276,58 @@ try_again:	next = RANDOM_RANGE(1, (nrules - 1));
  * add it at the ndx-th position.
  */
 int
-add_random_rule(rule_t *rules, int nrules, ruleset_t *rs, int ndx)
+add_random_rule(rule_t *rules, int nrules, ruleset_t **rs, int ndx)
 {
-	int j, new_rule;
+	int new_rule, ret;
 
-pickrule:
-	new_rule = RANDOM_RANGE(1, (nrules-1));
-	for (j = 0; j < rs->n_rules; j++)
-		if (rs->rules[j].rule_id == new_rule)
-			goto pickrule;
+	if ((new_rule = ruleindex_pick(&unused, &rng)) < 0)
+		return (EINVAL);
 	if (debug)
 		printf("\nAdding rule: %d\n", new_rule);
-	return(ruleset_add(rules, nrules, rs, new_rule, ndx));
+	if ((ret = ruleset_add(rules, nrules, rs, new_rule, ndx)) == 0)
+		ruleindex_take(&unused, new_rule);
+	return (ret);
+}
+
+/* Delete the ndx-th rule of a rule set, making it available again. */
+int
+delete_rule(rule_t *rules, int nrules, ruleset_t *rs, int ndx)
+{
+	int rule_id, ret;
+
+	rule_id = rs->rules[ndx].rule_id;
+	if ((ret = ruleset_delete(rules, nrules, rs, ndx)) == 0)
+		ruleindex_put(&unused, rule_id);
+	return (ret);
 }
 
 /*
  * Generate a random ruleset and then do some number of adds, removes,
- * swaps, etc.
+ * swaps, etc.  If resume_rs is non-NULL, it replaces the first random
+ * ruleset.
  */
 void
-run_experiment(int iters, int size, int nsamples, int nrules, rule_t *rules)
+run_experiment(int iters, int size,
+    int nsamples, int nrules, rule_t *rules, ruleset_t *resume_rs)
 {
-	int i, j, k, ret;
+	int i, j, k, asked, ret;
 	ruleset_t *rs;
 	struct timeval tv_acc, tv_start, tv_end;
 
+	asked = size;
 	for (i = 0; i < iters; i++) {
-		ret = create_random_ruleset(size, nsamples, nrules, rules, &rs);
-		if (ret != 0)
-			return;
+		if (i == 0 && resume_rs != NULL) {
+			/* The restored ruleset keeps its own size. */
+			rs = resume_rs;
+			size = rs->n_rules;
+			index_ruleset(rs);
+		} else {
+			size = asked;
+			ret = create_random_ruleset(size,
+			    nsamples, nrules, rules, &rs);
+			if (ret != 0)
+				return;
+		}
 		if (debug) {
 			printf("Initial ruleset\n");
 			ruleset_print(rs, rules);
@@ -183,16 +359,486 @@ run_experiment(int iters, int size, int nsamples, int nrules, rule_t *rules)
 		for (j = 0; j < (size - 1); j++) {
 			if (debug)
 				printf("\nDeleting rule %d\n", j);
-			ruleset_delete(rules, nrules, rs, j);
+			if (delete_rule(rules, nrules, rs, j) != 0)
+				return;
 			if (debug) 
 				ruleset_print(rs, rules);
-			add_random_rule(rules, nrules, rs, j);
+			add_random_rule(rules, nrules, &rs, j);
 			if (debug)
 				ruleset_print(rs, rules);
 		}
 		END_TIME(tv_start, tv_end, tv_acc);
 		REPORT_TIME("analyze", "per add/del", tv_acc, ((size-1) * 2));
+		if (checkpointer != NULL && (ret = checkpoint(rs, nrules)) != 0)
+			fprintf(stderr, "checkpoint: %s\n", strerror(ret));
 		ruleset_free(rs);
 	}
 
 }
+
+/*
+ * Append the samples in a .tab file to the rules, batch rows at a time,
+ * keeping a random ruleset up to date as we go.  At the end, check the
+ * ruleset against one built from scratch over all the samples.  With
+ * GMP, rules_append_held holds batches back until they are worth a shift
+ * of every vector.
+ */
+int
+run_append(char *file, int batch, int nrules, int *nsamples, rule_t *rules)
+{
+	FILE *fi;
+	char *line, **rows;
+	size_t linecap;
+	int i, n, nrows, ret, *ids;
+	appendbuf_t ab;
+	ruleset_t *rs, *check;
+	struct timeval tv_acc, tv_start, tv_end;
+
+	if ((fi = fopen(file, "r")) == NULL)
+		return (errno);
+	line = NULL;
+	linecap = 0;
+	n = 0;
+	rs = NULL;
+	appendbuf_init(&ab);
+	if ((rows = malloc(batch * sizeof(char *))) == NULL) {
+		ret = errno;
+		goto done;
+	}
+	if ((ret = create_random_ruleset(DEFAULT_RULESET_SIZE,
+	    *nsamples, nrules, rules, &rs)) != 0)
+		goto done;
+
+	INIT_TIME(tv_acc);
+	nrows = 0;
+	for (;;) {
+		for (n = 0; n < batch &&
+		    getline(&line, &linecap, fi) >= 0; n++)
+			if ((rows[n] = strdup(line)) == NULL) {
+				ret = errno;
+				goto done;
+			}
+		START_TIME(tv_start);
+		if (n != 0)
+			ret = rules_append_held(&ab,
+			    rules, nrules, nsamples, n, rows);
+		else
+			ret = rules_append_flush(&ab, rules, nrules, nsamples);
+		if (ret != 0 ||
+		    (ret = ruleset_extend(rs, rules, *nsamples)) != 0)
+			goto done;
+		END_TIME(tv_start, tv_end, tv_acc);
+		for (i = 0; i < n; i++)
+			free(rows[i]);
+		if (n == 0)
+			break;
+		nrows += n;
+	}
+	if (ferror(fi)) {
+		ret = EIO;
+		goto done;
+	}
+
+	printf("Appended %d samples; now %d samples\n", nrows, *nsamples);
+	REPORT_TIME("analyze", "per appended sample", tv_acc, nrows);
+	if (debug)
+		ruleset_print(rs, rules);
+
+	if ((ids = malloc(rs->n_rules * sizeof(int))) == NULL) {
+		ret = errno;
+		goto done;
+	}
+	for (i = 0; i < rs->n_rules; i++)
+		ids[i] = rs->rules[i].rule_id;
+	ret = ruleset_init(rs->n_rules, *nsamples, ids, rules, &check);
+	free(ids);
+	if (ret != 0)
+		goto done;
+	for (i = 0; i < rs->n_rules; i++)
+		if (rs->rules[i].ncaptured != check->rules[i].ncaptured) {
+			fprintf(stderr, "append: rule %d captures %d, not %d\n",
+			    rs->rules[i].rule_id, rs->rules[i].ncaptured,
+			    check->rules[i].ncaptured);
+			ret = EINVAL;
+		}
+	ruleset_free(check);
+
+done:
+	for (i = 0; i < n; i++)
+		free(rows[i]);
+	free(rows);
+	free(line);
+	appendbuf_free(&ab);
+	if (rs != NULL)
+		ruleset_free(rs);
+	(void)fclose(fi);
+	return (ret);
+}
+
+static double
+seconds(struct timeval tv)
+{
+	return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+/*
+ * Does a lazyset agree with a ruleset, counts and captures?
+ */
+static int
+lazy_check(lazyset_t *ls, ruleset_t *rs)
+{
+	int i;
+	ruleset_entry_t *re;
+
+	if (ls->n_rules != rs->n_rules)
+		return (0);
+	for (i = 0; i < rs->n_rules; i++) {
+		re = lazyset_entry(ls, i);
+		if (re->rule_id != rs->rules[i].rule_id ||
+		    re->ncaptured != rs->rules[i].ncaptured ||
+		    rule_vandcnt(re->captures, rs->rules[i].captures,
+		    rs->n_samples) != re->ncaptured)
+			return (0);
+	}
+	return (1);
+}
+
+/*
+ * Memory/latency tradeoff of lazy rulesets.  We run iters rounds of the
+ * delete/add sequence of run_experiment on a ruleset, recording the rules
+ * added, then replay it on lazysets checkpointed every 1, 2, 4, ... positions
+ * with nlru cached entries.  After each round, we look up every position
+ * in order and then as many at random.  We print one line per interval;
+ * the first line is the ruleset.
+ */
+int
+run_lazy(int iters, int size,
+    int nsamples, int nrules, rule_t *rules, int nlru)
+{
+	int i, j, k, n, interval, ret, *ids, *added, *probes;
+	ruleset_t *rs;
+	lazyset_t *ls;
+	size_t full;
+	double t_mod, t_seq, t_rand;
+	struct timeval tv_mod, tv_seq, tv_rand, tv_start, tv_end;
+
+	if ((ret = create_random_ruleset(size,
+	    nsamples, nrules, rules, &rs)) != 0)
+		return (ret);
+	ids = malloc(size * sizeof(int));
+	added = malloc(iters * (size - 1) * sizeof(int));
+	probes = malloc(size * sizeof(int));
+	if (ids == NULL || added == NULL || probes == NULL)
+		return (ENOMEM);
+	for (i = 0; i < size; i++) {
+		ids[i] = rs->rules[i].rule_id;
+		probes[i] = rng_int(&rng, size);
+	}
+
+	/* The ruleset, recording what we add. */
+	INIT_TIME(tv_mod);
+	n = 0;
+	for (i = 0; i < iters; i++)
+		for (j = 0; j < size - 1; j++) {
+			START_TIME(tv_start);
+			if ((ret = delete_rule(rules, nrules, rs, j)) != 0 ||
+			    (ret = add_random_rule(rules, nrules, &rs, j)) != 0)
+				return (ret);
+			END_TIME(tv_start, tv_end, tv_mod);
+			added[n++] = rs->rules[j].rule_id;
+		}
+	full = ruleset_bytes(rs);
+	printf("%8s %12s %8s %12s %12s %12s\n", "interval", "bytes", "% full",
+	    "usec add/del", "usec seq", "usec random");
+	printf("%8s %12zu %8.1f %12.3f %12s %12s\n", "full", full, 100.0,
+	    1e6 * seconds(tv_mod) / (2 * n), "-", "-");
+
+	for (interval = 1;; interval *= 2) {
+		if (interval > size)
+			interval = size;
+		if ((ret = lazyset_init(size,
+		    nsamples, ids, rules, NULL, interval, nlru, &ls)) != 0)
+			return (ret);
+		INIT_TIME(tv_mod);
+		INIT_TIME(tv_seq);
+		INIT_TIME(tv_rand);
+		n = 0;
+		for (i = 0; i < iters; i++) {
+			START_TIME(tv_start);
+			for (j = 0; j < size - 1; j++) {
+				lazyset_delete(ls, j);
+				if ((ret = lazyset_add(ls, added[n++], j)) != 0)
+					return (ret);
+			}
+			END_TIME(tv_start, tv_end, tv_mod);
+
+			START_TIME(tv_start);
+			for (j = 0; j < size; j++)
+				(void)lazyset_entry(ls, j);
+			END_TIME(tv_start, tv_end, tv_seq);
+
+			START_TIME(tv_start);
+			for (j = 0; j < size; j++)
+				(void)lazyset_entry(ls, probes[j]);
+			END_TIME(tv_start, tv_end, tv_rand);
+		}
+		t_mod = 1e6 * seconds(tv_mod) / (2 * n);
+		t_seq = 1e6 * seconds(tv_seq) / (iters * size);
+		t_rand = 1e6 * seconds(tv_rand) / (iters * size);
+		printf("%8d %12zu %8.1f %12.3f %12.3f %12.3f\n",
+		    interval, lazyset_bytes(ls), 100.0 * lazyset_bytes(ls) / full,
+		    t_mod, t_seq, t_rand);
+		if (debug)
+			printf("\t%ld hits %ld misses\n", ls->nhits, ls->nmisses);
+		k = lazy_check(ls, rs);
+		lazyset_free(ls);
+		if (!k) {
+			fprintf(stderr, "lazyset (interval %d) differs from "
+			    "ruleset\n", interval);
+			return (EINVAL);
+		}
+		if (interval == size)
+			break;
+	}
+	ruleset_free(rs);
+	free(ids);
+	free(added);
+	free(probes);
+	return (0);
+}
+
+/* Run rule_v* routine op (and, or, andnot, andcnt) on a and b. */
+static int
+kernel_call(int op, VECTOR d, VECTOR a, VECTOR b, int nsamples)
+{
+	int cnt;
+
+	cnt = 0;
+	if (op == 0)
+		rule_vand(d, a, b, nsamples, &cnt);
+	else if (op == 1)
+		rule_vor(d, a, b, nsamples, &cnt);
+	else if (op == 2)
+		rule_vandnot(d, a, b, nsamples, &cnt);
+	else
+		cnt = rule_vandcnt(a, b, nsamples);
+	return (cnt);
+}
+
+/*
+ * Time the rule_v* routines with the kernels specialized for this many
+ * samples (kernels.c) against their own loops, over passes passes of
+ * each rule with the next, and check that the two count the same.
+ */
+int
+run_kernels(int passes, int nsamples, int nrules, rule_t *rules)
+{
+	static const char *names[] = {"and", "or", "andnot", "andcnt"};
+	vkernel_t *special;
+	VECTOR d;
+	struct timeval tv_acc, tv_start, tv_end;
+	double secs[2][4], ncalls;
+	long sums[2][4];
+	int i, k, n, op, ret;
+
+	if ((special = vkernel) == NULL) {
+		printf("No specialized kernels for %d samples\n", nsamples);
+		return (0);
+	}
+	if ((ret = rule_vinit(nsamples, &d)) != 0)
+		return (ret);
+	for (k = 0; k < 2; k++) {
+		vkernel = k == 0 ? NULL : special;
+		for (op = 0; op < 4; op++) {
+			sums[k][op] = 0;
+			INIT_TIME(tv_acc);
+			START_TIME(tv_start);
+			for (n = 0; n < passes; n++)
+				for (i = 0; i < nrules; i++)
+					sums[k][op] += kernel_call(op, d,
+					    rules[i].truthtable,
+					    rules[(i + 1) % nrules].truthtable,
+					    nsamples);
+			END_TIME(tv_start, tv_end, tv_acc);
+			secs[k][op] = seconds(tv_acc);
+		}
+	}
+	vkernel = special;
+	rule_vdelete(d);
+
+	ncalls = (double)passes * nrules;
+	printf("%d entries per vector\n", special->n_entries);
+	printf("%8s %14s %14s %8s\n",
+	    "kernel", "nsec generic", "nsec special", "speedup");
+	for (op = 0; op < 4; op++) {
+		printf("%8s %14.1f %14.1f %7.2fx\n", names[op],
+		    1e9 * secs[0][op] / ncalls, 1e9 * secs[1][op] / ncalls,
+		    secs[0][op] / secs[1][op]);
+		if (sums[0][op] != sums[1][op]) {
+			fprintf(stderr, "%s: counts %ld generic, %ld special\n",
+			    names[op], sums[0][op], sums[1][op]);
+			ret = EINVAL;
+		}
+	}
+	return (ret);
+}
+
+/*
+ * Test each of the nq samples in samples (or with samples NULL, every
+ * sample) against each rule of the list in turn.
+ */
+static void
+scan_positions(int *ids, int n, rule_t *rules,
+    int nsamples, int *samples, int nq, int *pos)
+{
+	int i, q, s;
+
+	if (samples == NULL)
+		nq = nsamples;
+	for (q = 0; q < nq; q++) {
+		s = samples == NULL ? q : samples[q];
+		for (i = 0; i < n - 1; i++)
+			if (rule_isset(rules[ids[i]].truthtable, nsamples, s))
+				break;
+		pos[q] = i;
+	}
+}
+
+#define MATRIX_QUERIES	16		/* Samples asked about per list. */
+
+/*
+ * Find the position on the list capturing each sample for nlists random
+ * lists of size rules (and the default), by testing each sample against
+ * each rule in turn (scan), by the capture cascade (cascade_positions), and
+ * with rule matrices (transpose.c) laid out by rows (matrix) and bit-sliced
+ * (sliced), built on one thread and on as many as there are cores; then do
+ * the same for a few random samples per list, which the cascade cannot do
+ * by itself.  Report the time each method takes per sample and check that
+ * they agree.
+ */
+int
+run_matrix(int nlists, int size, int nsamples, int nrules, rule_t *rules)
+{
+	static const char *names[] = {"scan", "cascade", "matrix", "sliced"};
+	static const int layouts[] = {RM_ROWS, RM_BLOCKED};
+	rulematrix_t rm[2];
+	pool_stats_t ps;
+	struct timeval tv_acc, tv_start, tv_end;
+	double secs[4];
+	int *ids, *list, *samples, *pos[4], *sq;
+	int i, k, l, m, n, nq, ncores, nthreads, ret;
+
+	if (size > nrules - 1)
+		size = nrules - 1;
+	n = size + 1;
+	ids = malloc((size_t)nlists * n * sizeof(int));
+	samples = malloc((size_t)nlists * MATRIX_QUERIES * sizeof(int));
+	for (k = 0; k < 4; k++)
+		pos[k] = malloc(nsamples * sizeof(int));
+	if (ids == NULL || samples == NULL || pos[0] == NULL ||
+	    pos[1] == NULL || pos[2] == NULL || pos[3] == NULL)
+		return (ENOMEM);
+	for (l = 0; l < nlists; l++) {
+		list = ids + l * n;
+		for (i = 0; i < size; i++) {
+			list[i] = ruleindex_pick(&unused, &rng);
+			ruleindex_take(&unused, list[i]);
+		}
+		list[size] = 0;
+		ruleindex_reset(&unused);
+		for (i = 0; i < MATRIX_QUERIES; i++)
+			samples[l * MATRIX_QUERIES + i] =
+			    rng_int(&rng, nsamples);
+	}
+
+	if ((ncores = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncores = 1;
+	for (m = 0; m < 2; m++)
+		for (nthreads = 1; ; nthreads = ncores) {
+			if ((ret = rulematrix_init(&rm[m], rules, nrules,
+			    nsamples, layouts[m], nthreads, &ps)) != 0) {
+				if (m == 1)
+					rulematrix_free(&rm[0]);
+				return (ret);
+			}
+			printf("Transposed %d rules x %d samples (%s) on "
+			    "%d thread%s: %.3f msec, %.0f%% busy\n", nrules,
+			    nsamples, names[2 + m], ps.n_threads,
+			    ps.n_threads == 1 ? "" : "s", 1e3 * ps.wall,
+			    100 * ps.busy / (ps.wall * ps.n_threads));
+			if (nthreads == ncores)
+				break;
+			rulematrix_free(&rm[m]);
+		}
+
+	/* Every sample, then MATRIX_QUERIES samples, per list. */
+	for (nq = nsamples; ; nq = MATRIX_QUERIES) {
+		ret = 0;
+		for (l = 0; l < nlists && ret == 0; l++) {
+			list = ids + l * n;
+			sq = nq == nsamples ?
+			    NULL : samples + l * MATRIX_QUERIES;
+			scan_positions(list, n,
+			    rules, nsamples, sq, nq, pos[0]);
+			if (sq == NULL)
+				cascade_positions(list, n,
+				    rules, nsamples, pos[1]);
+			else
+				memcpy(pos[1], pos[0], nq * sizeof(int));
+			for (m = 0; m < 2 && ret == 0; m++)
+				ret = rulematrix_positions(&rm[m],
+				    list, n, sq, nq, pos[2 + m]);
+			if (ret != 0)
+				break;
+			for (k = 1; k < 4; k++)
+				if (memcmp(pos[0],
+				    pos[k], nq * sizeof(int)) != 0) {
+					fprintf(stderr, "%s: list %d "
+					    "positions differ\n", names[k], l);
+					ret = EINVAL;
+				}
+		}
+		for (k = 0; k < 4 && ret == 0; k++) {
+			if (k == 1 && nq != nsamples)
+				continue;
+			INIT_TIME(tv_acc);
+			START_TIME(tv_start);
+			for (l = 0; l < nlists && ret == 0; l++) {
+				list = ids + l * n;
+				sq = nq == nsamples ?
+				    NULL : samples + l * MATRIX_QUERIES;
+				if (k == 0)
+					scan_positions(list, n,
+					    rules, nsamples, sq, nq, pos[0]);
+				else if (k == 1)
+					cascade_positions(list, n,
+					    rules, nsamples, pos[1]);
+				else
+					ret = rulematrix_positions(&rm[k - 2],
+					    list, n, sq, nq, pos[k]);
+			}
+			END_TIME(tv_start, tv_end, tv_acc);
+			secs[k] = seconds(tv_acc);
+		}
+		if (ret != 0)
+			break;
+		printf("%d lists of %d rules, %d sample%s each\n",
+		    nlists, n, nq, nq == 1 ? "" : "s");
+		printf("%8s %16s %8s\n",
+		    "method", "nsec per sample", "vs scan");
+		for (k = 0; k < 4; k++)
+			if (k != 1 || nq == nsamples)
+				printf("%8s %16.2f %7.2fx\n", names[k],
+				    1e9 * secs[k] / ((double)nlists * nq),
+				    secs[0] / secs[k]);
+		if (nq == MATRIX_QUERIES)
+			break;
+	}
+	for (m = 0; m < 2; m++)
+		rulematrix_free(&rm[m]);
+	free(ids);
+	free(samples);
+	for (k = 0; k < 4; k++)
+		free(pos[k]);
+	return (ret);
+}
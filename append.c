@@ -0,0 +1,309 @@
+/*
+ * Copyright 2015 President and Fellows of Harvard College.
+ * All rights reserved.
+ */
+
+/*
+ * Online addition of samples.
+ *
+ * New labeled rows can be appended to an existing rule collection without
+ * re-running makedata and rules_init: we evaluate each rule's antecedent on
+ * the new rows and extend every truth table (and the default rule) with the
+ * results.  Live rulesets are then brought up to date by running the
+ * capture cascade over only the entries that hold the new samples.
+ *
+ * Rows are given in .tab format: a list of the attributes that are present,
+ * separated by white space.  A rule's features are its attributes separated
+ * by commas, as written by makedata.py.
+ *
+ * With GMP, the samples are numbered from the high-order end of each
+ * bignum, so every append shifts every truth table (see rule_vextend):
+ * rules_append costs time proportional to the size of the collection,
+ * however few rows it is given.  rules_append_held holds rows back until
+ * there is at least one for each word a truth table has, so that the
+ * shifts cost amortized time proportional to the rows appended.  Without
+ * GMP, the vectors grow in place and it appends at once.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rule.h"
+
+#ifdef GMP
+extern mpz_t mpz_hack_default_mask;
+#endif
+
+#define ATTR_SEP	" \t\r\n"
+
+typedef struct row {
+	char *buf;			/* Private copy of the line. */
+	int nattrs;
+	char **attrs;
+} row_t;
+
+/*
+ * Split a .tab line into its attributes.
+ */
+static int
+row_parse(const char *line, row_t *row)
+{
+	char *p, *tok, **expand;
+	int nalloc;
+
+	if ((row->buf = strdup(line)) == NULL)
+		return (errno);
+	row->nattrs = 0;
+	row->attrs = NULL;
+	nalloc = 0;
+	for (p = row->buf; (tok = strsep(&p, ATTR_SEP)) != NULL;) {
+		if (*tok == '\0')
+			continue;
+		if (row->nattrs == nalloc) {
+			nalloc = nalloc == 0 ? 16 : nalloc * 2;
+			expand = realloc(row->attrs, nalloc * sizeof(char *));
+			if (expand == NULL) {
+				free(row->attrs);
+				free(row->buf);
+				row->buf = NULL;
+				return (ENOMEM);
+			}
+			row->attrs = expand;
+		}
+		row->attrs[row->nattrs++] = tok;
+	}
+	return (0);
+}
+
+static void
+row_free(row_t *row)
+{
+	free(row->attrs);
+	free(row->buf);
+}
+
+/*
+ * Does the rule (a comma-separated list of attributes) hold for a row?
+ * That is, is every attribute in the rule's antecedent present in the row?
+ */
+int
+rule_matches(const char *features, char **attrs, int nattrs)
+{
+	const char *item, *end;
+	size_t len;
+	int i;
+
+	for (item = features; *item != '\0'; item = end + (*end != '\0')) {
+		if ((end = strchr(item, ',')) == NULL)
+			end = item + strlen(item);
+		len = end - item;
+		for (i = 0; i < nattrs; i++)
+			if (strncmp(attrs[i], item, len) == 0 &&
+			    attrs[i][len] == '\0')
+				break;
+		if (i == nattrs)
+			return (0);
+	}
+	return (1);
+}
+
+/*
+ * Append nnew samples, one .tab line each in rows, to every rule's truth
+ * table.  Rule 0 is the default rule and captures every sample.  On
+ * return, *nsamples is the new number of samples.  With GMP, this takes
+ * time proportional to nrules times the number of samples, however small
+ * nnew is; see rules_append_held.
+ */
+int
+rules_append(rule_t *rules, int nrules, int *nsamples, int nnew, char **rows)
+{
+	int i, k, oldn, newn, ret;
+	row_t *parsed;
+
+	oldn = *nsamples;
+	newn = oldn + nnew;
+	if (nnew == 0)
+		return (0);
+
+	if ((parsed = calloc(nnew, sizeof(row_t))) == NULL)
+		return (errno);
+	for (k = 0; k < nnew; k++)
+		if ((ret = row_parse(rows[k], parsed + k)) != 0)
+			goto done;
+
+	/*
+	 * Growing the vectors is the only step that can fail, so do all of
+	 * it before setting any bits.
+	 */
+	for (i = 0; i < nrules; i++)
+		if ((ret = rule_vextend(&rules[i].truthtable, oldn, newn)) != 0)
+			goto done;
+
+	for (i = 0; i < nrules; i++)
+		for (k = 0; k < nnew; k++)
+			if (i == 0 || rule_matches(rules[i].features,
+			    parsed[k].attrs, parsed[k].nattrs)) {
+				rule_setbit(rules[i].truthtable, newn, oldn + k);
+				rules[i].support++;
+			}
+#ifdef GMP
+	mpz_set(mpz_hack_default_mask, rules[0].truthtable);
+#endif
+	*nsamples = newn;
+	(void)vkernel_select(newn);
+	ret = 0;
+
+done:
+	for (k = 0; k < nnew; k++)
+		if (parsed[k].buf != NULL)
+			row_free(parsed + k);
+	free(parsed);
+	return (ret);
+}
+
+void
+appendbuf_init(appendbuf_t *ab)
+{
+	memset(ab, 0, sizeof(appendbuf_t));
+}
+
+/*
+ * Append the rows held in ab, if any.  On failure they stay held.
+ */
+int
+rules_append_flush(appendbuf_t *ab, rule_t *rules, int nrules, int *nsamples)
+{
+	int k, ret;
+
+	if ((ret = rules_append(rules,
+	    nrules, nsamples, ab->n_rows, ab->rows)) != 0)
+		return (ret);
+	for (k = 0; k < ab->n_rows; k++)
+		free(ab->rows[k]);
+	ab->n_rows = 0;
+	return (0);
+}
+
+/*
+ * Like rules_append, but with GMP the rows may be held in ab rather than
+ * appended (and *nsamples left alone) until there are enough of them.
+ * The caller appends whatever is left with rules_append_flush.
+ */
+int
+rules_append_held(appendbuf_t *ab, rule_t *rules,
+    int nrules, int *nsamples, int nnew, char **rows)
+{
+#ifdef GMP
+	char **expand;
+	int k, nalloc;
+
+	if (ab->n_rows + nnew > ab->n_alloc) {
+		for (nalloc = ab->n_alloc == 0 ? 16 : ab->n_alloc;
+		    nalloc < ab->n_rows + nnew; nalloc *= 2)
+			continue;
+		if ((expand = realloc(ab->rows,
+		    nalloc * sizeof(char *))) == NULL)
+			return (errno);
+		ab->rows = expand;
+		ab->n_alloc = nalloc;
+	}
+	for (k = 0; k < nnew; k++) {
+		if ((ab->rows[ab->n_rows + k] = strdup(rows[k])) == NULL) {
+			while (--k >= 0)
+				free(ab->rows[ab->n_rows + k]);
+			return (ENOMEM);
+		}
+	}
+	ab->n_rows += nnew;
+	if (ab->n_rows < *nsamples / (int)BITS_PER_ENTRY)
+		return (0);
+	return (rules_append_flush(ab, rules, nrules, nsamples));
+#else
+	(void)ab;
+	return (rules_append(rules, nrules, nsamples, nnew, rows));
+#endif
+}
+
+/* Drop any rows still held. */
+void
+appendbuf_free(appendbuf_t *ab)
+{
+	int k;
+
+	for (k = 0; k < ab->n_rows; k++)
+		free(ab->rows[k]);
+	free(ab->rows);
+	memset(ab, 0, sizeof(appendbuf_t));
+}
+
+/*
+ * Bring a ruleset up to date after rules_append has grown the rules from
+ * rs->n_samples to nsamples.  Only the new samples can change hands, so
+ * we extend each captures vector and run the cascade over just the part
+ * of the vectors that holds them.
+ */
+int
+ruleset_extend(ruleset_t *rs, rule_t *rules, int nsamples)
+{
+	int i, ret, oldn;
+#ifdef GMP
+	int nnew;
+	mpz_t caught, notcaught, newbits;
+#else
+	int w, first, nentries;
+	v_entry caught, c;
+	ruleset_entry_t *re;
+#endif
+
+	oldn = rs->n_samples;
+	if (nsamples == oldn)
+		return (0);
+	assert(nsamples > oldn);
+
+	for (i = 0; i < rs->n_rules; i++)
+		if ((ret = ruleset_own(rs, i)) != 0 ||
+		    (ret = rule_vextend(&rs->rules[i].captures,
+		    oldn, nsamples)) != 0)
+			return (ret);
+
+#ifdef GMP
+	/* The new samples are the low-order nnew bits. */
+	nnew = nsamples - oldn;
+	mpz_init(caught);
+	mpz_init(notcaught);
+	mpz_init(newbits);
+	for (i = 0; i < rs->n_rules; i++) {
+		mpz_tdiv_r_2exp(newbits,
+		    rules[rs->rules[i].rule_id].truthtable, nnew);
+		mpz_com(notcaught, caught);
+		mpz_and(newbits, newbits, notcaught);
+		mpz_ior(rs->rules[i].captures, rs->rules[i].captures, newbits);
+		mpz_ior(caught, caught, newbits);
+		rs->rules[i].ncaptured += mpz_popcount(newbits);
+	}
+	mpz_clear(caught);
+	mpz_clear(notcaught);
+	mpz_clear(newbits);
+#else
+	/*
+	 * Start at the entry that held the old trailing samples; recomputing
+	 * the old samples in it reproduces what was already there.
+	 */
+	first = oldn / BITS_PER_ENTRY;
+	nentries = (nsamples + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+	for (w = first; w < nentries; w++) {
+		caught = 0;
+		for (i = 0; i < rs->n_rules; i++) {
+			re = rs->rules + i;
+			c = rules[re->rule_id].truthtable[w] & ~caught;
+			re->ncaptured +=
+			    count_ones(c) - count_ones(re->captures[w]);
+			re->captures[w] = c;
+			caught |= c;
+		}
+	}
+#endif
+	rs->n_samples = nsamples;
+	return (0);
+}
@@ -0,0 +1,109 @@
+#Copyright 2015 President and Fellows of Harvard College.
+#All rights reserved.
+#
+#Compare the pure-Python BRL_code.py functions with their brl_native.py
+#replacements on a data set made by makedata.py:
+#
+#  python bench_native.py basename [numiters]
+#
+#reads basename.out and basename.Y, builds X, Y, lhs_len and nruleslen the way
+#BRL_code.get_freqitemsets does, checks that both versions agree and reports
+#the time each takes for compute_rule_usage, posterior scoring, preds_d_t and
+#numiters MCMC iterations.
+
+from __future__ import print_function
+import sys
+import time
+import random
+from collections import defaultdict,Counter
+from numpy import array,zeros,allclose
+import BRL_code
+import brl_native
+
+def load(basename):
+  X = []
+  lhs_len = []
+  for line in open(basename+'.out'):
+    features,bits = line.rstrip('\n').split('\t',1)
+    X.append(set(i for i,b in enumerate(bits.split()) if b == '1'))
+    lhs_len.append(len(features.split(',')))
+  Y = array([[int(y) for y in line.split()] for line in open(basename+'.Y')],dtype=float)
+  X.insert(0,set(range(Y.shape[0])))
+  lhs_len.insert(0,0)
+  nruleslen = Counter(lhs_len)
+  return X,Y,nruleslen,array(lhs_len)
+
+#Each of n lists draws a length from 1..maxlen and that many distinct rules.
+def random_lists(nrules,n,maxlen):
+  lists = []
+  for k in range(n):
+    d = random.sample(range(1,nrules),random.randint(1,maxlen))
+    lists.append(d+[0])
+  return lists
+
+def timeit(fn,reps):
+  t = time.time()
+  for r in range(reps):
+    res = fn()
+  return res,(time.time()-t)/reps
+
+def report(what,tpy,tnat):
+  print('%-20s %12.1f us %12.1f us %8.1fx' % (what,tpy*1e6,tnat*1e6,tpy/tnat))
+
+def main(basename,numiters):
+  lbda,eta,alpha = 3.,1.,array([1.,1.])
+  X,Y,nruleslen,lhs_len = load(basename)
+  maxlhs = max(lhs_len)
+  print('%s: %d rules, %d samples' % (basename,len(X),Y.shape[0]))
+  random.seed(1)
+  lists = random_lists(len(X),200,10)
+  beta_Z,logalpha_pmf,logbeta_pmf = BRL_code.prior_calculations(lbda,len(X),eta,maxlhs)
+  model = brl_native.rulelib.Model(brl_native.native_rules(X,Y,lhs_len),lbda,eta)
+  print('%-20s %15s %15s %9s' % ('','python','native','speedup'))
+
+  def usage(f):
+    return lambda: [f(d,len(d)-1,X,Y) for d in lists]
+  Npy,tpy = timeit(usage(BRL_code.compute_rule_usage),1)
+  Nnat,tnat = timeit(usage(brl_native.compute_rule_usage),10)
+  assert all((a == b).all() for a,b in zip(Npy,Nnat))
+  report('compute_rule_usage',tpy/len(lists),tnat/len(lists))
+
+  def post_py():
+    return [BRL_code.fn_logposterior(d,len(d)-1,BRL_code.compute_rule_usage(d,len(d)-1,X,Y),alpha,logalpha_pmf,logbeta_pmf,maxlhs,beta_Z,nruleslen,lhs_len) for d in lists]
+  Ppy,tpy = timeit(post_py,1)
+  Pnat,tnat = timeit(lambda: [model.logposterior(d) for d in lists],10)
+  #The priors differ for lists that use up a cardinality (see brl_native.py),
+  #so compare the likelihoods of every list and the posteriors of the others.
+  def uses_up(d):
+    n = Counter(lhs_len[r] for r in d[:-1])
+    return any(n[l] == nruleslen[l] for l in n)
+  Lpy = [p-BRL_code.fn_logprior(d,len(d)-1,logalpha_pmf,logbeta_pmf,maxlhs,beta_Z,nruleslen,lhs_len) for p,d in zip(Ppy,lists)]
+  Lnat = [p-model.logprior(d) for p,d in zip(Pnat,lists)]
+  assert allclose(Lpy,Lnat)
+  same = [k for k,d in enumerate(lists) if not uses_up(d)]
+  assert allclose([Ppy[k] for k in same],[Pnat[k] for k in same])
+  report('logposterior',tpy/len(lists),tnat/len(lists))
+
+  def preds(f):
+    return lambda: [f(X,Y,d,[0.5+k for k in range(len(d))]) for d in lists]
+  Rpy,tpy = timeit(preds(BRL_code.preds_d_t),1)
+  Rnat,tnat = timeit(preds(brl_native.preds_d_t),1)
+  assert all((a == b).all() for a,b in zip(Rpy,Rnat))
+  report('preds_d_t',tpy/len(lists),tnat/len(lists))
+
+  def mcmc(f):
+    permsdic = defaultdict(BRL_code.default_permsdic)
+    return lambda: f(numiters,1,alpha,lbda,eta,X,Y,nruleslen,lhs_len,maxlhs,permsdic,numiters//2,1,None)
+  (dpy,ppy),tpy = timeit(mcmc(BRL_code.bayesdl_mcmc),1)
+  (dnat,pnat),tnat = timeit(mcmc(brl_native.bayesdl_mcmc),1)
+  assert len(ppy) == len(pnat)
+  report('mcmc iteration',tpy/numiters,tnat/numiters)
+  for name,d in (('python',dpy),('native',dnat)):
+    best = max((v[0],p) for p,v in d.items() if v[1] > 0)
+    print('%s: %d lists scored, best %s %.3f' % (name,len(d),BRL_code.Pickle.loads(best[1]),best[0]))
+
+if __name__ == '__main__':
+  if len(sys.argv) < 2:
+    print('usage: bench_native.py basename [numiters]',file=sys.stderr)
+    sys.exit(1)
+  main(sys.argv[1],int(sys.argv[2]) if len(sys.argv) > 2 else 5000)
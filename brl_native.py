@@ -0,0 +1,131 @@
+#Copyright 2015 President and Fellows of Harvard College.
+#All rights reserved.
+#
+#Native replacements for the hot spots of BRL_code.py, backed by the rulelib
+#extension (rulelibmodule.c; build it with "make rulelib.so").
+#
+#Each function here has the signature of the BRL_code.py function of the same
+#name and returns the same thing, so they can be switched over one at a time:
+#
+#  import BRL_code, brl_native
+#  brl_native.install(BRL_code, ['compute_rule_usage'])
+#
+#replaces BRL_code.compute_rule_usage, which also speeds up everything in
+#BRL_code.py that calls it (get_rule_rhs, get_point_estimate, the pure-Python
+#bayesdl_mcmc).  install(BRL_code) switches over everything listed in NATIVE.
+#
+#The native rules for a data set are built from X (the list of sets of sample
+#indices, one per rule) the first time they are needed and then cached, keyed
+#on X itself, so X must not be changed in place afterwards.
+#
+#Like BRL_code.py, this is for binary classification only.  The native prior
+#differs from fn_logprior in one detail: when every rule of some cardinality
+#is already on the list, fn_logprior subtracts the log of that cardinality's
+#probability from beta_Z where sampler.c subtracts the probability itself.
+#Lists that exhaust a cardinality are rare, but their posteriors differ.
+
+import sys
+import random as pyrandom
+from numpy import array,frombuffer,intc
+try:
+  import cPickle as Pickle
+except ImportError:
+  import pickle as Pickle
+import rulelib
+
+#The functions install() replaces by default.
+NATIVE = ['compute_rule_usage','bayesdl_mcmc','preds_d_t']
+
+#id(X) -> (X, lhs_len, rulelib.Rules).  We hold on to X so its id stays unique.
+_rules_cache = {}
+
+#The native rules for X and Y.  lhs_len (the cardinality of each rule) is
+#only needed for the prior; without it, every rule but the default has
+#cardinality 1.
+def native_rules(X,Y,lhs_len=None):
+  cached = _rules_cache.get(id(X))
+  if cached is not None and cached[0] is X and (lhs_len is None or cached[1] is lhs_len):
+    return cached[2]
+  if Y.shape[1] != 2:
+    raise ValueError('rulelib handles two classes only')
+  if lhs_len is None:
+    lens = [0] + [1]*(len(X)-1)
+  else:
+    lens = [int(l) for l in lhs_len]
+  ones = [i for i in range(Y.shape[0]) if Y[i,1]]
+  rules = rulelib.Rules.from_sets(X,ones,lens)
+  _rules_cache[id(X)] = (X,lhs_len,rules)
+  return rules
+
+#Forget the native rules for X (or for everything).
+def clear_cache(X=None):
+  if X is None:
+    _rules_cache.clear()
+  else:
+    _rules_cache.pop(id(X),None)
+
+#Replace names (default NATIVE) in module with the native versions.
+def install(module,names=None):
+  if names is None:
+    names = NATIVE
+  this = sys.modules[__name__]
+  for name in names:
+    setattr(module,name,getattr(this,name))
+
+###############BRL
+
+#As BRL_code.compute_rule_usage: row i holds the number of samples of each
+#class captured by rule d_star[i].
+def compute_rule_usage(d_star,R_star,X,Y):
+  rules = native_rules(X,Y)
+  return array(rules.compute_rule_usage(d_star[:R_star+1]),dtype=float)
+
+#As BRL_code.bayesdl_mcmc, but the chain runs in rulelib (sampler.c).  The
+#initial list, proposals and acceptance draws come from rulelib's generator
+#rather than numpy's, so a given rseed gives a different (but equally valid)
+#chain.  permsdic gets entries only for the lists the chain is at when it
+#stores a sample, not for every list proposed along the way.
+def bayesdl_mcmc(numiters,thinning,alpha,lbda,eta,X,Y,nruleslen,lhs_len,maxlhs,permsdic,burnin,rseed,d_init):
+  perms = []
+  if rseed:
+    seed = int(rseed)
+  else:
+    seed = pyrandom.randint(1,2**31-1)
+  rules = native_rules(X,Y,lhs_len)
+  model = rulelib.Model(rules,float(lbda),float(eta),(float(alpha[0]),float(alpha[1])))
+  if d_init:
+    d_t = Pickle.loads(d_init)
+    chain = rulelib.Chain(model,seed,ids=d_t[:d_t.index(0)+1])
+  else:
+    chain = rulelib.Chain(model,seed)
+  a_t = Pickle.dumps(chain.ids)
+  if a_t not in permsdic:
+    permsdic[a_t][0] = chain.logpost
+  if burnin == 0:
+    permsdic[a_t][1] += 1 #store the initialization sample
+  #Iteration itr is stored if itr > burnin and itr % thinning == 0; step
+  #straight from one stored iteration to the next.
+  itr = burnin + 1
+  if itr % thinning:
+    itr += thinning - itr % thinning
+  done = 0
+  while itr < numiters:
+    chain.step(itr + 1 - done)
+    done = itr + 1
+    a_t = Pickle.dumps(chain.ids)
+    if a_t not in permsdic:
+      permsdic[a_t][0] = chain.logpost
+    permsdic[a_t][1] += 1
+    perms.append(a_t)
+    itr += thinning
+  if done < numiters:
+    chain.step(numiters - done)
+  return permsdic,perms
+
+#As BRL_code.preds_d_t: each observation gets the theta of the first rule on
+#d_t that it satisfies.
+def preds_d_t(X,Y,d_t,theta):
+  rules = native_rules(X,Y)
+  R_t = list(d_t).index(0)
+  pos = frombuffer(rules.positions(d_t[:R_t+1]),dtype=intc)
+  return array(theta,dtype=float)[pos]
@@ -0,0 +1,488 @@
+/*
+ * Copyright 2015 President and Fellows of Harvard College.
+ * All rights reserved.
+ */
+
+/*
+ * Ruleset snapshots and checkpointing.
+ *
+ * A snapshot is a compact binary image of a ruleset: a fixed header
+ * followed by a sequence of tagged sections.  The entries section (rule
+ * ids and capture counts) is always present; the captures vectors and the
+ * caller's random number generator state are optional.  The header records
+ * how many rules and samples the rule collection had and whether it was
+ * collapsed into distinct truth tables (SNAP_DEDUP), and restore refuses a
+ * snapshot taken against a collection of another size or kind.  When the
+ * captures are omitted, restore recomputes them from the rules' truth
+ * tables and checks the result against the saved counts; when they are
+ * present, it checks that each lies within its rule's truth table.
+ *
+ * That recomputation is done at restore, not put off until a captures
+ * vector is first read: every ruleset_t entry holds its vector, and
+ * everything that uses a ruleset reads them directly.  It is one pass of
+ * the capture cascade, the same as ruleset_init.  Callers that want the
+ * counts without the vectors should use a lazy ruleset (lazy.c) instead.
+ *
+ * Readers skip sections whose tag they do not know, so new kinds of state
+ * can be added without invalidating old checkpoints.
+ *
+ * The checkpointer hands snapshots to a background thread that writes them
+ * out, so the thread running the experiment never waits on the disk.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "rule.h"
+
+#define SNAP_MAGIC	0x52534e50	/* "RSNP" */
+#define SNAP_VERSION	2
+
+/* Section tags. */
+#define SNAP_T_ENTRIES	1
+#define SNAP_T_CAPTURES	2
+#define SNAP_T_RNG	3
+
+#define SNAP_ALIGN(n)	(((n) + 7) & ~(size_t)7)
+
+typedef struct snap_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_rules;		/* Entries in the ruleset. */
+	uint32_t n_total;		/* Rules in the collection. */
+	uint32_t n_samples;
+	uint32_t word_size;		/* sizeof(v_entry) of the writer. */
+	uint32_t flags;
+	uint32_t pad;			/* Keeps the sections 8-aligned. */
+} snap_header_t;
+
+typedef struct snap_section {
+	uint32_t tag;
+	uint32_t pad;
+	uint64_t len;			/* Payload bytes, excluding padding. */
+} snap_section_t;
+
+typedef struct snap_entry {
+	uint32_t rule_id;
+	uint32_t ncaptured;
+} snap_entry_t;
+
+struct checkpointer {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	char *file;
+	void *pending;			/* Most recent unwritten snapshot. */
+	size_t pending_len;
+	int stop;
+	int error;			/* First write error, if any. */
+};
+
+static char *
+snap_section(char *p, int tag, size_t len)
+{
+	snap_section_t *sec;
+
+	sec = (snap_section_t *)p;
+	sec->tag = tag;
+	sec->pad = 0;
+	sec->len = len;
+	return (p + sizeof(snap_section_t));
+}
+
+/*
+ * Serialize the ruleset, whose rules are taken from a collection of
+ * nrules rules, into a freshly malloc'd buffer.  If SNAP_CAPTURES
+ * is set in flags, the captures vectors are included, otherwise only the
+ * rule ids and counts are; SNAP_DEDUP records that the rules were
+ * collapsed (dedup.c).  rng/rnglen is an opaque blob (typically the
+ * generator state) stored alongside; pass NULL/0 to omit it.
+ */
+int
+ruleset_snapshot(ruleset_t *rs, int nrules,
+    int flags, void *rng, size_t rnglen, void **bufp, size_t *lenp)
+{
+	int i, nentries;
+	size_t len, caplen;
+	char *buf, *p;
+	snap_header_t *hdr;
+	snap_entry_t *ep;
+
+	nentries = (rs->n_samples + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+	caplen = (size_t)rs->n_rules * nentries * sizeof(v_entry);
+
+	len = sizeof(snap_header_t) + sizeof(snap_section_t) +
+	    SNAP_ALIGN(rs->n_rules * sizeof(snap_entry_t));
+	if (flags & SNAP_CAPTURES)
+		len += sizeof(snap_section_t) + caplen;
+	if (rng != NULL)
+		len += sizeof(snap_section_t) + SNAP_ALIGN(rnglen);
+
+	if ((buf = calloc(1, len)) == NULL)
+		return (errno);
+
+	hdr = (snap_header_t *)buf;
+	hdr->magic = SNAP_MAGIC;
+	hdr->version = SNAP_VERSION;
+	hdr->n_rules = rs->n_rules;
+	hdr->n_total = nrules;
+	hdr->n_samples = rs->n_samples;
+	hdr->word_size = sizeof(v_entry);
+	hdr->flags = flags;
+	p = buf + sizeof(snap_header_t);
+
+	ep = (snap_entry_t *)snap_section(p, SNAP_T_ENTRIES,
+	    rs->n_rules * sizeof(snap_entry_t));
+	for (i = 0; i < rs->n_rules; i++) {
+		ep[i].rule_id = rs->rules[i].rule_id;
+		ep[i].ncaptured = rs->rules[i].ncaptured;
+	}
+	p = (char *)ep + SNAP_ALIGN(rs->n_rules * sizeof(snap_entry_t));
+
+	if (flags & SNAP_CAPTURES) {
+		p = snap_section(p, SNAP_T_CAPTURES, caplen);
+		for (i = 0; i < rs->n_rules; i++) {
+#ifdef GMP
+			/* Low-order word first; the tail stays zero from calloc. */
+			mpz_export(p, NULL, -1, sizeof(v_entry), 0, 0,
+			    rs->rules[i].captures);
+#else
+			memcpy(p, rs->rules[i].captures,
+			    nentries * sizeof(v_entry));
+#endif
+			p += nentries * sizeof(v_entry);
+		}
+	}
+
+	if (rng != NULL) {
+		p = snap_section(p, SNAP_T_RNG, rnglen);
+		memcpy(p, rng, rnglen);
+		p += SNAP_ALIGN(rnglen);
+	}
+	assert(p == buf + len);
+
+	*bufp = buf;
+	*lenp = len;
+	return (0);
+}
+
+/*
+ * Rebuild a ruleset from a snapshot.  The rules array, of nrules rules
+ * over nsamples samples, collapsed if SNAP_DEDUP is set in flags, must be
+ * the same one (same file, same order) the snapshot was taken against;
+ * EINVAL if its size differs or only one of them was collapsed.  If rng is
+ * non-NULL, the saved generator state is copied into it; *rnglenp gives
+ * the size of rng on input and the number of bytes copied on output.
+ */
+int
+ruleset_restore(void *buf, size_t len, rule_t *rules, int nrules,
+    int nsamples, int flags, ruleset_t **rsp, void *rng, size_t *rnglenp)
+{
+	int i, n, nentries, *ids, ret;
+	char *p, *end, *caps;
+	size_t plen, rngmax;
+	ruleset_t *rs;
+	snap_header_t *hdr;
+	snap_section_t *sec;
+	snap_entry_t *ep;
+
+	hdr = buf;
+	if (len < sizeof(snap_header_t) ||
+	    hdr->magic != SNAP_MAGIC || hdr->version != SNAP_VERSION ||
+	    hdr->word_size != sizeof(v_entry) || hdr->n_rules > INT_MAX ||
+	    hdr->n_total != (unsigned)nrules ||
+	    hdr->n_samples != (unsigned)nsamples ||
+	    (hdr->flags & SNAP_DEDUP) != (unsigned)(flags & SNAP_DEDUP))
+		return (EINVAL);
+	n = hdr->n_rules;
+	nentries = (hdr->n_samples + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+
+	ep = NULL;
+	caps = NULL;
+	rngmax = 0;
+	if (rng != NULL) {
+		rngmax = *rnglenp;
+		*rnglenp = 0;
+	}
+	end = (char *)buf + len;
+	for (p = (char *)buf + sizeof(snap_header_t); p < end;
+	    p += sizeof(snap_section_t) + SNAP_ALIGN(plen)) {
+		if ((size_t)(end - p) < sizeof(snap_section_t))
+			return (EINVAL);
+		sec = (snap_section_t *)p;
+		plen = sec->len;
+		if (plen > (size_t)(end - p) - sizeof(snap_section_t))
+			return (EINVAL);
+		switch (sec->tag) {
+		case SNAP_T_ENTRIES:
+			if (plen != n * sizeof(snap_entry_t))
+				return (EINVAL);
+			ep = (snap_entry_t *)(sec + 1);
+			break;
+		case SNAP_T_CAPTURES:
+			if (plen != (size_t)n * nentries * sizeof(v_entry))
+				return (EINVAL);
+			caps = (char *)(sec + 1);
+			break;
+		case SNAP_T_RNG:
+			if (rng == NULL)
+				break;
+			if (plen > rngmax)
+				return (EINVAL);
+			memcpy(rng, sec + 1, plen);
+			*rnglenp = plen;
+			break;
+		default:
+			/* Written by a newer version; skip it. */
+			break;
+		}
+	}
+	if (ep == NULL || n == 0)
+		return (EINVAL);
+
+	if ((ids = malloc(n * sizeof(int))) == NULL)
+		return (errno);
+	for (i = 0; i < n; i++) {
+		if (ep[i].rule_id >= (unsigned)nrules) {
+			free(ids);
+			return (EINVAL);
+		}
+		ids[i] = ep[i].rule_id;
+	}
+
+	if (caps == NULL) {
+		/* Recompute the captures by running the rules in order. */
+		ret = ruleset_init(n, hdr->n_samples, ids, rules, &rs);
+		free(ids);
+		if (ret != 0)
+			return (ret);
+	} else {
+		/* Copy the saved captures straight in. */
+		free(ids);
+		rs = malloc(sizeof(ruleset_t) + n * sizeof(ruleset_entry_t));
+		if (rs == NULL)
+			return (errno);
+		rs->n_alloc = n;
+		rs->n_samples = hdr->n_samples;
+		for (i = 0; i < n; i++) {
+			rs->n_rules = i;
+			rs->rules[i].rule_id = ep[i].rule_id;
+			rs->rules[i].refs = NULL;
+			if ((ret = rule_vinit(hdr->n_samples,
+			    &rs->rules[i].captures)) != 0) {
+				ruleset_free(rs);
+				return (ret);
+			}
+#ifdef GMP
+			mpz_import(rs->rules[i].captures, nentries, -1,
+			    sizeof(v_entry), 0, 0, caps);
+			rs->rules[i].ncaptured =
+			    mpz_popcount(rs->rules[i].captures);
+#else
+			memcpy(rs->rules[i].captures, caps,
+			    nentries * sizeof(v_entry));
+			rs->rules[i].ncaptured = 0;
+			for (int j = 0; j < nentries; j++)
+				rs->rules[i].ncaptured +=
+				    count_ones(rs->rules[i].captures[j]);
+#endif
+			caps += nentries * sizeof(v_entry);
+		}
+		rs->n_rules = n;
+	}
+
+	/*
+	 * Either way, the counts must agree with what was saved, and a rule
+	 * captures only samples it satisfies.
+	 */
+	for (i = 0; i < rs->n_rules; i++)
+		if (rs->rules[i].ncaptured != (int)ep[i].ncaptured ||
+		    rule_vandcnt(rs->rules[i].captures,
+		    rules[rs->rules[i].rule_id].truthtable,
+		    nsamples) != rs->rules[i].ncaptured) {
+			ruleset_free(rs);
+			return (EINVAL);
+		}
+
+	*rsp = rs;
+	return (0);
+}
+
+/*
+ * Write a snapshot to file, atomically: we write a temporary file next to
+ * it and rename it into place, so a crash mid-write leaves the previous
+ * checkpoint intact.
+ */
+int
+snapshot_write(const char *file, void *buf, size_t len)
+{
+	FILE *fo;
+	char *tmp;
+	int ret;
+
+	if ((tmp = malloc(strlen(file) + 5)) == NULL)
+		return (errno);
+	sprintf(tmp, "%s.tmp", file);
+
+	ret = 0;
+	if ((fo = fopen(tmp, "w")) == NULL) {
+		ret = errno;
+		goto done;
+	}
+	if (fwrite(buf, 1, len, fo) != len || fflush(fo) != 0 ||
+	    fsync(fileno(fo)) != 0) {
+		ret = errno;
+		(void)fclose(fo);
+		(void)unlink(tmp);
+		goto done;
+	}
+	(void)fclose(fo);
+	if (rename(tmp, file) != 0)
+		ret = errno;
+done:
+	free(tmp);
+	return (ret);
+}
+
+/* Read a whole snapshot file into a malloc'd buffer. */
+int
+snapshot_read(const char *file, void **bufp, size_t *lenp)
+{
+	FILE *fi;
+	char *buf;
+	long len;
+	int ret;
+
+	if ((fi = fopen(file, "r")) == NULL)
+		return (errno);
+	if (fseek(fi, 0, SEEK_END) != 0 || (len = ftell(fi)) < 0 ||
+	    fseek(fi, 0, SEEK_SET) != 0) {
+		ret = errno;
+		(void)fclose(fi);
+		return (ret);
+	}
+	if ((buf = malloc(len)) == NULL) {
+		ret = errno;
+		(void)fclose(fi);
+		return (ret);
+	}
+	if (fread(buf, 1, len, fi) != (size_t)len) {
+		(void)fclose(fi);
+		free(buf);
+		return (EIO);
+	}
+	(void)fclose(fi);
+	*bufp = buf;
+	*lenp = len;
+	return (0);
+}
+
+static void *
+checkpoint_thread(void *arg)
+{
+	checkpointer_t *cp;
+	void *buf;
+	size_t len;
+	int ret;
+
+	cp = arg;
+	pthread_mutex_lock(&cp->lock);
+	for (;;) {
+		while (cp->pending == NULL && !cp->stop)
+			pthread_cond_wait(&cp->cv, &cp->lock);
+		if (cp->pending == NULL)
+			break;
+		buf = cp->pending;
+		len = cp->pending_len;
+		cp->pending = NULL;
+		pthread_mutex_unlock(&cp->lock);
+
+		ret = snapshot_write(cp->file, buf, len);
+		free(buf);
+
+		pthread_mutex_lock(&cp->lock);
+		if (ret != 0 && cp->error == 0)
+			cp->error = ret;
+	}
+	pthread_mutex_unlock(&cp->lock);
+	return (NULL);
+}
+
+/* Start a background writer for checkpoints to file. */
+int
+checkpoint_start(const char *file, checkpointer_t **cpp)
+{
+	checkpointer_t *cp;
+	int ret;
+
+	if ((cp = calloc(1, sizeof(checkpointer_t))) == NULL)
+		return (errno);
+	if ((cp->file = strdup(file)) == NULL) {
+		free(cp);
+		return (ENOMEM);
+	}
+	pthread_mutex_init(&cp->lock, NULL);
+	pthread_cond_init(&cp->cv, NULL);
+	if ((ret = pthread_create(&cp->thread,
+	    NULL, checkpoint_thread, cp)) != 0) {
+		pthread_mutex_destroy(&cp->lock);
+		pthread_cond_destroy(&cp->cv);
+		free(cp->file);
+		free(cp);
+		return (ret);
+	}
+	*cpp = cp;
+	return (0);
+}
+
+/*
+ * Queue a snapshot (from ruleset_snapshot) for writing; the checkpointer
+ * takes ownership of buf.  We never wait for the disk: if the writer is
+ * still busy with an earlier snapshot, any snapshot queued behind it is
+ * simply replaced by this newer one.
+ */
+int
+checkpoint_post(checkpointer_t *cp, void *buf, size_t len)
+{
+	void *stale;
+	int ret;
+
+	pthread_mutex_lock(&cp->lock);
+	stale = cp->pending;
+	cp->pending = buf;
+	cp->pending_len = len;
+	ret = cp->error;
+	pthread_cond_signal(&cp->cv);
+	pthread_mutex_unlock(&cp->lock);
+
+	free(stale);
+	return (ret);
+}
+
+/*
+ * Flush the last queued snapshot, stop the writer and return the first
+ * error it encountered (0 if none).
+ */
+int
+checkpoint_stop(checkpointer_t *cp)
+{
+	int ret;
+
+	pthread_mutex_lock(&cp->lock);
+	cp->stop = 1;
+	pthread_cond_signal(&cp->cv);
+	pthread_mutex_unlock(&cp->lock);
+	pthread_join(cp->thread, NULL);
+
+	ret = cp->error;
+	pthread_mutex_destroy(&cp->lock);
+	pthread_cond_destroy(&cp->cv);
+	free(cp->file);
+	free(cp);
+	return (ret);
+}
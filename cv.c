@@ -0,0 +1,513 @@
+/*
+ * Copyright 2015 President and Fellows of Harvard College.
+ * All rights reserved.
+ */
+
+/*
+ * Cross-validation and hyperparameter sweeps for the rule list sampler.
+ *
+ * We load the rules and labels once and split the samples into k folds.
+ * A fold is a pair of sample masks, its training and its test samples.
+ * The training mask is ANDed into the labels and, through the model
+ * (m->train, see sampler.c), into every count the sampler makes, so all
+ * the folds work from the same truth tables and none learns from its
+ * held-out samples.
+ *
+ * The sweep covers every combination of the -l, -e, -a and -s values
+ * (each a comma-separated list).  Minimum support (-s, a percentage)
+ * follows BRL_code.get_freqitemsets, which mines each class separately:
+ * in a fold, we keep the rules that hold for at least that percentage of
+ * the training samples of either class.  The rules kept are copied by
+ * value into an array per fold, sharing their truth tables with the
+ * loaded rules.
+ *
+ * Each (point, fold, chain) is a job for a work-stealing pool (pool.c).
+ * A job runs an exact chain and, every thin steps after burnin, adds to
+ * each held-out sample's sum the prediction of the first rule on the list
+ * that captures it: the posterior mean probability of class 1 among the
+ * training samples the rule captures (get_rule_rhs).  Averaged over the
+ * samples of all of a point's chains, that is the full posterior
+ * prediction of BRL_code.preds_full_posterior; we score it as
+ * preds_to_acc does, predicting class 1 when it is at least 0.5.  Every
+ * sample is held out once, so a point's accuracy is over all of them; we
+ * also give the spread of the accuracy across folds.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "rule.h"
+
+typedef struct fold {
+	rule_t train;			/* Samples to learn from. */
+	rule_t test;			/* Samples held out. */
+	VECTOR label;			/* Training samples in class 1. */
+	int n[2];			/* Training samples of each class. */
+	int *tests;			/* Held-out sample numbers. */
+	int n_tests;
+} fold_t;
+
+typedef struct sweep {
+	int nrules;
+	int nsamples;
+	rule_t *rules;
+	rule_t *labels;
+	int nfolds;
+	int npoints;
+	int nsupports;
+	int nchains;
+	int iters;
+	int burnin;
+	int thin;
+	unsigned seed;
+	fold_t *folds;
+	params_t *params;		/* Hyperparameters of each point. */
+	int *support;			/* Minimum support of each point. */
+	rule_t **subsets;		/* Rules kept, by support and fold. */
+	int *nsubset;
+	model_t *models;		/* By point and fold. */
+	double **preds;			/* Held-out sums, by job. */
+	int *nscored;			/* Samples summed, by job. */
+	chain_stats_t *stats;		/* By job. */
+} sweep_t;
+
+#define NJOBS(sw)	((sw)->npoints * (sw)->nfolds * (sw)->nchains)
+#define SUBSET(sw, s, f)	((s) * (sw)->nfolds + (f))
+
+int folds_init(sweep_t *);
+int subsets_init(sweep_t *, double *);
+int run_job(void *, int);
+void report(sweep_t *, double *);
+int parse_list(char *, double **, int *);
+
+int
+usage(void)
+{
+	(void)fprintf(stderr, "Usage: cv %s %s %s\n",
+	    "[-k folds] [-c chains] [-i iterations] [-b burnin] [-n thin]",
+	    "[-t threads] [-S seed] [-l lambdas] [-e etas] [-a alphas]",
+	    "[-s minsupports] rulefile labelfile");
+	return (-1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	extern char *optarg;
+	extern int optind;
+	sweep_t sw;
+	model_t *m;
+	pool_stats_t ps;
+	double *lambdas, *etas, *alphas, *supports, secs;
+	int ch, i, j, k, p, f, s, ret, nthreads, ncores, nlabels, ndims[4];
+	long nsteps;
+	char *lists[4] = { "3", "1", "1", "0" };
+
+	memset(&sw, 0, sizeof(sweep_t));
+	sw.nfolds = 5;
+	sw.nchains = 3;
+	sw.iters = 10000;
+	sw.burnin = -1;
+	sw.thin = 10;
+	sw.seed = 1;
+	if ((ncores = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncores = 1;
+	nthreads = ncores;
+	while ((ch = getopt(argc, argv, "a:b:c:e:i:k:l:n:s:S:t:")) != -1)
+		switch (ch) {
+		case 'a':
+			lists[2] = optarg;
+			break;
+		case 'b':
+			sw.burnin = atoi(optarg);
+			break;
+		case 'c':
+			sw.nchains = atoi(optarg);
+			break;
+		case 'e':
+			lists[1] = optarg;
+			break;
+		case 'i':
+			sw.iters = atoi(optarg);
+			break;
+		case 'k':
+			sw.nfolds = atoi(optarg);
+			break;
+		case 'l':
+			lists[0] = optarg;
+			break;
+		case 'n':
+			sw.thin = atoi(optarg);
+			break;
+		case 's':
+			lists[3] = optarg;
+			break;
+		case 'S':
+			sw.seed = (unsigned)atoi(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case '?':
+		default:
+			return (usage());
+		}
+	argc -= optind;
+	argv += optind;
+	if (sw.burnin < 0)
+		sw.burnin = sw.iters / 2;
+	if (argc != 2 || sw.nfolds < 2 || sw.nchains < 1 || sw.thin < 1 ||
+	    sw.burnin >= sw.iters || nthreads < 1 ||
+	    parse_list(lists[0], &lambdas, ndims) != 0 ||
+	    parse_list(lists[1], &etas, ndims + 1) != 0 ||
+	    parse_list(lists[2], &alphas, ndims + 2) != 0 ||
+	    parse_list(lists[3], &supports, ndims + 3) != 0)
+		return (usage());
+
+	if ((ret = rules_init(argv[0],
+	    &sw.nrules, &sw.nsamples, &sw.rules)) != 0) {
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(ret));
+		return (ret);
+	}
+	if ((ret = labels_init(argv[1],
+	    &nlabels, sw.nsamples, &sw.labels)) != 0 || nlabels != 2) {
+		fprintf(stderr, "%s: need two classes for %d samples\n",
+		    argv[1], sw.nsamples);
+		return (EINVAL);
+	}
+	if (sw.nfolds > sw.nsamples)
+		return (usage());
+	printf("%d rules %d samples, %d folds\n",
+	    sw.nrules, sw.nsamples, sw.nfolds);
+
+	/* The grid, with minimum support varying slowest. */
+	sw.nsupports = ndims[3];
+	sw.npoints = ndims[0] * ndims[1] * ndims[2] * ndims[3];
+	sw.params = malloc(sw.npoints * sizeof(params_t));
+	sw.support = malloc(sw.npoints * sizeof(int));
+	if (sw.params == NULL || sw.support == NULL)
+		return (ENOMEM);
+	p = 0;
+	for (s = 0; s < ndims[3]; s++)
+		for (i = 0; i < ndims[0]; i++)
+			for (j = 0; j < ndims[1]; j++)
+				for (k = 0; k < ndims[2]; k++, p++) {
+					sw.params[p].lambda = lambdas[i];
+					sw.params[p].eta = etas[j];
+					sw.params[p].alpha[0] =
+					    sw.params[p].alpha[1] = alphas[k];
+					sw.support[p] = s;
+				}
+
+	if ((ret = folds_init(&sw)) != 0 ||
+	    (ret = subsets_init(&sw, supports)) != 0)
+		return (ret);
+
+	/* A model for each point and fold (rules == NULL if too few). */
+	if ((sw.models = calloc(sw.npoints * sw.nfolds,
+	    sizeof(model_t))) == NULL)
+		return (ENOMEM);
+	for (p = 0; p < sw.npoints; p++)
+		for (f = 0; f < sw.nfolds; f++) {
+			m = sw.models + p * sw.nfolds + f;
+			s = SUBSET(&sw, sw.support[p], f);
+			if (sw.nsubset[s] < 3)
+				continue;
+			if ((ret = model_init(m, sw.subsets[s], sw.nsubset[s],
+			    sw.nsamples, sw.folds[f].label, NULL,
+			    sw.params + p)) != 0)
+				return (ret);
+			m->train = &sw.folds[f].train;
+		}
+
+	sw.preds = calloc(NJOBS(&sw), sizeof(double *));
+	sw.nscored = calloc(NJOBS(&sw), sizeof(int));
+	sw.stats = calloc(NJOBS(&sw), sizeof(chain_stats_t));
+	if (sw.preds == NULL || sw.nscored == NULL || sw.stats == NULL)
+		return (ENOMEM);
+	for (j = 0; j < NJOBS(&sw); j++) {
+		f = j / sw.nchains % sw.nfolds;
+		if ((sw.preds[j] = calloc(sw.folds[f].n_tests,
+		    sizeof(double))) == NULL)
+			return (ENOMEM);
+	}
+
+	if ((ret = pool_run(nthreads, NJOBS(&sw), run_job, &sw, &ps)) != 0) {
+		fprintf(stderr, "cv: %s\n", strerror(ret));
+		return (ret);
+	}
+
+	report(&sw, supports);
+	nsteps = 0;
+	for (j = 0; j < NJOBS(&sw); j++)
+		nsteps += sw.stats[j].nsteps;
+	secs = ps.wall > 0 ? ps.wall : 1e-6;
+	printf("%d jobs (%d points x %d folds x %d chains): %ld steps in "
+	    "%.2f sec, %.0f steps/sec, %.2f jobs/sec\n", NJOBS(&sw),
+	    sw.npoints, sw.nfolds, sw.nchains, nsteps, ps.wall,
+	    nsteps / secs, NJOBS(&sw) / secs);
+	printf("%d threads on %d cores: threads %.1f%% busy, cores %.1f%% "
+	    "used, %ld steals\n", ps.n_threads, ncores,
+	    100 * ps.busy / (ps.n_threads * secs),
+	    100 * ps.cpu / (ncores * secs), ps.nstolen);
+	return (0);
+}
+
+/*
+ * Deal the samples out to the folds at random and build each fold's
+ * masks and labels.
+ */
+int
+folds_init(sweep_t *sw)
+{
+	fold_t *f;
+	rng_t rng;
+	int i, j, k, t, nset, *order;
+
+	if ((sw->folds = calloc(sw->nfolds, sizeof(fold_t))) == NULL ||
+	    (order = malloc(sw->nsamples * sizeof(int))) == NULL)
+		return (ENOMEM);
+	rng_seed(&rng, sw->seed);
+	for (i = 0; i < sw->nsamples; i++)
+		order[i] = i;
+	for (i = sw->nsamples - 1; i > 0; i--) {
+		j = rng_int(&rng, i + 1);
+		t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+
+	for (k = 0; k < sw->nfolds; k++) {
+		f = sw->folds + k;
+		f->n_tests = (sw->nsamples - k + sw->nfolds - 1) / sw->nfolds;
+		if ((f->tests = malloc(f->n_tests * sizeof(int))) == NULL ||
+		    rule_vinit(sw->nsamples, &f->train.truthtable) != 0 ||
+		    rule_vinit(sw->nsamples, &f->test.truthtable) != 0 ||
+		    rule_vinit(sw->nsamples, &f->label) != 0)
+			return (ENOMEM);
+		f->train.features = "train";
+		f->test.features = "test";
+		for (i = k, j = 0; i < sw->nsamples; i += sw->nfolds, j++) {
+			f->tests[j] = order[i];
+			rule_setbit(f->test.truthtable, sw->nsamples, order[i]);
+		}
+		for (i = 0; i < sw->nsamples; i++)
+			if (i % sw->nfolds != k)
+				rule_setbit(f->train.truthtable,
+				    sw->nsamples, order[i]);
+		f->test.support = f->n_tests;
+		f->train.support = sw->nsamples - f->n_tests;
+		rule_vand(f->label, sw->labels[1].truthtable,
+		    f->train.truthtable, sw->nsamples, &nset);
+		f->n[1] = nset;
+		f->n[0] = f->train.support - nset;
+	}
+	free(order);
+	return (0);
+}
+
+/*
+ * For each minimum support and fold, the rules whose training support in
+ * either class reaches it, with the default rule first.  A rule's support
+ * is the same for every point, so we count it once per fold.
+ */
+int
+subsets_init(sweep_t *sw, double *supports)
+{
+	fold_t *f;
+	rule_t *sub;
+	int i, k, s, n, *sup1, *sup0;
+
+	n = sw->nsupports * sw->nfolds;
+	sw->subsets = calloc(n, sizeof(rule_t *));
+	sw->nsubset = calloc(n, sizeof(int));
+	sup0 = malloc(sw->nrules * sizeof(int));
+	sup1 = malloc(sw->nrules * sizeof(int));
+	if (sw->subsets == NULL || sw->nsubset == NULL ||
+	    sup0 == NULL || sup1 == NULL)
+		return (ENOMEM);
+	for (k = 0; k < sw->nfolds; k++) {
+		f = sw->folds + k;
+		for (i = 1; i < sw->nrules; i++) {
+			sup1[i] = rule_vandcnt(sw->rules[i].truthtable,
+			    f->label, sw->nsamples);
+			sup0[i] = rule_vandcnt(sw->rules[i].truthtable,
+			    f->train.truthtable, sw->nsamples) - sup1[i];
+		}
+		for (s = 0; s < sw->nsupports; s++) {
+			if ((sub = malloc(sw->nrules * sizeof(rule_t))) == NULL)
+				return (ENOMEM);
+			sub[0] = sw->rules[0];
+			n = 1;
+			for (i = 1; i < sw->nrules; i++)
+				if (sup0[i] >= supports[s] / 100 * f->n[0] ||
+				    sup1[i] >= supports[s] / 100 * f->n[1])
+					sub[n++] = sw->rules[i];
+			sw->subsets[SUBSET(sw, s, k)] = sub;
+			sw->nsubset[SUBSET(sw, s, k)] = n;
+		}
+	}
+	free(sup0);
+	free(sup1);
+	return (0);
+}
+
+/*
+ * Job j: chain j % nchains of fold j / nchains % nfolds at point
+ * j / (nchains * nfolds).
+ */
+int
+run_job(void *arg, int j)
+{
+	sweep_t *sw;
+	model_t *m;
+	fold_t *f;
+	chain_t c;
+	double *theta, *preds, a0, a1;
+	int i, k, it, step, ret;
+
+	sw = arg;
+	f = sw->folds + j / sw->nchains % sw->nfolds;
+	m = sw->models + j / sw->nchains;
+	if (m->rules == NULL)
+		return (0);
+	if ((theta = malloc(m->nrules * sizeof(double))) == NULL)
+		return (ENOMEM);
+	if ((ret = chain_init(&c, m, 0, sw->seed + j)) != 0) {
+		free(theta);
+		return (ret);
+	}
+	a0 = m->params.alpha[0];
+	a1 = m->params.alpha[1];
+	preds = sw->preds[j];
+	for (it = 0; it < sw->iters; it++) {
+		if ((step = chain_step(&c)) < 0) {
+			ret = -step;
+			break;
+		}
+		if (it < sw->burnin || (it - sw->burnin) % sw->thin != 0)
+			continue;
+		for (i = 0; i < c.n_ids; i++)
+			theta[i] = (c.counts[2 * i + 1] + a1) /
+			    (c.counts[2 * i] + a0 + a1);
+		/* The default rule captures whatever is left. */
+		for (k = 0; k < f->n_tests; k++) {
+			for (i = 0; !rule_isset(c.rs->rules[i].captures,
+			    sw->nsamples, f->tests[k]); i++)
+				continue;
+			preds[k] += theta[i];
+		}
+		sw->nscored[j]++;
+	}
+	sw->stats[j] = c.stats;
+	chain_free(&c);
+	free(theta);
+	return (ret);
+}
+
+/*
+ * Print each point's held-out accuracy, over all samples and across the
+ * folds, and the average number of rules its folds kept.
+ */
+void
+report(sweep_t *sw, double *supports)
+{
+	fold_t *f;
+	double acc, sum, sumsq, prob, best, rules, acc_f[sw->nfolds];
+	long nsteps, naccepted;
+	int c, i, j, k, p, n, ncorrect, ncorrect_f, missing, bestp, y;
+
+	printf("%8s %8s %8s %8s %8s %9s %9s %9s\n", "lambda", "eta", "alpha",
+	    "minsup", "rules", "accepted", "accuracy", "fold sd");
+	best = -1;
+	bestp = -1;
+	for (p = 0; p < sw->npoints; p++) {
+		ncorrect = missing = 0;
+		rules = 0;
+		nsteps = naccepted = 0;
+		for (k = 0; k < sw->nfolds; k++) {
+			f = sw->folds + k;
+			j = (p * sw->nfolds + k) * sw->nchains;
+			rules += sw->nsubset[SUBSET(sw, sw->support[p], k)];
+			n = 0;
+			for (c = 0; c < sw->nchains; c++) {
+				n += sw->nscored[j + c];
+				nsteps += sw->stats[j + c].nsteps;
+				naccepted += sw->stats[j + c].naccepted;
+			}
+			if (n == 0)
+				missing = 1;
+			ncorrect_f = 0;
+			for (i = 0; n != 0 && i < f->n_tests; i++) {
+				prob = 0;
+				for (c = 0; c < sw->nchains; c++)
+					prob += sw->preds[j + c][i];
+				prob /= n;
+				y = rule_isset(sw->labels[1].truthtable,
+				    sw->nsamples, f->tests[i]);
+				if ((prob >= 0.5) == (y != 0))
+					ncorrect_f++;
+			}
+			ncorrect += ncorrect_f;
+			acc_f[k] = (double)ncorrect_f / f->n_tests;
+		}
+		printf("%8g %8g %8g %8g %8.1f ", sw->params[p].lambda,
+		    sw->params[p].eta, sw->params[p].alpha[0],
+		    supports[sw->support[p]], rules / sw->nfolds);
+		/* Some fold kept fewer than two rules. */
+		if (missing) {
+			printf(" too few rules\n");
+			continue;
+		}
+		acc = (double)ncorrect / sw->nsamples;
+		sum = sumsq = 0;
+		for (k = 0; k < sw->nfolds; k++) {
+			sum += acc_f[k];
+			sumsq += acc_f[k] * acc_f[k];
+		}
+		sum /= sw->nfolds;
+		sumsq = sumsq / sw->nfolds - sum * sum;
+		printf("%8.1f%% %9.4f %9.4f\n", 100.0 * naccepted / nsteps,
+		    acc, sqrt(sumsq > 0 ? sumsq : 0));
+		if (acc > best) {
+			best = acc;
+			bestp = p;
+		}
+	}
+	if (bestp >= 0)
+		printf("Best: lambda %g eta %g alpha %g minsup %g, "
+		    "accuracy %.4f\n", sw->params[bestp].lambda,
+		    sw->params[bestp].eta, sw->params[bestp].alpha[0],
+		    supports[sw->support[bestp]], best);
+}
+
+/* Parse a comma-separated list of numbers. */
+int
+parse_list(char *s, double **retv, int *retn)
+{
+	double *v;
+	char *p, *end;
+	int n;
+
+	for (n = 1, p = s; *p != '\0'; p++)
+		if (*p == ',')
+			n++;
+	if ((v = malloc(n * sizeof(double))) == NULL)
+		return (ENOMEM);
+	for (n = 0, p = s;; p = end + 1) {
+		v[n++] = strtod(p, &end);
+		if (end == p || (*end != ',' && *end != '\0')) {
+			free(v);
+			return (EINVAL);
+		}
+		if (*end == '\0')
+			break;
+	}
+	*retv = v;
+	*retn = n;
+	return (0);
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright 2015 President and Fellows of Harvard College.
+ * All rights reserved.
+ */
+
+/*
+ * Collapsing rules with identical truth tables.
+ *
+ * Mined itemsets are often equivalent on the training data: the same
+ * itemset mined for each class, or an attribute that implies another.
+ * Such rules are interchangeable in a rule list, so rules_dedup replaces
+ * each set of them by a single rule, the equivalence class, with one truth
+ * table.  The representative of a class is its member with the fewest
+ * attributes (the first such, in file order).  The default rule is never
+ * merged with anything.
+ *
+ * The prior on rule lists depends on the cardinality of each rule, so for
+ * each class we record how many of its members have each cardinality;
+ * model_init takes these multiplicities.
+ *
+ * Truth tables are hashed a vector entry at a time (with VWORD, so both
+ * representations hash alike) into an open-addressed table of classes.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rule.h"
+
+static uint64_t
+vector_hash(VECTOR v, int nwords)
+{
+	uint64_t h;
+	int w;
+
+	h = 0xcbf29ce484222325ULL;
+	for (w = 0; w < nwords; w++) {
+		h ^= VWORD(v, w);
+		h *= 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 29;
+	}
+	return (h);
+}
+
+static int
+vector_equal(VECTOR a, VECTOR b, int nwords)
+{
+	int w;
+
+	for (w = 0; w < nwords; w++)
+		if (VWORD(a, w) != VWORD(b, w))
+			return (0);
+	return (1);
+}
+
+/*
+ * Collapse the nrules rules into equivalence classes, in place: on
+ * return, rules[0..*nrules-1] are the classes, rule 0 is still the default
+ * and *ddp describes the classes.  Duplicate truth tables are freed.
+ */
+int
+rules_dedup(rule_t *rules, int *nrules, int nsamples, dedup_t **ddp)
+{
+	dedup_t *dd;
+	uint64_t *hashes, h;
+	int *table, *shrink, i, c, n, nwords, tsize, slot, ret;
+
+	n = *nrules;
+	nwords = (nsamples + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+	for (tsize = 16; tsize < 2 * n; tsize <<= 1)
+		continue;
+
+	ret = ENOMEM;
+	hashes = malloc(n * sizeof(uint64_t));
+	table = malloc(tsize * sizeof(int));
+	if ((dd = calloc(1, sizeof(dedup_t))) == NULL || hashes == NULL ||
+	    table == NULL)
+		goto err;
+	dd->n_orig = n;
+	dd->class_of = malloc(n * sizeof(int));
+	dd->features = malloc(n * sizeof(char *));
+	if (dd->class_of == NULL || dd->features == NULL)
+		goto err;
+	for (i = 0; i < n; i++) {
+		dd->features[i] = rules[i].features;
+		if (rules[i].cardinality > dd->maxcard)
+			dd->maxcard = rules[i].cardinality;
+	}
+	/* Room for a class per rule; we give back the rest at the end. */
+	if ((dd->mult = calloc(n * (dd->maxcard + 1), sizeof(int))) == NULL)
+		goto err;
+	for (i = 0; i < tsize; i++)
+		table[i] = -1;
+
+	/* The default rule is class 0 and stays out of the table. */
+	dd->class_of[0] = 0;
+	dd->n_classes = 1;
+	for (i = 1; i < n; i++) {
+		h = vector_hash(rules[i].truthtable, nwords);
+		for (slot = h & (tsize - 1);
+		    (c = table[slot]) != -1; slot = (slot + 1) & (tsize - 1))
+			if (hashes[c] == h && rules[c].support ==
+			    rules[i].support && vector_equal(rules[c].truthtable,
+			    rules[i].truthtable, nwords))
+				break;
+		if (c == -1) {
+			/* A new class; c <= i, so this never clobbers. */
+			c = table[slot] = dd->n_classes++;
+			hashes[c] = h;
+			rules[c] = rules[i];
+		} else {
+			rule_vdelete(rules[i].truthtable);
+			if (rules[i].cardinality < rules[c].cardinality) {
+				rules[c].features = rules[i].features;
+				rules[c].cardinality = rules[i].cardinality;
+			}
+		}
+		/* Rules[i] itself is intact until a later class lands on it. */
+		dd->class_of[i] = c;
+		DEDUP_MULT(dd, c, rules[i].cardinality)++;
+	}
+	DEDUP_MULT(dd, 0, 0) = 1;
+
+	shrink = realloc(dd->mult,
+	    dd->n_classes * (dd->maxcard + 1) * sizeof(int));
+	if (shrink != NULL)
+		dd->mult = shrink;
+	*nrules = dd->n_classes;
+	*ddp = dd;
+	free(hashes);
+	free(table);
+	return (0);
+
+err:	if (dd != NULL)
+		dedup_free(dd);
+	free(hashes);
+	free(table);
+	return (ret);
+}
+
+/*
+ * The features strings belong to the rules they came from; we free only
+ * our own arrays.
+ */
+void
+dedup_free(dedup_t *dd)
+{
+	free(dd->class_of);
+	free(dd->features);
+	free(dd->mult);
+	free(dd);
+}
+
+/* Number of rules in class c. */
+int
+dedup_nmembers(dedup_t *dd, int c)
+{
+	int k, n;
+
+	n = 0;
+	for (k = 0; k <= dd->maxcard; k++)
+		n += DEDUP_MULT(dd, c, k);
+	return (n);
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright 2015 President and Fellows of Harvard College.
+ * All rights reserved.
+ */
+
+/*
+ * Vector kernels specialized for one vector size.
+ *
+ * The rule_v* routines work for any number of samples, so each call
+ * works out the number of entries and runs a loop the compiler knows
+ * nothing about.  But a data set's size is fixed once it is loaded, so
+ * for the sizes we use in production we build a copy of each kernel
+ * with the number of entries a constant: the compiler can then unroll
+ * it, keep it in registers, and vectorize it, with no tail to handle
+ * (the bits past the last sample are always 0).  The copies are counted
+ * with a popcount written in shifts and masks, which the compiler can
+ * vectorize too, rather than count_ones's table.
+ *
+ * KERNEL_WORDS lists the sizes, in entries, as KERNEL(n) for each n; the
+ * Makefile sets it from its own KERNEL_WORDS.  rules_init (and anything
+ * else that settles the number of samples) calls vkernel_select, and the
+ * rule_v* routines hand off to the chosen kernels whenever their vectors
+ * are the chosen size.  With GMP the vectors are mpz_t's, whose size
+ * varies, so there is nothing to specialize; "make fast" builds without
+ * GMP and with optimization.
+ *
+ * The kernels take their vectors to be KERNEL_ALIGN-aligned.  Vectors
+ * come from malloc, so vkernel_select checks once that malloc aligns
+ * that strictly, and rule_vinit asserts it of each vector it makes; the
+ * kernels themselves check nothing.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "rule.h"
+
+#ifndef KERNEL_WORDS
+#define KERNEL_WORDS	KERNEL(28) KERNEL(81)	/* As in the Makefile. */
+#endif
+
+#ifdef __GNUC__
+#define INLINE		inline __attribute__((always_inline))
+#define ASSUME_ALIGNED(p) \
+	((p) = __builtin_assume_aligned((p), KERNEL_ALIGN))
+#else
+#define INLINE		inline
+#define ASSUME_ALIGNED(p)
+#endif
+
+vkernel_t *vkernel;
+
+#ifndef GMP
+static INLINE int
+ones(v_entry v)
+{
+	v = v - ((v >> 1) & 0x5555555555555555UL);
+	v = (v & 0x3333333333333333UL) + ((v >> 2) & 0x3333333333333333UL);
+	v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fUL;
+	return ((int)((v * 0x0101010101010101UL) >> 56));
+}
+
+/*
+ * The bodies, for a constant n.  Each is inlined into the kernels for
+ * each size, where n is a literal.
+ */
+#define OP_AND		0
+#define OP_OR		1
+#define OP_ANDNOT	2
+
+static INLINE int
+kernel_op(v_entry *d, v_entry *a, v_entry *b, int n, int op)
+{
+	v_entry v;
+	int i, count;
+
+	ASSUME_ALIGNED(d);
+	ASSUME_ALIGNED(a);
+	ASSUME_ALIGNED(b);
+	count = 0;
+	for (i = 0; i < n; i++) {
+		v = op == OP_AND ? a[i] & b[i] :
+		    op == OP_OR ? a[i] | b[i] : a[i] & ~b[i];
+		d[i] = v;
+		count += ones(v);
+	}
+	return (count);
+}
+
+static INLINE int
+kernel_andcnt(v_entry *a, v_entry *b, int n)
+{
+	int i, count;
+
+	ASSUME_ALIGNED(a);
+	ASSUME_ALIGNED(b);
+	count = 0;
+	for (i = 0; i < n; i++)
+		count += ones(a[i] & b[i]);
+	return (count);
+}
+
+#define KERNEL(n)							\
+static int								\
+vand_##n(v_entry *d, v_entry *a, v_entry *b)				\
+{									\
+	return (kernel_op(d, a, b, n, OP_AND));				\
+}									\
+static int								\
+vor_##n(v_entry *d, v_entry *a, v_entry *b)				\
+{									\
+	return (kernel_op(d, a, b, n, OP_OR));				\
+}									\
+static int								\
+vandnot_##n(v_entry *d, v_entry *a, v_entry *b)				\
+{									\
+	return (kernel_op(d, a, b, n, OP_ANDNOT));			\
+}									\
+static int								\
+vandcnt_##n(v_entry *a, v_entry *b)					\
+{									\
+	return (kernel_andcnt(a, b, n));				\
+}
+KERNEL_WORDS
+#undef KERNEL
+
+#define KERNEL(n)	{ n, vand_##n, vor_##n, vandnot_##n, vandcnt_##n },
+static vkernel_t kernels[] = {
+	KERNEL_WORDS
+	{ 0 }
+};
+#undef KERNEL
+#endif
+
+/*
+ * Choose the kernels for vectors of nsamples bits, if we have them and
+ * malloc'd vectors are aligned as they need, and return 1; otherwise the
+ * rule_v* routines use their own loops and we return 0.
+ */
+int
+vkernel_select(int nsamples)
+{
+#ifndef GMP
+	vkernel_t *k;
+	int nentries;
+
+	vkernel = NULL;
+	if (_Alignof(max_align_t) < KERNEL_ALIGN)
+		return (0);
+	nentries = (nsamples + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+	for (k = kernels; k->n_entries != 0; k++)
+		if (k->n_entries == nentries) {
+			vkernel = k;
+			return (1);
+		}
+#else
+	(void)nsamples;
+	vkernel = NULL;
+#endif
+	return (0);
+}
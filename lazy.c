@@ -0,0 +1,374 @@
+/*
+ * Copyright 2015 President and Fellows of Harvard College.
+ * All rights reserved.
+ */
+
+/*
+ * Lazy rulesets.
+ *
+ * A ruleset_t keeps a full captures vector for every entry, which is the
+ * bulk of its memory.  A lazyset_t keeps only the counts: for each entry,
+ * how many samples it captures and how many of those are in class 1.
+ * Captures vectors are computed when someone asks for them.
+ *
+ * The captures of the rule at position p are its truth table less the
+ * samples caught by positions 0..p-1, and those are just the union of the
+ * truth tables at positions 0..p-1.  Every interval positions we keep
+ * that union as a checkpoint, so materializing a position, or recounting
+ * after an add or delete, starts from the nearest checkpoint and ORs in
+ * at most interval - 1 truth tables before it gets to work.  Larger
+ * intervals cost less memory and more time.
+ *
+ * Recently materialized positions are kept in a small LRU, along with the
+ * union of the truth tables before them, so walking down a list or going
+ * back to the same entry is cheap.  Adding or deleting at position p
+ * throws away the cached positions from p on.
+ *
+ * Checkpoints and cached unions are arrays of v_entry in both
+ * representations; the truth tables are read a word at a time with VWORD.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rule.h"
+
+struct lazy_slot {
+	int pos;			/* Position held, or -1. */
+	unsigned long stamp;		/* Last use, for LRU replacement. */
+	v_entry *caught;		/* Union of truth tables before pos. */
+	ruleset_entry_t entry;		/* The materialized entry. */
+};
+
+static v_entry *
+lazy_words(int nwords)
+{
+	return (calloc(nwords > 0 ? nwords : 1, sizeof(v_entry)));
+}
+
+/*
+ * Make sure we have a checkpoint for every interval positions in a list
+ * of n rules (there is none for position 0: nothing is caught before it).
+ */
+static int
+lazy_ckpt_resize(lazyset_t *ls, int n)
+{
+	int i, need;
+	v_entry **expand;
+
+	need = n > 0 ? (n - 1) / ls->interval : 0;
+	if (need > ls->n_ckpt) {
+		expand = realloc(ls->ckpt, need * sizeof(v_entry *));
+		if (expand == NULL)
+			return (errno);
+		ls->ckpt = expand;
+		for (i = ls->n_ckpt; i < need; i++)
+			if ((ls->ckpt[i] = lazy_words(ls->n_words)) == NULL) {
+				ls->n_ckpt = i;
+				return (ENOMEM);
+			}
+	} else
+		for (i = need; i < ls->n_ckpt; i++)
+			free(ls->ckpt[i]);
+	ls->n_ckpt = need;
+	return (0);
+}
+
+/* The checkpoint covering position p, or NULL if it is in the first run. */
+static v_entry *
+lazy_ckpt(lazyset_t *ls, int p)
+{
+	return (p < ls->interval ? NULL : ls->ckpt[p / ls->interval - 1]);
+}
+
+/*
+ * Recompute the counts of positions from..n_rules-1, and the checkpoints
+ * past from, in one pass over the vectors.
+ */
+static void
+lazy_recount(lazyset_t *ls, int from)
+{
+	int i, w, start;
+	v_entry caught, c, t, lab, *ck;
+	lazyset_entry_t *le;
+
+	/* Cached positions from here on are stale. */
+	for (i = 0; i < ls->n_lru; i++)
+		if (ls->lru[i].pos >= from) {
+			ls->lru[i].pos = -1;
+			ls->lru[i].stamp = 0;
+		}
+	if (from >= ls->n_rules)
+		return;
+
+	for (i = from; i < ls->n_rules; i++)
+		ls->entries[i].ncaptured = ls->entries[i].ncaptured1 = 0;
+
+	start = from - from % ls->interval;
+	ck = lazy_ckpt(ls, from);
+	for (w = 0; w < ls->n_words; w++) {
+		caught = ck == NULL ? 0 : ck[w];
+		lab = ls->label == NULL ? 0 : VWORD(ls->label->truthtable, w);
+		for (i = start; i < ls->n_rules; i++) {
+			if (i > start && i % ls->interval == 0)
+				ls->ckpt[i / ls->interval - 1][w] = caught;
+			le = ls->entries + i;
+			t = VWORD(ls->rules[le->rule_id].truthtable, w);
+			if (i >= from) {
+				c = t & ~caught;
+				le->ncaptured += count_ones(c);
+				le->ncaptured1 += count_ones(c & lab);
+			}
+			caught |= t;
+		}
+	}
+}
+
+/*
+ * Create a lazy ruleset from an array of rule ids.  Label is the rule
+ * whose truth table marks the samples in class 1, or NULL if the
+ * per-class counts are not wanted.  We checkpoint every interval
+ * positions and keep up to nlru materialized entries.
+ */
+int
+lazyset_init(int nrules, int nsamples, int *idarray, rule_t *rules,
+    rule_t *label, int interval, int nlru, lazyset_t **retls)
+{
+	int i, ret;
+	lazyset_t *ls;
+
+	if (interval < 1 || nlru < 1)
+		return (EINVAL);
+	if ((ls = calloc(1, sizeof(lazyset_t))) == NULL)
+		return (errno);
+	ls->n_samples = nsamples;
+	ls->n_words = (nsamples + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+	ls->rules = rules;
+	ls->label = label;
+	ls->interval = interval;
+	ls->n_lru = nlru;
+
+	ret = ENOMEM;
+	ls->n_alloc = nrules;
+	if ((ls->entries = calloc(nrules, sizeof(lazyset_entry_t))) == NULL ||
+	    (ls->lru = calloc(nlru, sizeof(struct lazy_slot))) == NULL)
+		goto err;
+	for (i = 0; i < nlru; i++) {
+		ls->lru[i].pos = -1;
+		if ((ls->lru[i].caught = lazy_words(ls->n_words)) == NULL)
+			goto err;
+#ifdef GMP
+		mpz_init(ls->lru[i].entry.captures);
+		ls->lru_init++;
+	}
+	if ((ls->scratch = lazy_words(ls->n_words)) == NULL)
+		goto err;
+#else
+		if ((ls->lru[i].entry.captures =
+		    lazy_words(ls->n_words)) == NULL)
+			goto err;
+		ls->lru_init++;
+	}
+#endif
+	if ((ret = lazy_ckpt_resize(ls, nrules)) != 0)
+		goto err;
+
+	ls->n_rules = nrules;
+	for (i = 0; i < nrules; i++)
+		ls->entries[i].rule_id = idarray[i];
+	lazy_recount(ls, 0);
+	*retls = ls;
+	return (0);
+
+err:	lazyset_free(ls);
+	*retls = NULL;
+	return (ret);
+}
+
+void
+lazyset_free(lazyset_t *ls)
+{
+	int i;
+
+	for (i = 0; i < ls->n_ckpt; i++)
+		free(ls->ckpt[i]);
+	free(ls->ckpt);
+	if (ls->lru != NULL)
+		for (i = 0; i < ls->n_lru; i++) {
+			free(ls->lru[i].caught);
+			if (i < ls->lru_init)
+				rule_vdelete(ls->lru[i].entry.captures);
+		}
+	free(ls->lru);
+#ifdef GMP
+	free(ls->scratch);
+#endif
+	free(ls->entries);
+	free(ls);
+}
+
+/*
+ * Add the rule newrule at position ndx; everything from ndx on moves down.
+ */
+int
+lazyset_add(lazyset_t *ls, int newrule, int ndx)
+{
+	int ret;
+	lazyset_entry_t *expand;
+
+	assert(ndx <= ls->n_rules);
+	if (ls->n_rules == ls->n_alloc) {
+		expand = realloc(ls->entries,
+		    (ls->n_alloc + 1) * sizeof(lazyset_entry_t));
+		if (expand == NULL)
+			return (errno);
+		ls->entries = expand;
+		ls->n_alloc++;
+	}
+	if ((ret = lazy_ckpt_resize(ls, ls->n_rules + 1)) != 0)
+		return (ret);
+	memmove(ls->entries + ndx + 1, ls->entries + ndx,
+	    (ls->n_rules - ndx) * sizeof(lazyset_entry_t));
+	ls->entries[ndx].rule_id = newrule;
+	ls->n_rules++;
+	lazy_recount(ls, ndx);
+	return (0);
+}
+
+/*
+ * Remove the rule at position ndx.
+ */
+void
+lazyset_delete(lazyset_t *ls, int ndx)
+{
+	assert(ndx < ls->n_rules);
+	memmove(ls->entries + ndx, ls->entries + ndx + 1,
+	    (ls->n_rules - ndx - 1) * sizeof(lazyset_entry_t));
+	ls->n_rules--;
+	/* Shrinking can't fail. */
+	(void)lazy_ckpt_resize(ls, ls->n_rules);
+	lazy_recount(ls, ndx);
+}
+
+/*
+ * Return the entry at position ndx with its captures vector filled in.
+ * The entry belongs to the lazyset: it is good until the lazyset changes
+ * or n_lru more entries have been materialized.
+ */
+ruleset_entry_t *
+lazyset_entry(lazyset_t *ls, int ndx)
+{
+	int i, p, w, start;
+	v_entry *caught, *from;
+	struct lazy_slot *s, *victim;
+
+	assert(ndx < ls->n_rules);
+	ls->clock++;
+
+	/*
+	 * Look for the position itself, else for the nearest cached
+	 * position before it that is no further back than its checkpoint.
+	 */
+	start = ndx - ndx % ls->interval;
+	from = lazy_ckpt(ls, ndx);
+	victim = ls->lru;
+	for (i = 0; i < ls->n_lru; i++) {
+		s = ls->lru + i;
+		if (s->pos == ndx) {
+			s->stamp = ls->clock;
+			ls->nhits++;
+			return (&s->entry);
+		}
+		if (s->pos >= start && s->pos < ndx) {
+			start = s->pos;
+			from = s->caught;
+		}
+		if (s->stamp < victim->stamp)
+			victim = s;
+	}
+	ls->nmisses++;
+
+	/* The victim may be where we start from; it is safe to reuse. */
+	caught = victim->caught;
+	for (w = 0; w < ls->n_words; w++) {
+		caught[w] = from == NULL ? 0 : from[w];
+		for (p = start; p < ndx; p++)
+			caught[w] |= VWORD(ls->rules[
+			    ls->entries[p].rule_id].truthtable, w);
+	}
+	victim->pos = ndx;
+	victim->stamp = ls->clock;
+	victim->entry.rule_id = ls->entries[ndx].rule_id;
+	victim->entry.ncaptured = ls->entries[ndx].ncaptured;
+#ifdef GMP
+	for (w = 0; w < ls->n_words; w++)
+		ls->scratch[w] = VWORD(ls->rules[
+		    ls->entries[ndx].rule_id].truthtable, w) & ~caught[w];
+	mpz_import(victim->entry.captures,
+	    ls->n_words, -1, sizeof(v_entry), 0, 0, ls->scratch);
+#else
+	for (w = 0; w < ls->n_words; w++)
+		victim->entry.captures[w] = ls->rules[
+		    ls->entries[ndx].rule_id].truthtable[w] & ~caught[w];
+#endif
+	return (&victim->entry);
+}
+
+/*
+ * Bytes allocated for a vector of nsamples bits.
+ */
+static size_t
+vector_bytes(VECTOR v, int nsamples)
+{
+#ifdef GMP
+	(void)nsamples;
+	return (mpz_size(v) * sizeof(mp_limb_t));
+#else
+	(void)v;
+	return ((nsamples + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY *
+	    sizeof(v_entry));
+#endif
+}
+
+/*
+ * Memory accounting: the bytes a ruleset or lazyset holds, not counting
+ * the rules themselves, which they share.  (With GMP, we count the limbs
+ * in use, not the limbs allocated.)  A captures vector shared by clones is
+ * split evenly among them, so the bytes of a ruleset and all its clones
+ * add up to what they hold together.
+ */
+size_t
+ruleset_bytes(ruleset_t *rs)
+{
+	size_t bytes;
+	int i;
+
+	bytes = sizeof(ruleset_t) + rs->n_alloc * sizeof(ruleset_entry_t);
+	for (i = 0; i < rs->n_rules; i++)
+		if (rs->rules[i].refs == NULL)
+			bytes += vector_bytes(rs->rules[i].captures,
+			    rs->n_samples);
+		else
+			bytes += (vector_bytes(rs->rules[i].captures,
+			    rs->n_samples) + sizeof(int)) / *rs->rules[i].refs;
+	return (bytes);
+}
+
+size_t
+lazyset_bytes(lazyset_t *ls)
+{
+	size_t bytes, wbytes;
+	int i;
+
+	wbytes = ls->n_words * sizeof(v_entry);
+	bytes = sizeof(lazyset_t) + ls->n_alloc * sizeof(lazyset_entry_t) +
+	    ls->n_ckpt * (sizeof(v_entry *) + wbytes) +
+	    ls->n_lru * (sizeof(struct lazy_slot) + wbytes);
+	for (i = 0; i < ls->n_lru; i++)
+		bytes += vector_bytes(ls->lru[i].entry.captures, ls->n_samples);
+#ifdef GMP
+	bytes += wbytes;
+#endif
+	return (bytes);
+}
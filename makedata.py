@@ -51,10 +51,12 @@ def get_freqitemsets(fname, minsupport=10, maxlhs = 2):
 	# Now for each rule we want to write out a line of output
 	# containing the rule and a bit for each training sample
 	# indicating if the sample satisfies the rule or not.
+	# The rule's attributes are separated by commas, so that the
+	# C code can evaluate the rule on new samples.
 
 	for lhs in itemsets :
 		print lhs
-		fout.write(''.join(lhs) + '\t')
+		fout.write(','.join(lhs) + '\t')
     		for (j, attrs) in enumerate(data) :
 			if set(lhs).issubset(attrs) :
 				fout.write('1 ')
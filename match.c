@@ -0,0 +1,270 @@
+/*
+ * Copyright 2015 President and Fellows of Harvard College.
+ * All rights reserved.
+ */
+
+/*
+ * Compiled rule lists.
+ *
+ * To classify new data, makedata.py (and rule_matches) test every rule
+ * against a row by comparing attribute strings.  A matcher_t is a rule
+ * list compiled for this: the attributes mentioned by the list's rules
+ * are interned as small integers, each rule becomes a bitmask of its
+ * attributes, and a row becomes a bitmask of the attributes it has.  A
+ * rule holds for a row when the row has every bit of the rule's mask, so
+ * classifying a row is a scan down the list for the first such rule.  The
+ * default rule, last on the list, has an empty mask and always holds.
+ *
+ * Attributes that no rule mentions cannot affect the outcome, so they are
+ * simply ignored when encoding a row.  A list rarely mentions more than
+ * BITS_PER_ENTRY attributes; in that case a row is one v_entry and there
+ * is a fast path for it.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rule.h"
+
+static uint32_t
+name_hash(const char *s, size_t len)
+{
+	uint32_t h;
+
+	for (h = 2166136261U; len > 0; len--)
+		h = (h ^ (unsigned char)*s++) * 16777619U;
+	return (h);
+}
+
+/*
+ * Look up the attribute s[0..len-1]; if it isn't there and add is set,
+ * give it the next id.  Returns the id, -1 if not found, or -2 if we ran
+ * out of memory.
+ */
+static int
+intern(matcher_t *m, const char *s, size_t len, int add)
+{
+	uint32_t slot;
+	char *name, **expand;
+	int id, *slots, i, nslots;
+
+	for (slot = name_hash(s, len) & (m->n_slots - 1);
+	    (id = m->slots[slot]) != -1; slot = (slot + 1) & (m->n_slots - 1))
+		if (strncmp(m->names[id], s, len) == 0 &&
+		    m->names[id][len] == '\0')
+			return (id);
+	if (!add)
+		return (-1);
+
+	if ((name = malloc(len + 1)) == NULL)
+		return (-2);
+	memcpy(name, s, len);
+	name[len] = '\0';
+	if ((expand = realloc(m->names,
+	    (m->n_attrs + 1) * sizeof(char *))) == NULL) {
+		free(name);
+		return (-2);
+	}
+	m->names = expand;
+	id = m->n_attrs++;
+	m->names[id] = name;
+	m->slots[slot] = id;
+
+	/* Keep the table at most half full. */
+	if (2 * m->n_attrs > m->n_slots) {
+		nslots = 2 * m->n_slots;
+		if ((slots = malloc(nslots * sizeof(int))) == NULL)
+			return (-2);
+		for (i = 0; i < nslots; i++)
+			slots[i] = -1;
+		for (i = 0; i < m->n_attrs; i++) {
+			slot = name_hash(m->names[i],
+			    strlen(m->names[i])) & (nslots - 1);
+			while (slots[slot] != -1)
+				slot = (slot + 1) & (nslots - 1);
+			slots[slot] = i;
+		}
+		free(m->slots);
+		m->slots = slots;
+		m->n_slots = nslots;
+	}
+	return (id);
+}
+
+/*
+ * Compile the rule list in rs (whose rule ids index rules) into a matcher.
+ * If preds is not NULL, preds[i] is the prediction for the ith rule on the
+ * list, and matcher_predict returns it.
+ */
+int
+matcher_compile(ruleset_t *rs, rule_t *rules, double *preds, matcher_t **ret)
+{
+	matcher_t *m;
+	const char *item, *end;
+	int i, id, err;
+
+	/* The default rule stops every scan. */
+	if (rs->n_rules == 0 || rs->rules[rs->n_rules - 1].rule_id != 0)
+		return (EINVAL);
+	if ((m = calloc(1, sizeof(matcher_t))) == NULL)
+		return (errno);
+	err = ENOMEM;
+	m->n_rules = rs->n_rules;
+	m->n_slots = 64;
+	if ((m->slots = malloc(m->n_slots * sizeof(int))) == NULL ||
+	    (m->preds = calloc(rs->n_rules, sizeof(double))) == NULL)
+		goto err;
+	for (i = 0; i < m->n_slots; i++)
+		m->slots[i] = -1;
+	if (preds != NULL)
+		memcpy(m->preds, preds, rs->n_rules * sizeof(double));
+
+	/* Intern every attribute first, so we know how wide masks are. */
+	for (i = 0; i < rs->n_rules; i++) {
+		if (rs->rules[i].rule_id == 0)
+			continue;
+		for (item = rules[rs->rules[i].rule_id].features;
+		    *item != '\0'; item = end + (*end != '\0')) {
+			if ((end = strchr(item, ',')) == NULL)
+				end = item + strlen(item);
+			if (intern(m, item, end - item, 1) == -2)
+				goto err;
+		}
+	}
+	m->n_words = m->n_attrs == 0 ? 1 :
+	    (m->n_attrs + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+	if ((m->masks = calloc(rs->n_rules * m->n_words,
+	    sizeof(v_entry))) == NULL)
+		goto err;
+	for (i = 0; i < rs->n_rules; i++) {
+		if (rs->rules[i].rule_id == 0)
+			continue;
+		for (item = rules[rs->rules[i].rule_id].features;
+		    *item != '\0'; item = end + (*end != '\0')) {
+			if ((end = strchr(item, ',')) == NULL)
+				end = item + strlen(item);
+			id = intern(m, item, end - item, 0);
+			m->masks[i * m->n_words + id / BITS_PER_ENTRY] |=
+			    (v_entry)1 << (id % BITS_PER_ENTRY);
+		}
+	}
+	*ret = m;
+	return (0);
+
+err:	matcher_free(m);
+	return (err);
+}
+
+void
+matcher_free(matcher_t *m)
+{
+	int i;
+
+	for (i = 0; i < m->n_attrs; i++)
+		free(m->names[i]);
+	free(m->names);
+	free(m->slots);
+	free(m->masks);
+	free(m->preds);
+	free(m);
+}
+
+/*
+ * Encode a row given as attribute strings into row, which has room for
+ * n_words entries.
+ */
+void
+matcher_encode(matcher_t *m, char **attrs, int nattrs, v_entry *row)
+{
+	int i, id;
+
+	memset(row, 0, m->n_words * sizeof(v_entry));
+	for (i = 0; i < nattrs; i++)
+		if ((id = intern(m, attrs[i], strlen(attrs[i]), 0)) >= 0)
+			row[id / BITS_PER_ENTRY] |=
+			    (v_entry)1 << (id % BITS_PER_ENTRY);
+}
+
+/*
+ * Encode a row given as a line of .tab text: attributes separated by
+ * white space, up to len bytes (the line need not be NUL-terminated).
+ */
+void
+matcher_encode_line(matcher_t *m, const char *line, size_t len, v_entry *row)
+{
+	const char *p, *end, *tok;
+	int id;
+
+	memset(row, 0, m->n_words * sizeof(v_entry));
+	for (p = line, end = line + len; p < end;) {
+		while (p < end && (*p == ' ' || *p == '\t' ||
+		    *p == '\r' || *p == '\n'))
+			p++;
+		for (tok = p; p < end && *p != ' ' && *p != '\t' &&
+		    *p != '\r' && *p != '\n'; p++)
+			continue;
+		if (p > tok && (id = intern(m, tok, p - tok, 0)) >= 0)
+			row[id / BITS_PER_ENTRY] |=
+			    (v_entry)1 << (id % BITS_PER_ENTRY);
+	}
+}
+
+/* The position of the first rule that holds for an encoded row. */
+int
+matcher_match(matcher_t *m, const v_entry *row)
+{
+	const v_entry *mask;
+	int i, w;
+
+	mask = m->masks;
+	if (m->n_words == 1) {
+		for (i = 0; (row[0] & mask[i]) != mask[i]; i++)
+			continue;
+		return (i);
+	}
+	for (i = 0;; i++, mask += m->n_words) {
+		for (w = 0; w < m->n_words; w++)
+			if ((row[w] & mask[w]) != mask[w])
+				break;
+		if (w == m->n_words)
+			return (i);
+	}
+}
+
+/*
+ * Classify nrows encoded rows, stored one after another, putting the
+ * position of the rule that fires for each in pos.
+ */
+void
+matcher_batch(matcher_t *m, const v_entry *rows, int nrows, int *pos)
+{
+	const v_entry *mask;
+	v_entry r;
+	int i, j, n;
+
+	if (m->n_words != 1) {
+		for (j = 0; j < nrows; j++, rows += m->n_words)
+			pos[j] = matcher_match(m, rows);
+		return;
+	}
+	mask = m->masks;
+	for (j = 0; j < nrows; j++) {
+		r = rows[j];
+		for (i = 0, n = m->n_rules - 1; i < n; i++)
+			if ((r & mask[i]) == mask[i])
+				break;
+		pos[j] = i;
+	}
+}
+
+/* The prediction for a row given as attribute strings. */
+double
+matcher_predict(matcher_t *m, char **attrs, int nattrs)
+{
+	v_entry row[m->n_words];
+
+	matcher_encode(m, attrs, nattrs, row);
+	return (m->preds[matcher_match(m, row)]);
+}
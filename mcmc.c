@@ -0,0 +1,640 @@
+/*
+ * Copyright 2015 President and Fellows of Harvard College.
+ * All rights reserved.
+ */
+
+/*
+ * Driver for the rule list sampler: reads the rules produced by makedata
+ * and the training labels, runs some number of Metropolis-Hastings chains
+ * and reports the best list found along with acceptance rates and
+ * throughput.
+ *
+ * With -A, the chains make approximate decisions from subsets of the
+ * samples (see sampler.c); we then also run exact chains from the same
+ * seeds so the two can be compared, and with -V we check every
+ * approximate decision against the exact one.
+ *
+ * With -P, we instead run that many replicas of an exact chain in
+ * parallel tempering (see tempering.c), the hottest at temperature -T,
+ * and then as many independent chains in parallel for the same number of
+ * steps, and compare their effective samples per second.
+ *
+ * With -k, exact chains keep every state they visit after burnin, as
+ * clones of their rulesets (see ruleset_clone), and we report the memory
+ * those take against what copying each ruleset in full would.
+ *
+ * With -W, we then run the first chain again with its ruleset sharded
+ * over 1, 2, 4, ... up to that many worker processes (see shard.c), bound
+ * to NUMA nodes in turn with -N, and report how its throughput scales.
+ * The workers count exactly, so every run must retrace the first chain;
+ * we check that it does.
+ *
+ * With -o, the chains push every state they keep after burnin to a trace
+ * file (see trace.c), which a writer thread fills while they run.  We
+ * then read the trace back and report on each chain from it: how often
+ * its list changed, the effective sample size of its log posterior and
+ * its best state, and check that it reads back what the chain pushed.
+ * predict -T takes its list from such a trace.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mytime.h"
+#include "rule.h"
+
+#define EXCHANGE_INTERVAL	10	/* Steps between replica exchanges. */
+
+int debug;
+dedup_t *dedup;
+
+typedef struct result {
+	double secs;
+	chain_stats_t stats;
+	double best;			/* Best log posterior seen. */
+	int *best_ids;
+	int n_best;
+	uint64_t traced;		/* Hash of the states traced. */
+} result_t;
+
+int keep;
+tracer_t *tracer;
+
+int run_chains(model_t *, int, int, int, unsigned, double, int, result_t *);
+int run_tempering(model_t *, int, double, int, int, unsigned);
+int run_shards(model_t *, int, int, int, int, unsigned, result_t *);
+uint64_t state_hash(uint64_t, long, double, int *, int);
+int report_trace(model_t *, const char *, int, int, double, result_t *);
+void print_list(model_t *, int *, int, double);
+
+int
+usage(void)
+{
+	(void)fprintf(stderr, "Usage: mcmc [-dk] [-A tcrit [-V] | %s] %s %s\n",
+	    "-P replicas [-T tmax] | -W workers [-N]",
+	    "[-c chains] [-i iterations] [-b burnin] [-S seed] [-o trace]",
+	    "[-l lambda] [-e eta] [-a alpha] rulefile labelfile");
+	return (-1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	extern char *optarg;
+	extern int optind;
+	int ch, i, ret, nchains, iters, burnin, verify, nreplicas;
+	int nworkers, bind;
+	int norig, nrules, nsamples, nlabels;
+	unsigned seed;
+	char *tracefile;
+	double tcrit, tmax;
+	rule_t *rules, *labels;
+	model_t model;
+	params_t params;
+	result_t *res, *exact;
+	trace_stats_t tstats;
+
+	debug = 0;
+	keep = 0;
+	nchains = 3;
+	iters = 50000;
+	burnin = -1;
+	seed = 1;
+	tcrit = 0;
+	verify = 0;
+	nreplicas = 0;
+	tmax = 1.5;
+	nworkers = bind = 0;
+	tracefile = NULL;
+	params.lambda = 3;
+	params.eta = 1;
+	params.alpha[0] = params.alpha[1] = 1;
+	while ((ch = getopt(argc, argv, "a:A:b:c:de:i:kl:No:P:S:T:VW:")) != -1)
+		switch (ch) {
+		case 'a':
+			params.alpha[0] = params.alpha[1] = atof(optarg);
+			break;
+		case 'A':
+			tcrit = atof(optarg);
+			break;
+		case 'b':
+			burnin = atoi(optarg);
+			break;
+		case 'c':
+			nchains = atoi(optarg);
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'e':
+			params.eta = atof(optarg);
+			break;
+		case 'i':
+			iters = atoi(optarg);
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		case 'l':
+			params.lambda = atof(optarg);
+			break;
+		case 'N':
+			bind = 1;
+			break;
+		case 'o':
+			tracefile = optarg;
+			break;
+		case 'P':
+			nreplicas = atoi(optarg);
+			break;
+		case 'S':
+			seed = (unsigned)atoi(optarg);
+			break;
+		case 'T':
+			tmax = atof(optarg);
+			break;
+		case 'V':
+			verify = 1;
+			break;
+		case 'W':
+			nworkers = atoi(optarg);
+			break;
+		case '?':
+		default:
+			return (usage());
+		}
+	argc -= optind;
+	argv += optind;
+	if (argc != 2 || nchains < 1 || nreplicas < 0 || nworkers < 0 ||
+	    (nreplicas > 0 && (tcrit != 0 || tmax < 1)) ||
+	    (nworkers > 0 && (tcrit != 0 || nreplicas > 0)))
+		return (usage());
+	if (burnin < 0)
+		burnin = iters / 2;
+
+	if ((ret = rules_init(argv[0], &nrules, &nsamples, &rules)) != 0) {
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(ret));
+		return (ret);
+	}
+	if ((ret = labels_init(argv[1], &nlabels, nsamples, &labels)) != 0 ||
+	    nlabels != 2) {
+		fprintf(stderr, "%s: need two classes for %d samples\n",
+		    argv[1], nsamples);
+		return (EINVAL);
+	}
+	norig = nrules;
+	if ((ret = rules_dedup(rules, &nrules, nsamples, &dedup)) != 0)
+		return (ret);
+	printf("%d rules %d samples\n", norig, nsamples);
+	printf("%d distinct truth tables (dedup ratio %.2f)\n",
+	    nrules, (double)norig / nrules);
+
+	if ((ret = model_init(&model, rules, nrules,
+	    nsamples, labels[1].truthtable, dedup, &params)) != 0)
+		return (ret);
+
+	if (nreplicas > 0)
+		return (run_tempering(&model,
+		    nreplicas, tmax, iters, burnin, seed));
+
+	res = calloc(nchains, sizeof(result_t));
+	exact = calloc(nchains, sizeof(result_t));
+	if (res == NULL || exact == NULL)
+		return (ENOMEM);
+
+	if (tracefile != NULL && (ret = tracer_start(tracefile, nchains,
+	    model.rules, model.nrules, 1 << 20, &tracer)) != 0) {
+		fprintf(stderr, "%s: %s\n", tracefile, strerror(ret));
+		return (ret);
+	}
+	if ((ret = run_chains(&model,
+	    nchains, iters, burnin, seed, tcrit, verify, res)) != 0)
+		return (ret);
+	if (tracer != NULL) {
+		ret = tracer_stop(tracer, &tstats);
+		tracer = NULL;
+		if (ret != 0) {
+			fprintf(stderr, "%s: %s\n", tracefile, strerror(ret));
+			return (ret);
+		}
+		printf("Trace: %ld states kept, %ld dropped, %ld bytes "
+		    "(%.1f per state)\n", tstats.n_kept, tstats.n_dropped,
+		    tstats.n_bytes, (double)tstats.n_bytes / tstats.n_kept);
+		if ((ret = report_trace(&model, tracefile,
+		    nchains, iters - burnin, tcrit, res)) != 0)
+			return (ret);
+	}
+
+	if (nworkers > 0)
+		return (run_shards(&model,
+		    nworkers, bind, iters, burnin, seed, res));
+
+	if (tcrit != 0) {
+		/* Run exact chains from the same seeds for comparison. */
+		printf("Exact chains for comparison:\n");
+		if ((ret = run_chains(&model,
+		    nchains, iters, burnin, seed, 0, 0, exact)) != 0)
+			return (ret);
+		double asecs = 0, esecs = 0, frac = 0;
+		for (i = 0; i < nchains; i++) {
+			asecs += res[i].secs;
+			esecs += exact[i].secs;
+			frac += (double)res[i].stats.nwords / res[i].stats.nsteps;
+		}
+		printf("Approximate: %.0f steps/sec, exact: %.0f steps/sec "
+		    "(%.2fx)\n", (double)nchains * iters / asecs,
+		    (double)nchains * iters / esecs, esecs / asecs);
+		printf("Approximate chains scanned %.1f%% of the data "
+		    "per step\n", 100 * frac / nchains /
+		    ((nsamples + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY));
+	}
+	return (0);
+}
+
+/*
+ * Run nchains chains of iters steps each, one after another, starting
+ * chain i from seed + i.  We keep the best list each chain visits after
+ * burnin (by exact log posterior).
+ */
+int
+run_chains(model_t *m, int nchains, int iters,
+    int burnin, unsigned seed, double tcrit, int verify, result_t *res)
+{
+	chain_t c;
+	ruleset_t **kept;
+	int i, j, k, ret, nkept, nentries;
+	size_t shared, full;
+	struct timeval tv_acc, tv_start, tv_end;
+
+	for (i = 0; i < nchains; i++) {
+		if ((ret = chain_init(&c, m, tcrit, seed + i)) != 0)
+			return (ret);
+		c.verify = verify;
+		res[i].best = -INFINITY;
+		res[i].traced = 0;
+		if ((res[i].best_ids = malloc(m->nrules * sizeof(int))) == NULL)
+			return (ENOMEM);
+		kept = NULL;
+		nkept = 0;
+		nentries = (m->nsamples + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+		full = 0;
+		if (keep && tcrit == 0 &&
+		    (kept = malloc(iters * sizeof(ruleset_t *))) == NULL)
+			return (ENOMEM);
+
+		INIT_TIME(tv_acc);
+		START_TIME(tv_start);
+		for (j = 0; j < iters; j++) {
+			if ((ret = chain_step(&c)) < 0)
+				return (-ret);
+			/* The queue never blocks; a full one drops. */
+			if (j >= burnin && tracer != NULL &&
+			    tracer_push(tracer,
+			    i, j, c.logpost, c.ids, c.n_ids) == 0)
+				res[i].traced = state_hash(res[i].traced,
+				    j, c.logpost, c.ids, c.n_ids);
+			if (j >= burnin && kept != NULL) {
+				if (ruleset_clone(c.rs, kept + nkept++) != 0)
+					return (ENOMEM);
+				full += sizeof(ruleset_t) + c.rs->n_rules *
+				    (sizeof(ruleset_entry_t) + nentries *
+				    sizeof(v_entry));
+			}
+			if (j < burnin || ret == 0)
+				continue;
+			/*
+			 * Approximate chains don't know their posterior; we
+			 * only score the list they end on.
+			 */
+			if (tcrit == 0 && c.logpost > res[i].best) {
+				res[i].best = c.logpost;
+				memcpy(res[i].best_ids,
+				    c.ids, c.n_ids * sizeof(int));
+				res[i].n_best = c.n_ids;
+			}
+		}
+		END_TIME(tv_start, tv_end, tv_acc);
+		tv_acc.tv_sec += tv_acc.tv_usec / 1000000;
+		tv_acc.tv_usec %= 1000000;
+		res[i].secs = tv_acc.tv_sec + tv_acc.tv_usec / 1e6;
+		res[i].stats = c.stats;
+
+		if (res[i].n_best == 0) {
+			res[i].best = list_logposterior(m, c.ids, c.n_ids);
+			memcpy(res[i].best_ids, c.ids, c.n_ids * sizeof(int));
+			res[i].n_best = c.n_ids;
+		}
+
+		printf("chain %d: %ld steps, %.1f%% accepted, "
+		    "%.0f steps/sec\n", i, c.stats.nsteps,
+		    100.0 * c.stats.naccepted / c.stats.nsteps,
+		    c.stats.nsteps / res[i].secs);
+		if (tcrit != 0)
+			printf("\t%.2f subset growths per step\n",
+			    (double)c.stats.ngrow / c.stats.nsteps);
+		if (c.stats.nverified != 0)
+			printf("\t%ld of %ld decisions (%.3f%%) differ "
+			    "from the exact sampler's\n",
+			    c.stats.nerrors, c.stats.nverified,
+			    100.0 * c.stats.nerrors / c.stats.nverified);
+		if (debug || i == nchains - 1)
+			print_list(m, res[i].best_ids,
+			    res[i].n_best, res[i].best);
+		chain_free(&c);
+
+		if (kept != NULL) {
+			/*
+			 * full is what whole copies of the states would
+			 * take; the chain is gone, so the clones now split
+			 * what they share among themselves.
+			 */
+			shared = 0;
+			for (k = 0; k < nkept; k++)
+				shared += ruleset_bytes(kept[k]);
+			printf("\t%d states kept in %.1f KB (%.1f KB copied "
+			    "in full, %.1fx)\n", nkept, shared / 1024.0,
+			    full / 1024.0, (double)full / shared);
+			for (k = 0; k < nkept; k++)
+				ruleset_free(kept[k]);
+			free(kept);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Run the chain from seed again with its ruleset sharded over 1, 2, 4, ...
+ * nworkers workers, and compare each run with ref, the same chain run in
+ * this process.
+ */
+int
+run_shards(model_t *m, int nworkers, int bind,
+    int iters, int burnin, unsigned seed, result_t *ref)
+{
+	chain_t c;
+	shards_t *sh;
+	char file[] = "/tmp/mcmc.XXXXXX";
+	double secs, best, base;
+	int j, w, n, fd, ret, naccepted;
+	struct timeval tv_acc, tv_start, tv_end;
+
+	/* The workers load their shards from a rules image. */
+	if ((fd = mkstemp(file)) < 0)
+		return (errno);
+	close(fd);
+	if ((ret = rules_image_write(file,
+	    m->rules, m->nrules, m->nsamples, m->label)) != 0) {
+		fprintf(stderr, "%s: %s\n", file, strerror(ret));
+		unlink(file);
+		return (ret);
+	}
+
+	base = 0;
+	for (w = 1; ret == 0; w = 2 * w < nworkers ? 2 * w : nworkers) {
+		if ((ret = shards_start(file, w, bind, &sh)) != 0)
+			break;
+		if ((ret = chain_init(&c, m, 0, seed)) != 0 ||
+		    (ret = chain_shard(&c, sh)) != 0) {
+			shards_stop(sh);
+			break;
+		}
+		best = -INFINITY;
+		naccepted = 0;
+		INIT_TIME(tv_acc);
+		START_TIME(tv_start);
+		for (j = 0; j < iters; j++) {
+			if ((ret = chain_step(&c)) < 0)
+				break;
+			naccepted += ret;
+			if (j >= burnin && ret != 0 && c.logpost > best)
+				best = c.logpost;
+		}
+		END_TIME(tv_start, tv_end, tv_acc);
+		tv_acc.tv_sec += tv_acc.tv_usec / 1000000;
+		tv_acc.tv_usec %= 1000000;
+		secs = tv_acc.tv_sec + tv_acc.tv_usec / 1e6;
+		/* As run_chains does when nothing past burnin is accepted. */
+		if (best == -INFINITY)
+			best = c.logpost;
+		n = sh->n_workers;
+		if (ret < 0) {
+			ret = -ret;
+			fprintf(stderr, "mcmc: a worker failed: %s\n",
+			    strerror(ret));
+		} else {
+			ret = 0;
+			if (base == 0)
+				base = iters / secs;
+			printf("%d worker%s%s: %.0f steps/sec (%.2fx one "
+			    "worker, %.2fx in-process), %s\n", n,
+			    n == 1 ? "" : "s",
+			    sh->n_nodes > 0 ? " bound to nodes" : "",
+			    iters / secs, iters / secs / base,
+			    iters / secs / (iters / ref->secs),
+			    naccepted == ref->stats.naccepted &&
+			    best == ref->best ? "same chain" : "CHAIN DIFFERS");
+		}
+		chain_free(&c);
+		shards_stop(sh);
+		/* There may be fewer vector entries than workers. */
+		if (w == nworkers || n < w)
+			break;
+	}
+	unlink(file);
+	return (ret);
+}
+
+/*
+ * Run nreplicas replicas for iters steps each with replica exchange up to
+ * temperature tmax, then the same number of independent chains (tmax 1)
+ * from the same seeds, and compare effective samples per second.  The
+ * samples of a tempering run are those of replica 0; the independent
+ * chains' effective sample sizes add up.
+ */
+int
+run_tempering(model_t *m, int nreplicas,
+    double tmax, int iters, int burnin, unsigned seed)
+{
+	tempering_t pt;
+	double secs[2], ess[2], e, best;
+	int k, r, ret, kbest;
+	struct timeval tv_acc, tv_start, tv_end;
+
+	if (burnin >= iters)
+		return (usage());
+	for (r = 0; r < 2; r++) {
+		if ((ret = tempering_init(&pt, m, nreplicas,
+		    r == 0 ? tmax : 1, EXCHANGE_INTERVAL, seed)) != 0) {
+			tempering_free(&pt);
+			return (ret);
+		}
+		INIT_TIME(tv_acc);
+		START_TIME(tv_start);
+		if ((ret = tempering_run(&pt, iters, burnin)) != 0) {
+			tempering_free(&pt);
+			return (ret);
+		}
+		END_TIME(tv_start, tv_end, tv_acc);
+		tv_acc.tv_sec += tv_acc.tv_usec / 1000000;
+		tv_acc.tv_usec %= 1000000;
+		secs[r] = tv_acc.tv_sec + tv_acc.tv_usec / 1e6;
+
+		if (r == 0)
+			printf("Parallel tempering, %d replicas up to "
+			    "temperature %g, exchanging every %d steps:\n",
+			    nreplicas, tmax, EXCHANGE_INTERVAL);
+		else
+			printf("Independent chains for comparison:\n");
+		ess[r] = 0;
+		kbest = 0;
+		for (k = 0; k < nreplicas; k++) {
+			printf("%s %d (T %.2f): %.1f%% accepted",
+			    r == 0 ? "replica" : "chain", k, 1 / pt.betas[k],
+			    100.0 * pt.chains[k].stats.naccepted /
+			    pt.chains[k].stats.nsteps);
+			if (pt.ntried[k] != 0)
+				printf(", %.1f%% of exchanges with %d made",
+				    100.0 * pt.nswapped[k] / pt.ntried[k],
+				    k + 1);
+			if (pt.betas[k] == 1) {
+				e = trace_ess(pt.trace +
+				    k * pt.n_trace, pt.n_trace);
+				printf(", ESS %.0f", e);
+				ess[r] += e;
+				if (pt.best[k] > pt.best[kbest])
+					kbest = k;
+			}
+			printf("\n");
+		}
+		best = pt.best[kbest];
+		printf("%.0f effective samples of %d in %.2f sec: "
+		    "%.1f per sec\n", ess[r],
+		    r == 0 ? pt.n_trace : nreplicas * pt.n_trace,
+		    secs[r], ess[r] / secs[r]);
+		if (debug || r == 0)
+			print_list(m, pt.best_ids + kbest * m->nrules,
+			    pt.n_best[kbest], best);
+		else
+			printf("Best log posterior %.3f\n", best);
+		tempering_free(&pt);
+	}
+	printf("Tempering: %.2fx the effective samples per second of "
+	    "independent chains\n", (ess[0] / secs[0]) / (ess[1] / secs[1]));
+	return (0);
+}
+
+/* Fold a state into h (FNV-1a over its bytes). */
+uint64_t
+state_hash(uint64_t h, long step, double logpost, int *ids, int n)
+{
+	unsigned char *p;
+	size_t i;
+
+	if (h == 0)
+		h = 0xcbf29ce484222325ULL;
+	for (p = (unsigned char *)&step, i = 0; i < sizeof(step); i++)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	for (p = (unsigned char *)&logpost, i = 0; i < sizeof(logpost); i++)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	for (p = (unsigned char *)ids, i = 0; i < n * sizeof(int); i++)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	return (h);
+}
+
+/*
+ * Read back the trace in file of nchains chains of at most nkeep states
+ * each, report on each chain from it, and check that each chain's states
+ * are the ones run_chains pushed (res[i].traced).  The log posteriors of
+ * approximate chains (tcrit not 0) are not exact, so we leave them out.
+ */
+int
+report_trace(model_t *m, const char *file,
+    int nchains, int nkeep, double tcrit, result_t *res)
+{
+	trace_reader_t *tr;
+	trace_state_t st;
+	double *lp, best;
+	uint64_t *h;
+	int *n, *nchanged, *prev, *n_prev, i, nc, nr, ret;
+
+	if ((ret = trace_open(file, &tr, &nc, &nr)) != 0) {
+		fprintf(stderr, "%s: %s\n", file, strerror(ret));
+		return (ret);
+	}
+	if (nc != nchains || nr != m->nrules) {
+		trace_close(tr);
+		return (EINVAL);
+	}
+	lp = malloc((size_t)nchains * nkeep * sizeof(double));
+	prev = malloc((size_t)nchains * m->nrules * sizeof(int));
+	n = calloc(nchains, sizeof(int));
+	nchanged = calloc(nchains, sizeof(int));
+	n_prev = calloc(nchains, sizeof(int));
+	h = calloc(nchains, sizeof(uint64_t));
+	if (lp == NULL || prev == NULL || n == NULL ||
+	    nchanged == NULL || n_prev == NULL || h == NULL) {
+		ret = ENOMEM;
+		goto done;
+	}
+	while ((ret = trace_next(tr, &st)) == 0 && st.n_ids != 0) {
+		i = st.chain;
+		if (n[i] == nkeep) {
+			ret = EINVAL;
+			break;
+		}
+		lp[i * nkeep + n[i]++] = st.logpost;
+		h[i] = state_hash(h[i], st.step, st.logpost, st.ids, st.n_ids);
+		if (st.n_ids != n_prev[i] || memcmp(st.ids,
+		    prev + i * m->nrules, st.n_ids * sizeof(int)) != 0)
+			nchanged[i]++;
+		memcpy(prev + i * m->nrules, st.ids, st.n_ids * sizeof(int));
+		n_prev[i] = st.n_ids;
+	}
+	if (ret != 0) {
+		fprintf(stderr, "%s: %s\n", file, strerror(ret));
+		goto done;
+	}
+	for (i = 0; i < nchains; i++) {
+		printf("trace %d: %d states, list changed %d times", i,
+		    n[i], n[i] > 0 ? nchanged[i] - 1 : 0);
+		if (tcrit == 0 && n[i] > 0) {
+			best = -INFINITY;
+			for (nc = 0; nc < n[i]; nc++)
+				if (lp[i * nkeep + nc] > best)
+					best = lp[i * nkeep + nc];
+			printf(", ESS %.1f, best %.3f",
+			    trace_ess(lp + i * nkeep, n[i]), best);
+		}
+		printf(", %s\n", h[i] == res[i].traced ?
+		    "as pushed" : "DIFFERS FROM WHAT WAS PUSHED");
+	}
+
+done:
+	trace_close(tr);
+	free(lp);
+	free(prev);
+	free(n);
+	free(nchanged);
+	free(n_prev);
+	free(h);
+	return (ret);
+}
+
+void
+print_list(model_t *m, int *ids, int n, double logpost)
+{
+	int i, k;
+
+	printf("List (log posterior %.3f):\n", logpost);
+	for (i = 0; i < n; i++) {
+		printf("\t%d: %s", ids[i], m->rules[ids[i]].features);
+		if ((k = dedup_nmembers(dedup, ids[i])) > 1)
+			printf(" (+%d equivalent)", k - 1);
+		printf("\n");
+	}
+}
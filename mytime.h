@@ -17,8 +17,8 @@
 	if (TV2.tv_usec > TV1.tv_usec)			\
 		TV2.tv_usec -= TV1.tv_usec;			\
 	else {						\
-		TV2.tv_sec++;				\
-		TV2.tv_sec += 1000000 - TV1.tv_usec;		\
+		TV2.tv_sec--;				\
+		TV2.tv_usec += 1000000 - TV1.tv_usec;		\
 	}						\
 	ADD_TIME(TV2, ACC_TV);				\
 }
@@ -0,0 +1,211 @@
+/*
+ * Copyright 2015 President and Fellows of Harvard College.
+ * All rights reserved.
+ */
+
+/*
+ * A work-stealing pool for batches of independent jobs, numbered 0 to
+ * njobs - 1.
+ *
+ * Each thread starts with an equal, contiguous range of the jobs and runs
+ * them from the bottom up.  A thread whose range is empty looks at the
+ * others in turn and steals the top half of the first nonempty range it
+ * finds.  A range is a single word (first job in the low half, end in the
+ * high half) changed only by compare-and-swap, so the owner and any
+ * thieves agree on who gets each job without locks.  Jobs are never
+ * added, so once a thread finds every range empty it is done: any job it
+ * missed belongs to a thread that will run it.
+ *
+ * We time how long each thread spends in jobs and how much CPU it uses,
+ * so callers can tell how well the threads kept the cores busy.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mytime.h"
+#include "rule.h"
+
+#define RANGE(lo, hi)	((uint64_t)(hi) << 32 | (uint32_t)(lo))
+#define RANGE_LO(r)	((int)((r) & 0xffffffff))
+#define RANGE_HI(r)	((int)((r) >> 32))
+
+struct pool;
+
+struct worker {
+	struct pool *pool;
+	int k;
+	uint64_t range;			/* Jobs not yet taken. */
+	double busy;			/* Seconds spent in jobs. */
+	double cpu;			/* CPU seconds used. */
+	long njobs;
+	long nstolen;
+	pthread_t thread;
+};
+
+struct pool {
+	int n_workers;
+	struct worker *workers;
+	int (*job)(void *, int);
+	void *arg;
+	int error;
+};
+
+static double
+seconds(struct timeval *tv)
+{
+	return (tv->tv_sec + tv->tv_usec / 1e6);
+}
+
+/* Take the next job from the bottom of w's range, or return -1. */
+static int
+take(struct worker *w)
+{
+	uint64_t r;
+	int lo, hi;
+
+	r = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+	do {
+		lo = RANGE_LO(r);
+		hi = RANGE_HI(r);
+		if (lo >= hi)
+			return (-1);
+	} while (!__atomic_compare_exchange_n(&w->range, &r,
+	    RANGE(lo + 1, hi), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	return (lo);
+}
+
+/*
+ * Move the top half of some other worker's range into w's (empty) range.
+ * Returns 0 if every other range was empty.
+ */
+static int
+steal(struct worker *w)
+{
+	struct pool *p;
+	struct worker *v;
+	uint64_t r;
+	int i, lo, hi, n;
+
+	p = w->pool;
+	for (i = 1; i < p->n_workers; i++) {
+		v = p->workers + (w->k + i) % p->n_workers;
+		r = __atomic_load_n(&v->range, __ATOMIC_ACQUIRE);
+		do {
+			lo = RANGE_LO(r);
+			hi = RANGE_HI(r);
+			n = (hi - lo + 1) / 2;
+		} while (n > 0 && !__atomic_compare_exchange_n(&v->range, &r,
+		    RANGE(lo, hi - n), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+		if (n > 0) {
+			__atomic_store_n(&w->range,
+			    RANGE(hi - n, hi), __ATOMIC_RELEASE);
+			w->nstolen++;
+			return (1);
+		}
+	}
+	return (0);
+}
+
+static void *
+worker_run(void *arg)
+{
+	struct worker *w;
+	struct pool *p;
+	struct timespec cpu0, cpu;
+	struct timeval tv_acc, tv_start, tv_end;
+	int j, ret, none;
+
+	w = arg;
+	p = w->pool;
+	INIT_TIME(tv_acc);
+	cpu0.tv_sec = cpu0.tv_nsec = 0;
+	(void)clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+	for (;;) {
+		if ((j = take(w)) < 0) {
+			if (steal(w))
+				continue;
+			break;
+		}
+		/* After an error we only empty the ranges. */
+		if (__atomic_load_n(&p->error, __ATOMIC_RELAXED) != 0)
+			continue;
+		START_TIME(tv_start);
+		ret = p->job(p->arg, j);
+		END_TIME(tv_start, tv_end, tv_acc);
+		w->njobs++;
+		none = 0;
+		if (ret != 0)
+			(void)__atomic_compare_exchange_n(&p->error, &none,
+			    ret, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+	tv_acc.tv_sec += tv_acc.tv_usec / 1000000;
+	tv_acc.tv_usec %= 1000000;
+	w->busy = seconds(&tv_acc);
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu) == 0)
+		w->cpu = cpu.tv_sec - cpu0.tv_sec +
+		    (cpu.tv_nsec - cpu0.tv_nsec) / 1e9;
+	return (NULL);
+}
+
+/*
+ * Run job(arg, j) for j = 0 .. njobs - 1 on nthreads threads (the calling
+ * thread is one of them).  Jobs may run in any order and at the same
+ * time, so they must only share what they do not change.  Returns 0, or
+ * the error the first failed job returned, after which no more jobs are
+ * started.  If stats is not NULL, we fill it in.
+ */
+int
+pool_run(int nthreads, int njobs,
+    int (*job)(void *, int), void *arg, pool_stats_t *stats)
+{
+	struct pool p;
+	struct worker *w;
+	struct timeval tv_acc, tv_start, tv_end;
+	int k, n;
+
+	if (nthreads < 1 || njobs < 0)
+		return (EINVAL);
+	if ((p.workers = calloc(nthreads, sizeof(struct worker))) == NULL)
+		return (ENOMEM);
+	p.n_workers = nthreads;
+	p.job = job;
+	p.arg = arg;
+	p.error = 0;
+	for (k = 0; k < nthreads; k++) {
+		w = p.workers + k;
+		w->pool = &p;
+		w->k = k;
+		w->range = RANGE((long)njobs * k / nthreads,
+		    (long)njobs * (k + 1) / nthreads);
+	}
+
+	INIT_TIME(tv_acc);
+	START_TIME(tv_start);
+	for (n = 1; n < nthreads; n++)
+		if (pthread_create(&p.workers[n].thread,
+		    NULL, worker_run, p.workers + n) != 0)
+			break;
+	/* The jobs of threads we could not start get stolen. */
+	worker_run(p.workers);
+	for (k = 1; k < n; k++)
+		pthread_join(p.workers[k].thread, NULL);
+	END_TIME(tv_start, tv_end, tv_acc);
+
+	if (stats != NULL) {
+		memset(stats, 0, sizeof(pool_stats_t));
+		stats->n_threads = n;
+		tv_acc.tv_sec += tv_acc.tv_usec / 1000000;
+		tv_acc.tv_usec %= 1000000;
+		stats->wall = seconds(&tv_acc);
+		for (k = 0; k < n; k++) {
+			stats->busy += p.workers[k].busy;
+			stats->cpu += p.workers[k].cpu;
+			stats->nstolen += p.workers[k].nstolen;
+		}
+	}
+	free(p.workers);
+	return (p.error);
+}
@@ -0,0 +1,288 @@
+/*
+ * Copyright 2015 President and Fellows of Harvard College.
+ * All rights reserved.
+ */
+
+/*
+ * Classify rows of raw attributes with a rule list.
+ *
+ * The list is given on the command line as the features of its rules, in
+ * order, as mcmc prints them (e.g. adult,male 3rd_class); the default rule
+ * is implied.  We look the rules up in rulefile and score each one on the
+ * training labels: its prediction is the posterior mean probability of
+ * class 1 among the training samples it captures.  Then we compile the
+ * list (see match.c) and read .tab rows from standard input, batch rows at
+ * a time, writing for each the position of the rule that fires and its
+ * prediction.
+ *
+ * With -T, the list is instead the one of highest log posterior in a
+ * trace written by mcmc -o (see trace.c), which names its rules by their
+ * features too.
+ *
+ * With -t, we instead read all of standard input and report how fast the
+ * rows can be encoded and classified.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mytime.h"
+#include "rule.h"
+
+int trace_best(const char *, char ***, int *);
+int run_stream(matcher_t *, int);
+int run_timing(matcher_t *);
+
+int
+usage(void)
+{
+	(void)fprintf(stderr, "Usage: predict [-t] [-a alpha] [-b batch] %s\n",
+	    "rulefile labelfile [-T trace | rule ...]");
+	return (-1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	extern char *optarg;
+	extern int optind;
+	int ch, i, j, n, ret, batch, timing, *ids;
+	int nrules, nsamples, nlabels, n1;
+	char *tracefile, **names;
+	double alpha, *preds;
+	rule_t *rules, *labels;
+	ruleset_t *rs;
+	matcher_t *m;
+
+	alpha = 1;
+	batch = 1024;
+	timing = 0;
+	tracefile = NULL;
+	while ((ch = getopt(argc, argv, "a:b:tT:")) != -1)
+		switch (ch) {
+		case 'a':
+			alpha = atof(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 't':
+			timing = 1;
+			break;
+		case 'T':
+			tracefile = optarg;
+			break;
+		case '?':
+		default:
+			return (usage());
+		}
+	argc -= optind;
+	argv += optind;
+	if (argc < 2 || batch < 1 || (tracefile != NULL && argc != 2))
+		return (usage());
+
+	if ((ret = rules_init(argv[0], &nrules, &nsamples, &rules)) != 0) {
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(ret));
+		return (ret);
+	}
+	if ((ret = labels_init(argv[1], &nlabels, nsamples, &labels)) != 0 ||
+	    nlabels != 2) {
+		fprintf(stderr, "%s: need two classes for %d samples\n",
+		    argv[1], nsamples);
+		return (EINVAL);
+	}
+
+	if (tracefile == NULL) {
+		names = argv + 2;
+		n = argc - 2 + 1;
+	} else if ((ret = trace_best(tracefile, &names, &n)) != 0) {
+		fprintf(stderr, "%s: %s\n", tracefile, strerror(ret));
+		return (ret);
+	}
+	if ((ids = malloc(n * sizeof(int))) == NULL ||
+	    (preds = malloc(n * sizeof(double))) == NULL)
+		return (ENOMEM);
+	for (i = 0; i < n - 1; i++) {
+		for (j = 1; j < nrules; j++)
+			if (strcmp(rules[j].features, names[i]) == 0)
+				break;
+		if (j == nrules) {
+			fprintf(stderr, "%s: no rule %s\n", argv[0], names[i]);
+			return (EINVAL);
+		}
+		ids[i] = j;
+	}
+	ids[n - 1] = 0;
+	if ((ret = ruleset_init(n, nsamples, ids, rules, &rs)) != 0)
+		return (ret);
+
+	for (i = 0; i < n; i++) {
+		n1 = rule_vandcnt(rs->rules[i].captures,
+		    labels[1].truthtable, nsamples);
+		preds[i] = (n1 + alpha) / (rs->rules[i].ncaptured + 2 * alpha);
+		fprintf(stderr, "%d: %s\t%d/%d\t%.4f\n", i,
+		    rules[ids[i]].features, n1, rs->rules[i].ncaptured,
+		    preds[i]);
+	}
+	if ((ret = matcher_compile(rs, rules, preds, &m)) != 0)
+		return (ret);
+	fprintf(stderr, "%d attributes, %d word(s) per row\n",
+	    m->n_attrs, m->n_words);
+
+	ret = timing ? run_timing(m) : run_stream(m, batch);
+	matcher_free(m);
+	ruleset_free(rs);
+	return (ret);
+}
+
+/*
+ * Find the state of highest log posterior in a trace, the first if there
+ * are several, and return the features of its rules other than the
+ * default in a malloc'd array, and their number plus 1 (for the default)
+ * in *np.
+ */
+int
+trace_best(const char *file, char ***namesp, int *np)
+{
+	trace_reader_t *tr;
+	trace_state_t st;
+	char **names;
+	double best;
+	int i, k, n, nchains, nrules, ret, *ids;
+
+	if ((ret = trace_open(file, &tr, &nchains, &nrules)) != 0)
+		return (ret);
+	if ((ids = malloc(nrules * sizeof(int))) == NULL) {
+		trace_close(tr);
+		return (ENOMEM);
+	}
+	best = -INFINITY;
+	n = 0;
+	while ((ret = trace_next(tr, &st)) == 0 && st.n_ids != 0)
+		if (st.logpost > best) {
+			best = st.logpost;
+			memcpy(ids, st.ids, st.n_ids * sizeof(int));
+			n = st.n_ids;
+		}
+	if (ret == 0 && n == 0)
+		ret = EINVAL;
+	if (ret == 0 && (names = malloc(n * sizeof(char *))) == NULL)
+		ret = ENOMEM;
+	if (ret == 0) {
+		/* The list ends with the default rule, 0. */
+		for (i = k = 0; i < n && ret == 0; i++)
+			if (ids[i] != 0 && (names[k++] =
+			    strdup(trace_features(tr, ids[i]))) == NULL)
+				ret = ENOMEM;
+		if (ret == 0) {
+			*namesp = names;
+			*np = k + 1;
+			fprintf(stderr,
+			    "%s: best log posterior %.3f\n", file, best);
+		} else {
+			while (k > 0)
+				free(names[--k]);
+			free(names);
+		}
+	}
+	free(ids);
+	trace_close(tr);
+	return (ret);
+}
+
+/*
+ * Classify standard input, batch rows at a time.
+ */
+int
+run_stream(matcher_t *m, int batch)
+{
+	char *line;
+	size_t linecap;
+	ssize_t len;
+	v_entry *rows;
+	int i, n, *pos;
+
+	rows = malloc(batch * m->n_words * sizeof(v_entry));
+	pos = malloc(batch * sizeof(int));
+	if (rows == NULL || pos == NULL) {
+		free(rows);
+		free(pos);
+		return (ENOMEM);
+	}
+	line = NULL;
+	linecap = 0;
+	do {
+		for (n = 0; n < batch &&
+		    (len = getline(&line, &linecap, stdin)) >= 0; n++)
+			matcher_encode_line(m, line, len, rows + n * m->n_words);
+		matcher_batch(m, rows, n, pos);
+		for (i = 0; i < n; i++)
+			printf("%d %.4f\n", pos[i], m->preds[pos[i]]);
+	} while (n == batch);
+	free(line);
+	free(rows);
+	free(pos);
+	return (ferror(stdin) ? EIO : 0);
+}
+
+/*
+ * Encode all of standard input, then classify it repeatedly until we have
+ * done at least 10 million rows.
+ */
+int
+run_timing(matcher_t *m)
+{
+	char *line;
+	size_t linecap;
+	ssize_t len;
+	v_entry *rows, *expand;
+	int i, nrows, nalloc, reps, *pos;
+	struct timeval tv_acc, tv_start, tv_end;
+
+	rows = NULL;
+	nrows = nalloc = 0;
+	line = NULL;
+	linecap = 0;
+	INIT_TIME(tv_acc);
+	START_TIME(tv_start);
+	while ((len = getline(&line, &linecap, stdin)) >= 0) {
+		if (nrows == nalloc) {
+			nalloc = nalloc == 0 ? 1024 : 2 * nalloc;
+			expand = realloc(rows,
+			    nalloc * m->n_words * sizeof(v_entry));
+			if (expand == NULL) {
+				free(line);
+				free(rows);
+				return (ENOMEM);
+			}
+			rows = expand;
+		}
+		matcher_encode_line(m, line, len, rows + nrows * m->n_words);
+		nrows++;
+	}
+	free(line);
+	END_TIME(tv_start, tv_end, tv_acc);
+	if (nrows == 0)
+		return (0);
+	REPORT_TIME("predict", "per row read and encoded", tv_acc, nrows);
+
+	if ((pos = malloc(nrows * sizeof(int))) == NULL)
+		return (ENOMEM);
+	reps = 10000000 / nrows + 1;
+	INIT_TIME(tv_acc);
+	START_TIME(tv_start);
+	for (i = 0; i < reps; i++)
+		matcher_batch(m, rows, nrows, pos);
+	END_TIME(tv_start, tv_end, tv_acc);
+	tv_acc.tv_sec += tv_acc.tv_usec / 1000000;
+	tv_acc.tv_usec %= 1000000;
+	printf("%d rows x %d: %.1f million rows/sec\n", nrows, reps,
+	    (double)nrows * reps / (tv_acc.tv_sec + tv_acc.tv_usec / 1e6) / 1e6);
+	free(rows);
+	free(pos);
+	return (0);
+}
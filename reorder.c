@@ -0,0 +1,395 @@
+/*
+ * Copyright 2015 President and Fellows of Harvard College.
+ * All rights reserved.
+ */
+
+/*
+ * Reorder the samples of a data set (see permute.c) and measure what it
+ * buys.
+ *
+ * We load the rules and labels once and, for the samples in file order,
+ * in lexicographic order and in Gray code order of their bits in the
+ * ntop rules of highest support and their label, report:
+ *
+ *	- the mean number of runs of equal bits in a truth table;
+ *	- the share of vector entries that are all 0's or all 1's;
+ *	- the size of the truth tables compressed (vector_compress) as a
+ *	  share of their size plain;
+ *	- the time to run the capture cascade (rules_cascade, which skips
+ *	  an entry once it is all caught) for nlists random lists of 1 to 8
+ *	  rules, and the share of rule entries it skips;
+ *	- the time to count the samples shared by each pair of the top
+ *	  rules, plain (rule_vandcnt) and compressed (cvector_andcnt).
+ *
+ * The cascade and pair counts do not depend on the order, and we check
+ * that they do not change.
+ *
+ * With -o basename, we write the rules, the labels and the permutation in
+ * the chosen order (Gray with -g, otherwise lexicographic) to basename.out
+ * and basename.Y, in the formats rules_init and labels_init read, and to
+ * basename.perm, which gives for each new sample its number in the
+ * original files, one per line.  Predictions made from
+ * the reordered files go back to the original rows through it.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mytime.h"
+#include "rule.h"
+
+#define NPAIRS	64		/* Top rules whose pairs we count. */
+#define MAXLIST	8
+#define TOP(b, i)	((b)->rules[(b)->top[i]].truthtable)
+
+typedef struct bench {
+	int nrules;
+	int nsamples;
+	rule_t *rules;
+	rule_t *labels;
+	int nlabels;
+	int nlists;
+	int *lists;			/* MAXLIST ids per list. */
+	int *lens;
+	int *top;			/* Rules whose pairs we count. */
+	int ntop;
+	long cascade_sum;		/* To check the orders agree. */
+	long pair_sum;
+} bench_t;
+
+void measure(bench_t *, const char *);
+int apply(bench_t *, int *, int *);
+int write_files(bench_t *, const char *, int *);
+
+int
+usage(void)
+{
+	(void)fprintf(stderr, "Usage: reorder %s %s\n",
+	    "[-g] [-n ntop] [-l lists] [-S seed] [-o basename]",
+	    "rulefile labelfile");
+	return (-1);
+}
+
+static double
+seconds(struct timeval *tv)
+{
+	tv->tv_sec += tv->tv_usec / 1000000;
+	tv->tv_usec %= 1000000;
+	return (tv->tv_sec + tv->tv_usec / 1e6);
+}
+
+int
+main(int argc, char *argv[])
+{
+	extern char *optarg;
+	extern int optind;
+	bench_t b;
+	char *outbase;
+	int ch, i, j, k, ret, gray, ntop, *perm[2], *orig;
+	unsigned seed;
+	rng_t rng;
+
+	memset(&b, 0, sizeof(bench_t));
+	gray = 0;
+	ntop = 16;
+	b.nlists = 2000;
+	seed = 1;
+	outbase = NULL;
+	while ((ch = getopt(argc, argv, "gl:n:o:S:")) != -1)
+		switch (ch) {
+		case 'g':
+			gray = 1;
+			break;
+		case 'l':
+			b.nlists = atoi(optarg);
+			break;
+		case 'n':
+			ntop = atoi(optarg);
+			break;
+		case 'o':
+			outbase = optarg;
+			break;
+		case 'S':
+			seed = (unsigned)atoi(optarg);
+			break;
+		case '?':
+		default:
+			return (usage());
+		}
+	argc -= optind;
+	argv += optind;
+	if (argc != 2 || b.nlists < 1 || ntop < 0 || ntop > 63)
+		return (usage());
+
+	if ((ret = rules_init(argv[0],
+	    &b.nrules, &b.nsamples, &b.rules)) != 0) {
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(ret));
+		return (ret);
+	}
+	if ((ret = labels_init(argv[1],
+	    &b.nlabels, b.nsamples, &b.labels)) != 0 || b.nlabels != 2) {
+		fprintf(stderr, "%s: need two classes for %d samples\n",
+		    argv[1], b.nsamples);
+		return (EINVAL);
+	}
+	if (b.nrules < 2) {
+		fprintf(stderr, "%s: no rules\n", argv[0]);
+		return (EINVAL);
+	}
+	printf("%d rules %d samples, ordering on %d rules\n",
+	    b.nrules, b.nsamples, ntop < b.nrules - 1 ? ntop : b.nrules - 1);
+
+	/* The random lists and the top rules (by support). */
+	rng_seed(&rng, seed);
+	b.lists = malloc(b.nlists * MAXLIST * sizeof(int));
+	b.lens = malloc(b.nlists * sizeof(int));
+	b.top = malloc(NPAIRS * sizeof(int));
+	perm[0] = malloc(b.nsamples * sizeof(int));
+	perm[1] = malloc(b.nsamples * sizeof(int));
+	orig = malloc(b.nsamples * sizeof(int));
+	if (b.lists == NULL || b.lens == NULL || b.top == NULL ||
+	    perm[0] == NULL || perm[1] == NULL || orig == NULL)
+		return (ENOMEM);
+	for (i = 0; i < b.nlists; i++) {
+		b.lens[i] = 1 + rng_int(&rng, MAXLIST);
+		for (j = 0; j < b.lens[i]; j++)
+			b.lists[i * MAXLIST + j] =
+			    1 + rng_int(&rng, b.nrules - 1);
+	}
+	for (i = 1; i < b.nrules; i++) {
+		/* Insertion into the NPAIRS of highest support so far. */
+		for (j = b.ntop; j > 0 &&
+		    b.rules[b.top[j - 1]].support < b.rules[i].support; j--)
+			if (j < NPAIRS)
+				b.top[j] = b.top[j - 1];
+		if (j < NPAIRS)
+			b.top[j] = i;
+		if (b.ntop < NPAIRS)
+			b.ntop++;
+	}
+
+	/* Both orders come from the original tables. */
+	if ((ret = samples_order(b.rules, b.nrules, b.nsamples,
+	    b.labels[1].truthtable, ntop, 0, perm[0])) != 0 ||
+	    (ret = samples_order(b.rules, b.nrules, b.nsamples,
+	    b.labels[1].truthtable, ntop, 1, perm[1])) != 0) {
+		fprintf(stderr, "reorder: %s\n", strerror(ret));
+		return (ret);
+	}
+	for (i = 0; i < b.nsamples; i++)
+		orig[i] = i;
+
+	measure(&b, "file order");
+	for (k = 0; k < 2; k++) {
+		if ((ret = apply(&b, orig, perm[k])) != 0) {
+			fprintf(stderr, "reorder: %s\n", strerror(ret));
+			return (ret);
+		}
+		measure(&b, k == 0 ? "lexicographic" : "Gray code");
+		if (outbase != NULL && k == gray &&
+		    (ret = write_files(&b, outbase, orig)) != 0) {
+			fprintf(stderr, "%s: %s\n", outbase, strerror(ret));
+			return (ret);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Move the samples, now in the order orig (orig[s] is the original number
+ * of sample s), into the order perm, and make that orig.
+ */
+int
+apply(bench_t *b, int *orig, int *perm)
+{
+	int *inv, s, ret;
+
+	if ((inv = malloc(b->nsamples * sizeof(int))) == NULL)
+		return (ENOMEM);
+	for (s = 0; s < b->nsamples; s++)
+		inv[orig[s]] = s;
+	for (s = 0; s < b->nsamples; s++)
+		orig[s] = inv[perm[s]];
+	if ((ret = samples_permute(b->rules, b->nrules, b->nsamples, orig)) ||
+	    (ret = samples_permute(b->labels, b->nlabels, b->nsamples, orig))) {
+		free(inv);
+		return (ret);
+	}
+	memcpy(orig, perm, b->nsamples * sizeof(int));
+	free(inv);
+	return (0);
+}
+
+void
+measure(bench_t *b, const char *name)
+{
+	struct timeval tv_acc, tv_start, tv_end;
+	v_entry **cv, caught, w;
+	long nruns, nuniform, nplain, ncompressed, nvisited, nwords, sum;
+	int i, j, k, r, s, nentries, len, reps, *counts;
+	int prev, bit, ret;
+	double plain, compressed, cascade;
+
+	nentries = (b->nsamples + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+	nruns = nuniform = nplain = ncompressed = 0;
+	for (r = 1; r < b->nrules; r++) {
+		prev = -1;
+		for (s = 0; s < b->nsamples; s++) {
+			bit = rule_isset(b->rules[r].truthtable,
+			    b->nsamples, s);
+			if (bit != prev)
+				nruns++;
+			prev = bit;
+		}
+		for (i = 0; i < nentries; i++) {
+			w = VWORD(b->rules[r].truthtable, i);
+			if (w == 0 || w == ~(v_entry)0)
+				nuniform++;
+		}
+	}
+
+	/* Compress every rule but the default; keep the top ones. */
+	if ((cv = calloc(b->nrules, sizeof(v_entry *))) == NULL)
+		return;
+	for (r = 1; r < b->nrules; r++) {
+		if ((ret = vector_compress(b->rules[r].truthtable,
+		    b->nsamples, cv + r, &len)) != 0) {
+			fprintf(stderr, "reorder: %s\n", strerror(ret));
+			return;
+		}
+		nplain += nentries;
+		ncompressed += len;
+	}
+
+	/* The cascade, over enough repetitions to take a while. */
+	if ((counts = malloc(2 * MAXLIST * sizeof(int))) == NULL)
+		return;
+	reps = 20000000 / ((long)b->nlists * nentries * MAXLIST / 2) + 1;
+	sum = 0;
+	INIT_TIME(tv_acc);
+	START_TIME(tv_start);
+	for (k = 0; k < reps; k++)
+		for (i = 0; i < b->nlists; i++) {
+			memset(counts, 0, 2 * MAXLIST * sizeof(int));
+			rules_cascade(b->lists + i * MAXLIST, b->lens[i],
+			    b->rules, b->labels[1].truthtable, NULL,
+			    0, nentries, counts);
+			for (j = 0; j < 2 * b->lens[i]; j++)
+				sum += counts[j];
+		}
+	END_TIME(tv_start, tv_end, tv_acc);
+	cascade = seconds(&tv_acc) / reps / b->nlists;
+	assert(b->cascade_sum == 0 || b->cascade_sum == sum / reps);
+	b->cascade_sum = sum / reps;
+	/* The rule entries the cascade looked at, counted apart. */
+	nvisited = nwords = 0;
+	for (i = 0; i < b->nlists; i++)
+		for (s = 0; s < nentries; s++) {
+			caught = 0;
+			for (j = 0; j < b->lens[i] && caught != ~(v_entry)0;
+			    j++) {
+				caught |= VWORD(b->rules[b->lists[i * MAXLIST +
+				    j]].truthtable, s);
+				nvisited++;
+			}
+			nwords += b->lens[i];
+		}
+
+	/* Every pair of the top rules, plain and compressed. */
+	reps = 20000000 / (b->ntop * b->ntop * nentries / 2 + 1) + 1;
+	sum = 0;
+	INIT_TIME(tv_acc);
+	START_TIME(tv_start);
+	for (k = 0; k < reps; k++)
+		for (i = 0; i < b->ntop; i++)
+			for (j = 0; j < i; j++)
+				sum += rule_vandcnt(TOP(b, i), TOP(b, j),
+				    b->nsamples);
+	END_TIME(tv_start, tv_end, tv_acc);
+	plain = seconds(&tv_acc);
+	assert(b->pair_sum == 0 || b->pair_sum == sum / reps);
+	b->pair_sum = sum / reps;
+	INIT_TIME(tv_acc);
+	START_TIME(tv_start);
+	for (k = 0; k < reps; k++)
+		for (i = 0; i < b->ntop; i++)
+			for (j = 0; j < i; j++)
+				sum -= cvector_andcnt(cv[b->top[i]],
+				    cv[b->top[j]], b->nsamples);
+	END_TIME(tv_start, tv_end, tv_acc);
+	compressed = seconds(&tv_acc);
+	assert(sum == 0);
+
+	printf("%s:\n", name);
+	printf("\t%.1f runs per rule, %.1f%% of entries uniform, "
+	    "compressed to %.1f%%\n",
+	    (double)nruns / (b->nrules - 1),
+	    100.0 * nuniform / ((long)(b->nrules - 1) * nentries),
+	    100.0 * ncompressed / nplain);
+	printf("\tcascade: %.2f usec per list, %.1f%% of rule entries "
+	    "skipped\n", 1e6 * cascade, 100.0 * (nwords - nvisited) / nwords);
+	printf("\tpairs of %d rules: %.3f usec plain, %.3f usec compressed\n",
+	    b->ntop, 1e6 * plain / reps / (b->ntop * (b->ntop - 1) / 2),
+	    1e6 * compressed / reps / (b->ntop * (b->ntop - 1) / 2));
+
+	for (r = 1; r < b->nrules; r++)
+		free(cv[r]);
+	free(cv);
+	free(counts);
+}
+
+/* Write a vector as makedata does: one 0 or 1 per sample. */
+static void
+write_bits(FILE *fp, VECTOR v, int nsamples)
+{
+	int s;
+
+	for (s = 0; s < nsamples; s++)
+		fprintf(fp, s == 0 ? "%d" : " %d", rule_isset(v, nsamples, s));
+	fputc('\n', fp);
+}
+
+int
+write_files(bench_t *b, const char *base, int *orig)
+{
+	FILE *fp;
+	char *path;
+	int i, r, s;
+	static const char *ext[] = { ".out", ".Y", ".perm" };
+
+	if ((path = malloc(strlen(base) + 6)) == NULL)
+		return (ENOMEM);
+	for (i = 0; i < 3; i++) {
+		sprintf(path, "%s%s", base, ext[i]);
+		if ((fp = fopen(path, "w")) == NULL) {
+			free(path);
+			return (errno);
+		}
+		if (i == 0)
+			for (r = 1; r < b->nrules; r++) {
+				fprintf(fp, "%s\t", b->rules[r].features);
+				write_bits(fp, b->rules[r].truthtable,
+				    b->nsamples);
+			}
+		else if (i == 1)
+			for (s = 0; s < b->nsamples; s++)
+				for (r = 0; r < b->nlabels; r++)
+					fprintf(fp, "%d%c", rule_isset(
+					    b->labels[r].truthtable,
+					    b->nsamples, s),
+					    r + 1 < b->nlabels ? ' ' : '\n');
+		else
+			for (s = 0; s < b->nsamples; s++)
+				fprintf(fp, "%d\n", orig[s]);
+		if (fclose(fp) != 0) {
+			free(path);
+			return (errno);
+		}
+	}
+	printf("wrote %s.out, %s.Y and %s.perm\n", base, base, base);
+	free(path);
+	return (0);
+}
@@ -0,0 +1,359 @@
+/*
+ * Copyright 2015 President and Fellows of Harvard College.
+ * All rights reserved.
+ */
+
+/*
+ * Random numbers for proposals.
+ *
+ * Each chain has its own generator, xoshiro256** (Blackman and Vigna),
+ * seeded through splitmix64 so that neighbouring seeds give unrelated
+ * streams.  Its whole state is four words, with nothing global, so
+ * chains on different threads never share it and a checkpoint can save
+ * it as it is.  rng_int draws an integer below n without the bias of
+ * scaling a float, by Lemire's multiply-and-reject.
+ *
+ * An alias table (Walker's method, built as Vose does) draws from a
+ * fixed discrete distribution, such as the prior on list length or on
+ * rule cardinality, in constant time: pick an entry uniformly, then keep
+ * it or take its alias.
+ *
+ * A rule index keeps the rules that are not on a list so that a proposal
+ * can pick one, and the list can take one or give one back, in constant
+ * time however many rules there are.  The unused rules sit at the front
+ * of an array and each rule's place in it is kept alongside, so taking
+ * a rule swaps it with the last unused one.  For drawing a list from the
+ * prior, the index also keeps the members of the unused rules by
+ * cardinality, the same way: a class of equivalent rules (rules_dedup)
+ * has one member for each of its rules, so picking a member uniformly
+ * from one cardinality weights the classes by their multiplicities.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rule.h"
+
+static uint64_t
+rotl(uint64_t x, int k)
+{
+	return ((x << k) | (x >> (64 - k)));
+}
+
+static uint64_t
+splitmix64(uint64_t *x)
+{
+	uint64_t z;
+
+	z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return (z ^ (z >> 31));
+}
+
+void
+rng_seed(rng_t *g, uint64_t seed)
+{
+	int i;
+
+	/* splitmix64 never gives four 0's, the one state to avoid. */
+	for (i = 0; i < 4; i++)
+		g->s[i] = splitmix64(&seed);
+}
+
+uint64_t
+rng_next(rng_t *g)
+{
+	uint64_t r, t;
+
+	r = rotl(g->s[1] * 5, 7) * 9;
+	t = g->s[1] << 17;
+	g->s[2] ^= g->s[0];
+	g->s[3] ^= g->s[1];
+	g->s[1] ^= g->s[2];
+	g->s[0] ^= g->s[3];
+	g->s[2] ^= t;
+	g->s[3] = rotl(g->s[3], 45);
+	return (r);
+}
+
+/* A uniform double in [0, 1). */
+double
+rng_uniform(rng_t *g)
+{
+	return ((rng_next(g) >> 11) * 0x1.0p-53);
+}
+
+/*
+ * A uniform integer in [0, n), n > 0.  The top 32 bits of a draw times n
+ * land in one of n buckets of 2^32; we reject the few draws that would
+ * make the low buckets larger.
+ */
+int
+rng_int(rng_t *g, int n)
+{
+	uint64_t m;
+	uint32_t t;
+
+	m = (rng_next(g) >> 32) * (uint32_t)n;
+	if ((uint32_t)m < (uint32_t)n) {
+		t = -(uint32_t)n % (uint32_t)n;
+		while ((uint32_t)m < t)
+			m = (rng_next(g) >> 32) * (uint32_t)n;
+	}
+	return ((int)(m >> 32));
+}
+
+/*
+ * Build an alias table for drawing lo + i with probability proportional
+ * to w[i], i = 0 .. n-1.  The weights must not be negative, nor all 0.
+ */
+int
+alias_init(alias_t *a, double *w, int n, int lo)
+{
+	double total;
+	int i, s, l, ns, nl, *small, *large;
+
+	memset(a, 0, sizeof(alias_t));
+	if (n < 1)
+		return (EINVAL);
+	total = 0;
+	for (i = 0; i < n; i++) {
+		if (!(w[i] >= 0))
+			return (EINVAL);
+		total += w[i];
+	}
+	if (total <= 0)
+		return (EINVAL);
+	a->prob = malloc(n * sizeof(double));
+	a->alias = malloc(n * sizeof(int));
+	small = malloc(2 * n * sizeof(int));
+	if (a->prob == NULL || a->alias == NULL || small == NULL) {
+		free(small);
+		alias_free(a);
+		return (ENOMEM);
+	}
+	a->n = n;
+	a->lo = lo;
+
+	/* Scale to a mean of 1 and sort into below and at or above it. */
+	large = small + n;
+	ns = nl = 0;
+	for (i = 0; i < n; i++) {
+		a->prob[i] = w[i] * n / total;
+		a->alias[i] = i;
+		if (a->prob[i] < 1)
+			small[ns++] = i;
+		else
+			large[nl++] = i;
+	}
+	/* Top up each small entry from a large one. */
+	while (ns > 0 && nl > 0) {
+		s = small[--ns];
+		l = large[--nl];
+		a->alias[s] = l;
+		a->prob[l] -= 1 - a->prob[s];
+		if (a->prob[l] < 1)
+			small[ns++] = l;
+		else
+			large[nl++] = l;
+	}
+	/* What is left is full, but for rounding. */
+	while (nl > 0)
+		a->prob[large[--nl]] = 1;
+	while (ns > 0)
+		a->prob[small[--ns]] = 1;
+	free(small);
+	return (0);
+}
+
+int
+alias_draw(alias_t *a, rng_t *g)
+{
+	int i;
+
+	i = rng_int(g, a->n);
+	if (rng_uniform(g) >= a->prob[i])
+		i = a->alias[i];
+	return (a->lo + i);
+}
+
+void
+alias_free(alias_t *a)
+{
+	free(a->prob);
+	free(a->alias);
+	memset(a, 0, sizeof(alias_t));
+}
+
+/* The number of ints in an index's block. */
+static size_t
+ruleindex_size(int nrules, int maxcard, int nmembers)
+{
+	return (3 * (size_t)nrules + 1 + 2 * (size_t)(maxcard + 1) + 1 +
+	    4 * (size_t)nmembers);
+}
+
+/*
+ * Set up an index of rules 1 .. nrules-1 (the default rule is never in
+ * it), all unused.  mult holds the rules' multiplicities, as in dedup_t
+ * (mult[r * (maxcard + 1) + k] members of cardinality k); with mult NULL
+ * the index is not kept by cardinality.
+ */
+int
+ruleindex_init(ruleindex_t *ix, int nrules, int maxcard, int *mult)
+{
+	int *p, r, k, e, j, nmembers;
+
+	memset(ix, 0, sizeof(ruleindex_t));
+	if (nrules < 1 || maxcard < 0)
+		return (EINVAL);
+	if (mult == NULL)
+		maxcard = 0;
+	nmembers = 0;
+	if (mult != NULL)
+		for (r = 1; r < nrules; r++)
+			for (k = 1; k <= maxcard; k++)
+				nmembers += mult[r * (maxcard + 1) + k];
+	if ((p = malloc(ruleindex_size(nrules,
+	    maxcard, nmembers) * sizeof(int))) == NULL)
+		return (ENOMEM);
+	ix->n_rules = nrules;
+	ix->maxcard = maxcard;
+	ix->n_members = nmembers;
+	ix->unused = p;
+	ix->where = p += nrules;
+	ix->first = p += nrules;
+	ix->n_card = p += nrules + 1;
+	ix->start = p += maxcard + 1;
+	ix->card = p += maxcard + 2;
+	ix->owner = p += nmembers;
+	ix->members = p += nmembers;
+	ix->mpos = p + nmembers;
+
+	/* Number the members class by class; lay them out by cardinality. */
+	memset(ix->start, 0, (maxcard + 2) * sizeof(int));
+	e = 0;
+	for (r = 0; r < nrules; r++) {
+		ix->first[r] = e;
+		if (mult == NULL || r == 0)
+			continue;
+		for (k = 1; k <= maxcard; k++)
+			for (j = 0; j < mult[r * (maxcard + 1) + k]; j++) {
+				ix->card[e] = k;
+				ix->owner[e++] = r;
+				ix->start[k + 1]++;
+			}
+	}
+	ix->first[nrules] = e;
+	for (k = 1; k <= maxcard + 1; k++)
+		ix->start[k] += ix->start[k - 1];
+	ruleindex_reset(ix);
+	return (0);
+}
+
+/* Mark every rule unused. */
+void
+ruleindex_reset(ruleindex_t *ix)
+{
+	int r, k, e;
+
+	ix->n_unused = 0;
+	ix->where[0] = -1;
+	for (r = 1; r < ix->n_rules; r++) {
+		ix->where[r] = ix->n_unused;
+		ix->unused[ix->n_unused++] = r;
+	}
+	for (k = 0; k <= ix->maxcard; k++)
+		ix->n_card[k] = 0;
+	for (e = 0; e < ix->n_members; e++) {
+		k = ix->card[e];
+		ix->mpos[e] = ix->start[k] + ix->n_card[k]++;
+		ix->members[ix->mpos[e]] = e;
+	}
+}
+
+/* Make ix a copy of from, which must have been set up alike. */
+void
+ruleindex_copy(ruleindex_t *ix, ruleindex_t *from)
+{
+	memcpy(ix->unused, from->unused, ruleindex_size(from->n_rules,
+	    from->maxcard, from->n_members) * sizeof(int));
+	ix->n_unused = from->n_unused;
+}
+
+/* Swap the members at places i and j. */
+static void
+member_swap(ruleindex_t *ix, int i, int j)
+{
+	int a, b;
+
+	a = ix->members[i];
+	b = ix->members[j];
+	ix->members[i] = b;
+	ix->members[j] = a;
+	ix->mpos[a] = j;
+	ix->mpos[b] = i;
+}
+
+/* Take unused rule r (for the list). */
+void
+ruleindex_take(ruleindex_t *ix, int r)
+{
+	int i, last, e, k;
+
+	i = ix->where[r];
+	last = ix->unused[--ix->n_unused];
+	ix->unused[i] = last;
+	ix->where[last] = i;
+	ix->unused[ix->n_unused] = r;
+	ix->where[r] = -1;
+	for (e = ix->first[r]; e < ix->first[r + 1]; e++) {
+		k = ix->card[e];
+		member_swap(ix, ix->mpos[e], ix->start[k] + --ix->n_card[k]);
+	}
+}
+
+/* Give rule r back. */
+void
+ruleindex_put(ruleindex_t *ix, int r)
+{
+	int i, e, k;
+
+	i = ix->n_unused++;
+	ix->unused[i] = r;
+	ix->where[r] = i;
+	for (e = ix->first[r]; e < ix->first[r + 1]; e++) {
+		k = ix->card[e];
+		member_swap(ix, ix->mpos[e], ix->start[k] + ix->n_card[k]++);
+	}
+}
+
+/* A uniformly chosen unused rule, or -1 if there are none. */
+int
+ruleindex_pick(ruleindex_t *ix, rng_t *g)
+{
+	if (ix->n_unused == 0)
+		return (-1);
+	return (ix->unused[rng_int(g, ix->n_unused)]);
+}
+
+/*
+ * An unused rule with a member of cardinality k, chosen with probability
+ * proportional to how many it has, or -1 if there are none.
+ */
+int
+ruleindex_pick_card(ruleindex_t *ix, int k, rng_t *g)
+{
+	if (k < 1 || k > ix->maxcard || ix->n_card[k] == 0)
+		return (-1);
+	return (ix->owner[ix->members[ix->start[k] +
+	    rng_int(g, ix->n_card[k])]]);
+}
+
+void
+ruleindex_free(ruleindex_t *ix)
+{
+	free(ix->unused);
+	memset(ix, 0, sizeof(ruleindex_t));
+}
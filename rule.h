@@ -3,6 +3,7 @@
  * All rights reserved.
  */
 
+#include <stdint.h>
 #ifdef GMP
 #include <gmp.h>
 const int mp_bits_per_limb;
@@ -37,14 +38,54 @@ const int mp_bits_per_limb;
  * Define types for bit vectors.
  */
 typedef unsigned long v_entry;
+#define BITS_PER_ENTRY (sizeof(v_entry) * 8)
 #ifdef GMP
 typedef mpz_t VECTOR;
 #define VECTOR_ASSIGN(dest, src) mpz_init_set(dest, src)
+#define VWORD(v, i) ((v_entry)mpz_getlimbn(v, i))	/* 0 past the end. */
 #else
 typedef v_entry *VECTOR;
 #define VECTOR_ASSIGN(dest, src) dest = src
+#define VWORD(v, i) ((v)[i])
 #endif
 
+/*
+ * The sample held by bit k of entry w of a vector of n bits, as rule_isset
+ * numbers them; the bit is in use if w * BITS_PER_ENTRY + k < n.
+ */
+#define NBITS(n, w)	((n) - (w) * (int)BITS_PER_ENTRY)
+#ifdef GMP
+#define BIT_SAMPLE(n, w, k)	(NBITS(n, w) - 1 - (k))
+#else
+#define BIT_SAMPLE(n, w, k)	((w) * (int)BITS_PER_ENTRY - 1 - (k) + \
+	(NBITS(n, w) < (int)BITS_PER_ENTRY ? NBITS(n, w) : (int)BITS_PER_ENTRY))
+#endif
+
+/* The number of the lowest bit set in a nonzero entry. */
+#ifdef __GNUC__
+#define FIRST_ONE(v)	__builtin_ctzl(v)
+#else
+#define FIRST_ONE(v)	first_one(v)
+#endif
+
+/*
+ * Kernels for vectors of one number of entries (kernels.c).  The rule_v*
+ * routines use vkernel's when their vectors are that size.
+ */
+typedef struct vkernel {
+	int n_entries;
+	int (*vand)(v_entry *, v_entry *, v_entry *);
+	int (*vor)(v_entry *, v_entry *, v_entry *);
+	int (*vandnot)(v_entry *, v_entry *, v_entry *);
+	int (*vandcnt)(v_entry *, v_entry *);
+} vkernel_t;
+
+extern vkernel_t *vkernel;
+
+/* The alignment the kernels assume of their vectors. */
+#define KERNEL_ALIGN	16
+#define VALIGNED(p)	(((uintptr_t)(p) & (KERNEL_ALIGN - 1)) == 0)
+
 
 
 /*
@@ -56,6 +97,7 @@ typedef v_entry *VECTOR;
 typedef struct rule {
 	char *features;			/* Representation of the rule. */
 	int support;			/* Number of 1's in truth table. */
+	int cardinality;		/* Number of attributes in features. */
 	VECTOR truthtable;		/* Truth table; one bit per sample. */
 } rule_t;
 
@@ -63,6 +105,7 @@ typedef struct ruleset_entry {
 	unsigned rule_id;
 	int ncaptured;			/* Number of 1's in bit vector. */
 	VECTOR captures;		/* Bit vector. */
+	int *refs;			/* Sharers of captures, or NULL. */
 } ruleset_entry_t;
 
 typedef struct ruleset {
@@ -72,18 +115,303 @@ typedef struct ruleset {
 	ruleset_entry_t rules[];	/* Array of rules. */
 } ruleset_t;
 
+/*
+ * Rows that rules_append_held (append.c) holds back until appending them
+ * is worth a pass over every vector.
+ */
+typedef struct appendbuf {
+	int n_rows;
+	int n_alloc;
+	char **rows;			/* Private copies of the lines. */
+} appendbuf_t;
+
+typedef struct checkpointer checkpointer_t;
+typedef struct tracer tracer_t;
+typedef struct trace_reader trace_reader_t;
+
+/*
+ * A lazy ruleset (lazy.c) keeps only counts; captures vectors are built
+ * on demand from the truth tables and a checkpoint of what the earlier
+ * rules caught every interval positions.
+ */
+typedef struct lazyset_entry {
+	unsigned rule_id;
+	int ncaptured;			/* Samples captured. */
+	int ncaptured1;			/* ... that are in class 1. */
+} lazyset_entry_t;
+
+typedef struct lazyset {
+	int n_rules;
+	int n_alloc;
+	int n_samples;
+	int n_words;			/* Vector entries per vector. */
+	rule_t *rules;
+	rule_t *label;			/* Class 1 samples, or NULL. */
+	int interval;			/* Positions between checkpoints. */
+	int n_ckpt;
+	v_entry **ckpt;			/* What positions before k*interval
+					   caught, for k = 1..n_ckpt. */
+	int n_lru;
+	int lru_init;			/* Slots whose vectors exist. */
+	struct lazy_slot *lru;		/* Materialized entries. */
+	unsigned long clock;
+	long nhits;			/* lazyset_entry found in the LRU. */
+	long nmisses;			/* ... and not. */
+#ifdef GMP
+	v_entry *scratch;
+#endif
+	lazyset_entry_t *entries;
+} lazyset_t;
+
+/*
+ * Equivalence classes of rules with identical truth tables (dedup.c).
+ */
+typedef struct dedup {
+	int n_orig;			/* Rules before deduplication. */
+	int n_classes;
+	int *class_of;			/* Class of each original rule. */
+	char **features;		/* Features of each original rule. */
+	int maxcard;			/* Largest cardinality. */
+	int *mult;			/* Members of each class, by cardinality. */
+} dedup_t;
+#define DEDUP_MULT(dd, c, k)	((dd)->mult[(c) * ((dd)->maxcard + 1) + (k)])
+
+/*
+ * A rule list compiled for classifying rows of attributes (match.c).
+ * Rule i holds for a row if the row has every attribute in masks[i].
+ */
+typedef struct matcher {
+	int n_rules;
+	int n_attrs;			/* Attributes the rules mention. */
+	int n_words;			/* Entries per mask or encoded row. */
+	char **names;			/* Attribute names, by id. */
+	int n_slots;
+	int *slots;			/* Hash table of ids, by name. */
+	v_entry *masks;			/* n_words entries per rule. */
+	double *preds;			/* Prediction of each rule. */
+} matcher_t;
+
+/*
+ * What a work-stealing pool run (pool.c) did.
+ */
+typedef struct pool_stats {
+	int n_threads;
+	double wall;			/* Seconds from start to finish. */
+	double busy;			/* Seconds in jobs, all threads. */
+	double cpu;			/* CPU seconds, all threads. */
+	long nstolen;			/* Ranges stolen. */
+} pool_stats_t;
+
+/*
+ * The truth tables transposed (transpose.c): for each sample, a bitmap of
+ * the rules it satisfies, n_words entries long.  The samples are stored in
+ * blocks, one for each entry of a truth table, and within a block either
+ * sample by sample (RM_ROWS) or entry by entry (RM_BLOCKED).
+ */
+typedef struct rulematrix {
+	int n_rules;
+	int n_samples;
+	int n_words;
+	int layout;
+	v_entry *bits;
+} rulematrix_t;
+
+#define RM_ROWS		0		/* Each sample's bitmap together. */
+#define RM_BLOCKED	1		/* Bit-sliced: each entry together. */
+
+/*
+ * Worker processes, each holding a shard of the samples of every truth
+ * table and a ruleset over it (shard.c).
+ */
+typedef struct shards {
+	int n_workers;
+	int n_rules;
+	int n_samples;
+	int n_nodes;			/* NUMA nodes bound to, or 0. */
+	int *pids;
+	size_t ctl_size;		/* Bytes of region per worker. */
+	size_t region_size;
+	char *region;			/* Shared with the workers. */
+} shards_t;
+
+/*
+ * What a trace (trace.c) took in, and one state read back from one.
+ */
+typedef struct trace_stats {
+	long n_kept;			/* States queued ... */
+	long n_dropped;			/* ... and dropped, queue full. */
+	long n_bytes;			/* Bytes of records written. */
+} trace_stats_t;
+
+typedef struct trace_state {
+	int chain;
+	long step;
+	double logpost;
+	int n_ids;			/* 0 at the end of the trace. */
+	int *ids;			/* Good until the next state is read. */
+} trace_state_t;
+
+/* Operations for shards_send. */
+#define SHARD_ADD	1		/* Add rule a at position b. */
+#define SHARD_DELETE	2		/* Delete the rule at position a. */
+#define SHARD_SWAP	3		/* Swap positions a and a + 1. */
+#define SHARD_MOVE	4		/* Move the rule at position a to b. */
+#define SHARD_RESET	5		/* Back to just the default rule. */
+#define SHARD_COUNTS	6		/* Nothing; for a reply. */
+#define SHARD_REPLY	0x100		/* Or'd in: send back the counts. */
+
+/* A xoshiro256** generator (rng.c). */
+typedef struct rng {
+	uint64_t s[4];
+} rng_t;
+
+/* An alias table, for drawing lo .. lo + n - 1 (rng.c). */
+typedef struct alias {
+	int n;
+	int lo;
+	double *prob;			/* Chance of keeping entry i ... */
+	int *alias;			/* ... rather than taking this one. */
+} alias_t;
+
+/*
+ * The rules not on a list (rng.c).  The unused rules are unused[0 ..
+ * n_unused-1], and rule r is at where[r], or -1 if it is on the list.
+ * Rule r's members are first[r] .. first[r+1]-1; member e is of
+ * cardinality card[e] and belongs to owner[e].  The unused members of
+ * cardinality k are members[start[k] .. start[k] + n_card[k] - 1], and
+ * member e is at mpos[e].  The arrays share one block, unused's.
+ */
+typedef struct ruleindex {
+	int n_rules;
+	int n_unused;
+	int *unused;
+	int *where;
+	int maxcard;
+	int n_members;
+	int *first;
+	int *card;
+	int *owner;
+	int *start;
+	int *n_card;
+	int *members;
+	int *mpos;
+} ruleindex_t;
+
+#define RULE_UNUSED(ix, r)	((ix)->where[r] >= 0)
+
+/*
+ * Bayesian rule list sampling (sampler.c).  A list is an array of rule
+ * ids, the last of which is the default rule, 0.
+ */
+typedef struct params {
+	double lambda;			/* Prior mean list length. */
+	double eta;			/* Prior mean rule cardinality. */
+	double alpha[2];		/* Dirichlet pseudocounts per class. */
+} params_t;
+
+typedef struct model {
+	int nrules;
+	int nsamples;
+	rule_t *rules;
+	VECTOR label;			/* Samples in class 1. */
+	rule_t *train;			/* Samples to learn from, or NULL
+					   for all; label must lie in it. */
+	params_t params;
+	int maxcard;			/* Largest rule cardinality. */
+	int *ncard;			/* Number of rules of each cardinality. */
+	int *mult;			/* As in dedup_t, one class per rule
+					   if rules were not deduplicated. */
+	double *logalpha;		/* log prior of each list length. */
+	double *logbeta;		/* log Poisson(eta) of cardinalities. */
+	double beta_z;			/* Mass of Poisson(eta) on 1..maxcard. */
+	alias_t lens;			/* Prior list lengths ... */
+	alias_t cards;			/* ... and rule cardinalities. */
+} model_t;
+
+typedef struct chain_stats {
+	long nsteps;
+	long naccepted;
+	long nwords;			/* Entries scanned deciding (approx). */
+	long ngrow;			/* Times a subset had to grow. */
+	long nverified;			/* Decisions checked against exact. */
+	long nerrors;			/* ... and found to differ. */
+} chain_stats_t;
+
+typedef struct chain {
+	model_t *model;
+	int *ids;			/* Current list. */
+	int n_ids;
+	int *pids;			/* Proposed list. */
+	int n_pids;
+	ruleindex_t *unused;		/* Rules not on the current list. */
+	ruleset_t *rs;			/* Current list's captures (exact). */
+	shards_t *shards;		/* ... or the workers holding them. */
+	double logpost;			/* Its log posterior (exact). */
+	double tcrit;			/* 0 for exact, else the test's t. */
+	double beta;			/* Inverse temperature (1: none). */
+	int verify;			/* Check approximate decisions. */
+	int *counts;			/* Per-rule counts, current list. */
+	int *pcounts;			/* Per-rule counts, proposed list. */
+	int nblocks;			/* Blocks of samples (approx). */
+	int *blocks;			/* The order we visit them in. */
+	int *bcounts;			/* Counts for one block. */
+	rng_t rng;
+	chain_stats_t stats;
+} chain_t;
+
+/*
+ * Parallel tempering (tempering.c): replica k is a chain at inverse
+ * temperature betas[k], betas[0] = 1, each run by its own thread.
+ */
+typedef struct tempering {
+	int n_replicas;
+	chain_t *chains;
+	double *betas;
+	int interval;			/* Steps between exchange rounds. */
+	long *ntried;			/* Exchanges tried between k and k+1. */
+	long *nswapped;			/* ... and made. */
+	int n_trace;			/* Steps traced per replica. */
+	double *trace;			/* Log posterior after each. */
+	double *best;			/* Best log posterior (betas[k] 1). */
+	int *best_ids;			/* ... and its list. */
+	int *n_best;
+	rng_t rng;			/* For exchanges. */
+	int start;			/* Go (1) or give up (-1). */
+	int arrived;			/* Replicas waiting to exchange. */
+	int sense;			/* Flips when the last one arrives. */
+	int round;
+	int error;
+	int round_error;		/* error as of the last round. */
+} tempering_t;
+
+/* Flags for ruleset_snapshot. */
+#define SNAP_CAPTURES	0x1		/* Save captures, not just counts. */
+#define SNAP_DEDUP	0x2		/* Rules collapsed (dedup.c). */
+
 /*
  * Functions in the library
  */
 int ruleset_init(int, int, int *, rule_t *, ruleset_t **);
-int ruleset_add(rule_t *, int, ruleset_t *, int, int);
-void ruleset_delete(rule_t *, int, ruleset_t *, int);
+int ruleset_add(rule_t *, int, ruleset_t **, int, int);
+int ruleset_delete(rule_t *, int, ruleset_t *, int);
 int ruleset_swap(ruleset_t *, int, int, rule_t *);
+int ruleset_move(rule_t *, int, ruleset_t **, int, int);
 void ruleset_print(ruleset_t *, rule_t *);
 void ruleset_entry_print(ruleset_entry_t *, int);
 void ruleset_free(ruleset_t *);
+int ruleset_clone(ruleset_t *, ruleset_t **);
+int ruleset_own(ruleset_t *, int);
 
 int rules_init(const char *, int *, int *, rule_t **);
+void rules_free(rule_t *, int);
+int labels_init(const char *, int *, int, rule_t **);
+int rules_append(rule_t *, int, int *, int, char **);
+void appendbuf_init(appendbuf_t *);
+int rules_append_held(appendbuf_t *, rule_t *, int, int *, int, char **);
+int rules_append_flush(appendbuf_t *, rule_t *, int, int *);
+void appendbuf_free(appendbuf_t *);
+int ruleset_extend(ruleset_t *, rule_t *, int);
+int rule_matches(const char *, char **, int);
 
 void rule_print(rule_t *, int, int);
 void rule_print_all(rule_t *, int, int);
@@ -91,8 +419,116 @@ void rule_vector_print(VECTOR, int);
 void rule_copy(VECTOR, VECTOR, int);
 
 int rule_vinit(int, VECTOR *);
-void rule_vdelete(mpz_t);
+void rule_vdelete(VECTOR);
+int rule_vextend(VECTOR *, int, int);
+int rule_isset(VECTOR, int, int);
+void rule_setbit(VECTOR, int, int);
 void rule_vand(VECTOR, VECTOR, VECTOR, int, int *);
 void rule_vandnot(VECTOR, VECTOR, VECTOR, int, int *);
 void rule_vor(VECTOR, VECTOR, VECTOR, int, int *);
+int rule_vandcnt(VECTOR, VECTOR, int);
+void rules_cascade(int *, int, rule_t *, VECTOR, rule_t *, int, int, int *);
+void cascade_positions(int *, int, rule_t *, int, int *);
 int count_ones(v_entry);
+int first_one(v_entry);
+int vkernel_select(int);
+
+/* Bayesian rule list sampling (sampler.c). */
+int model_init(model_t *, rule_t *, int, int, VECTOR, dedup_t *, params_t *);
+void model_free(model_t *);
+double list_logprior(model_t *, int *, int);
+double list_loglik(model_t *, int *, int, double);
+double list_logposterior(model_t *, int *, int);
+int chain_init(chain_t *, model_t *, double, unsigned);
+int chain_step(chain_t *);
+int chain_set_list(chain_t *, int *, int);
+int chain_fork(chain_t *, chain_t *, unsigned);
+int chain_shard(chain_t *, shards_t *);
+void chain_swap_state(chain_t *, chain_t *);
+void chain_free(chain_t *);
+int tempering_init(tempering_t *, model_t *, int, double, int, unsigned);
+int tempering_run(tempering_t *, int, int);
+void tempering_free(tempering_t *);
+double trace_ess(double *, int);
+
+/* Random numbers for proposals (rng.c). */
+void rng_seed(rng_t *, uint64_t);
+uint64_t rng_next(rng_t *);
+double rng_uniform(rng_t *);
+int rng_int(rng_t *, int);
+int alias_init(alias_t *, double *, int, int);
+int alias_draw(alias_t *, rng_t *);
+void alias_free(alias_t *);
+int ruleindex_init(ruleindex_t *, int, int, int *);
+void ruleindex_reset(ruleindex_t *);
+void ruleindex_copy(ruleindex_t *, ruleindex_t *);
+void ruleindex_take(ruleindex_t *, int);
+void ruleindex_put(ruleindex_t *, int);
+int ruleindex_pick(ruleindex_t *, rng_t *);
+int ruleindex_pick_card(ruleindex_t *, int, rng_t *);
+void ruleindex_free(ruleindex_t *);
+
+/* Equivalent rules (dedup.c). */
+int rules_dedup(rule_t *, int *, int, dedup_t **);
+void dedup_free(dedup_t *);
+int dedup_nmembers(dedup_t *, int);
+
+/* Compiled rule lists (match.c). */
+int matcher_compile(ruleset_t *, rule_t *, double *, matcher_t **);
+void matcher_free(matcher_t *);
+void matcher_encode(matcher_t *, char **, int, v_entry *);
+void matcher_encode_line(matcher_t *, const char *, size_t, v_entry *);
+int matcher_match(matcher_t *, const v_entry *);
+void matcher_batch(matcher_t *, const v_entry *, int, int *);
+double matcher_predict(matcher_t *, char **, int);
+
+/* Lazy rulesets and memory accounting (lazy.c). */
+int lazyset_init(int, int, int *, rule_t *, rule_t *, int, int, lazyset_t **);
+void lazyset_free(lazyset_t *);
+int lazyset_add(lazyset_t *, int, int);
+void lazyset_delete(lazyset_t *, int);
+ruleset_entry_t *lazyset_entry(lazyset_t *, int);
+size_t lazyset_bytes(lazyset_t *);
+size_t ruleset_bytes(ruleset_t *);
+
+/* Work-stealing thread pool (pool.c). */
+int pool_run(int, int, int (*)(void *, int), void *, pool_stats_t *);
+
+/* Sample-major rule matrices (transpose.c). */
+int rulematrix_init(rulematrix_t *,
+    rule_t *, int, int, int, int, pool_stats_t *);
+int rulematrix_positions(rulematrix_t *, int *, int, int *, int, int *);
+void rulematrix_free(rulematrix_t *);
+
+/* Sample reordering and compressed vectors (permute.c). */
+int samples_order(rule_t *, int, int, VECTOR, int, int, int *);
+int samples_permute(rule_t *, int, int, int *);
+int vector_compress(VECTOR, int, v_entry **, int *);
+int cvector_andcnt(v_entry *, v_entry *, int);
+
+/* Sample-sharded worker processes (shard.c). */
+int rules_image_write(const char *, rule_t *, int, int, VECTOR);
+int shards_start(const char *, int, int, shards_t **);
+int shards_send(shards_t *, int, int, int);
+int shards_recv(shards_t *, int *, int *);
+void shards_stop(shards_t *);
+
+/* Snapshots and checkpoints (checkpoint.c). */
+int ruleset_snapshot(ruleset_t *,
+    int, int, void *, size_t, void **, size_t *);
+int ruleset_restore(void *, size_t,
+    rule_t *, int, int, int, ruleset_t **, void *, size_t *);
+int snapshot_write(const char *, void *, size_t);
+int snapshot_read(const char *, void **, size_t *);
+int checkpoint_start(const char *, checkpointer_t **);
+int checkpoint_post(checkpointer_t *, void *, size_t);
+int checkpoint_stop(checkpointer_t *);
+
+/* Traces of sampler states (trace.c). */
+int tracer_start(const char *, int, rule_t *, int, int, tracer_t **);
+int tracer_push(tracer_t *, int, long, double, int *, int);
+int tracer_stop(tracer_t *, trace_stats_t *);
+int trace_open(const char *, trace_reader_t **, int *, int *);
+int trace_next(trace_reader_t *, trace_state_t *);
+const char *trace_features(trace_reader_t *, int);
+void trace_close(trace_reader_t *);
@@ -3,6 +3,7 @@
  * All rights reserved.
  */
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,8 +14,8 @@
 /* Function declarations. */
 int ascii_to_vector(char *, size_t, int *, int *, VECTOR *);
 int make_default(VECTOR *, int);
+int count_items(const char *);
 #define RULE_INC 100
-#define BITS_PER_ENTRY (sizeof(v_entry) * 8)
 
 #ifdef GMP
 /* This is an incredible hack -- in order not to make all my bitmasks
@@ -65,7 +66,7 @@ rules_init(const char *infile, int *nrules, int *nsamples, rule_t **rules_ret)
 	char *line, *rulestr;
 	int rule_cnt, sample_cnt, rsize;
 	int i, ones, ret;
-	rule_t *rules;
+	rule_t *rules = NULL;
 	rule_t default_rule;
 	size_t len, rulelen;
 
@@ -94,6 +95,7 @@ rules_init(const char *infile, int *nrules, int *nsamples, rule_t **rules_ret)
 		if ((rules[rule_cnt].features = malloc(rulelen)) == NULL)
 			goto err;
 		(void)strncpy(rules[rule_cnt].features, rulestr, rulelen);
+		rules[rule_cnt].cardinality = count_items(rulestr);
 		/*
 		 * At this point "len" is a line terminated by a newline
 		 * at line[len-1]; let's make it a NUL and shorten the line
@@ -112,12 +114,14 @@ rules_init(const char *infile, int *nrules, int *nsamples, rule_t **rules_ret)
 	/* Now create the 0'th (default) rule. */
 	rules[0].support = sample_cnt;
 	rules[0].features = "default";
+	rules[0].cardinality = 0;
 	if (make_default(&rules[0].truthtable, sample_cnt) != 0)
 		goto err;
 
 	*nsamples = sample_cnt;
 	*nrules = rule_cnt;
 	*rules_ret = rules;
+	(void)vkernel_select(sample_cnt);
 
 	return (0);
 
@@ -136,6 +140,114 @@ err:
 	return (ret);
 }
 
+/*
+ * Free the rules returned by rules_init.  The default rule's features are
+ * a constant.
+ */
+void
+rules_free(rule_t *rules, int nrules)
+{
+	int i;
+
+	for (i = 0; i < nrules; i++) {
+		if (i != 0)
+			free(rules[i].features);
+		rule_vdelete(rules[i].truthtable);
+	}
+	free(rules);
+}
+
+/* Number of attributes in a rule's (comma-separated) features. */
+int
+count_items(const char *features)
+{
+	int n;
+
+	for (n = 1; *features != '\0'; features++)
+		if (*features == ',')
+			n++;
+	return (n);
+}
+
+/*
+ * Read the labels for nsamples samples.  The file has one line per
+ * sample, with a 1 in the column of the sample's class and 0's elsewhere
+ * (the .Y format used by BRL_code.py).  We return one rule_t per class,
+ * whose truth table selects the samples in that class.
+ */
+int
+labels_init(const char *infile, int *nlabels, int nsamples, rule_t **ret)
+{
+	FILE *fi;
+	char *line, *p, *end;
+	int i, k, ncols, ninit, sample;
+	rule_t *labels;
+	size_t len;
+
+	if ((fi = fopen(infile, "r")) == NULL)
+		return (errno);
+
+	labels = NULL;
+	ncols = ninit = 0;
+	for (sample = 0; (line = fgetln(fi, &len)) != NULL; sample++) {
+		if (sample >= nsamples)
+			goto err;
+
+		/* fgetln does not terminate the line; stop at its end. */
+		end = line + len;
+		if (labels == NULL) {
+			/* First line: count the classes. */
+			for (p = line; p < end; p++)
+				if (!isspace(*p) &&
+				    (p + 1 == end || isspace(p[1])))
+					ncols++;
+			if (ncols == 0 ||
+			    (labels = calloc(ncols, sizeof(rule_t))) == NULL)
+				goto err;
+			for (; ninit < ncols; ninit++) {
+				labels[ninit].features = "label";
+				if (rule_vinit(nsamples,
+				    &labels[ninit].truthtable) != 0)
+					goto err;
+			}
+		}
+
+		for (k = 0, p = line; p < end; k++) {
+			while (p < end && isspace(*p))
+				p++;
+			if (p == end)
+				break;
+			if (k >= ncols)
+				goto err;
+			if (*p == '1') {
+				rule_setbit(labels[k].truthtable,
+				    nsamples, sample);
+				labels[k].support++;
+			}
+			while (p < end && !isspace(*p))
+				p++;
+		}
+	}
+	(void)fclose(fi);
+	fi = NULL;
+	if (sample != nsamples)
+		goto err;
+
+	*nlabels = ncols;
+	*ret = labels;
+	return (0);
+
+err:
+	if (fi != NULL)
+		(void)fclose(fi);
+	if (labels != NULL) {
+		for (i = 0; i < ninit; i++)
+			rule_vdelete(labels[i].truthtable);
+		free(labels);
+	}
+	return (EINVAL);
+}
+
 /* Malloc a vector to contain nsamples bits. */
 int
 rule_vinit(int len, VECTOR *ret)
@@ -148,12 +260,13 @@ rule_vinit(int len, VECTOR *ret)
 	nentries = (len + BITS_PER_ENTRY - 1)/BITS_PER_ENTRY;
 	if ((*ret = calloc(nentries, sizeof(v_entry))) == NULL)
 		return(errno);
+	assert(VALIGNED(*ret));
 #endif
 	return (0);
 }
 
 void
-rule_vdelete(mpz_t v)
+rule_vdelete(VECTOR v)
 {
 #ifdef GMP
 	mpz_clear(v);
@@ -164,6 +277,96 @@ rule_vdelete(mpz_t v)
 	return;
 }
 
+/*
+ * Bit addressing.  Vectors built by ascii_to_vector hold sample 0 in the
+ * high-order bit: with GMP, sample i of n is bit n-1-i; without, full
+ * entries hold samples from the high-order bit down and the trailing
+ * partial entry holds its samples in its low-order bits.
+ */
+#ifndef GMP
+static inline v_entry
+bit_mask(int nsamples, int sample)
+{
+	int nbits;
+
+	if (sample / BITS_PER_ENTRY < nsamples / BITS_PER_ENTRY)
+		nbits = BITS_PER_ENTRY;
+	else
+		nbits = nsamples % BITS_PER_ENTRY;
+	return ((v_entry)1 << (nbits - 1 - sample % BITS_PER_ENTRY));
+}
+#endif
+
+int
+rule_isset(VECTOR v, int nsamples, int sample)
+{
+#ifdef GMP
+	return (mpz_tstbit(v, nsamples - 1 - sample));
+#else
+	return ((v[sample / BITS_PER_ENTRY] & bit_mask(nsamples, sample)) != 0);
+#endif
+}
+
+void
+rule_setbit(VECTOR v, int nsamples, int sample)
+{
+#ifdef GMP
+	mpz_setbit(v, nsamples - 1 - sample);
+#else
+	v[sample / BITS_PER_ENTRY] |= bit_mask(nsamples, sample);
+#endif
+}
+
+/*
+ * Grow a vector from oldn to newn samples; the new samples are 0.  This
+ * is exactly what ascii_to_vector would have produced had it seen the
+ * extra samples, so we shift the trailing partial entry up as it fills.
+ * Storage grows to the next power of two entries, so that a series of
+ * small extensions reallocates only a logarithmic number of times.
+ * Without GMP, that makes an extension cost amortized time proportional
+ * to the number of samples added.  With GMP, the samples are numbered
+ * from the high-order end, so the whole bignum still shifts up to make
+ * room at the bottom: one pass over its words, in place.
+ */
+int
+rule_vextend(VECTOR *v, int oldn, int newn)
+{
+	int oldent, newent, cap;
+#ifdef GMP
+
+	oldent = (oldn + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+	newent = (newn + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+	if (newent > oldent) {
+		for (cap = 1; cap < newent; cap <<= 1)
+			continue;
+		mpz_realloc2(*v, (mp_bitcnt_t)cap * BITS_PER_ENTRY);
+	}
+	mpz_mul_2exp(*v, *v, newn - oldn);
+#else
+	int i, tail;
+	v_entry *expand;
+
+	oldent = (oldn + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+	newent = (newn + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+	if (newent > oldent) {
+		for (cap = 1; cap < newent; cap <<= 1)
+			continue;
+		if ((expand = realloc(*v, cap * sizeof(v_entry))) == NULL)
+			return (errno);
+		*v = expand;
+		for (i = oldent; i < newent; i++)
+			(*v)[i] = 0;
+	}
+	if ((tail = oldn % BITS_PER_ENTRY) != 0) {
+		if (newn / BITS_PER_ENTRY > oldn / BITS_PER_ENTRY)
+			(*v)[oldent - 1] <<= BITS_PER_ENTRY - tail;
+		else
+			(*v)[oldent - 1] <<= newn - oldn;
+	}
+#endif
+	return (0);
+}
+
 /*
  * Convert an ascii sequence of 0's and 1's to a bit vector.
  * This is a hand-coded naive implementation; we'll also support
@@ -279,19 +482,22 @@ make_default(VECTOR *tt, int len)
 	mpz_init_set(mpz_hack_default_mask, *tt);
 	return (0);
 #else
-	int nbytes;
-
-	nbytes = (len + 7) / 8;
-	unsigned char *c;
+	int i, nentries;
+	v_entry *v;
 
-	if ((c = malloc(nbytes)) == NULL)
+	nentries = (len + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+	if ((v = malloc(nentries * sizeof(v_entry))) == NULL)
 		return (errno);
-	/* Set all full bytes */
-	memset(c, BYTE_MASK, nbytes);
-	/* Take care of a number of bits not divisible by 8. */
-	if (len % 8 != 0)
-		c[nbytes-1] = bit_ones[len % 8];
-	*tt = (VECTOR)c;
+	/* Set all full entries */
+	for (i = 0; i < nentries - (len % BITS_PER_ENTRY != 0); i++)
+		v[i] = ~(v_entry)0;
+	/*
+	 * Take care of a number of bits not divisible by the entry size;
+	 * like ascii_to_vector, the trailing bits are the low-order ones.
+	 */
+	if (len % BITS_PER_ENTRY != 0)
+		v[i] = ((v_entry)1 << (len % BITS_PER_ENTRY)) - 1;
+	*tt = v;
 
 	return (0);
 #endif
@@ -328,6 +534,7 @@ ruleset_init(int nrules,
 		cur_rule = rules + idarray[i];
 		cur_re = rs->rules + i;
 		cur_re->rule_id = idarray[i];
+		cur_re->refs = NULL;
 		if (rule_vinit(nsamples, &cur_re->captures) != 0)
 			goto err1;
 
@@ -361,47 +568,138 @@ err1:
 	return (ENOMEM);
 }
 
+/*
+ * Copy-on-write captures.  A clone shares every captures vector with the
+ * ruleset it came from; an entry's refs then points at a count of the
+ * entries holding the vector (refs is NULL while only one does).  Shared
+ * vectors are never changed: anything about to change an entry's
+ * captures calls ruleset_own first, which gives the entry a copy of its
+ * own.  The counts are not atomic, so a ruleset and its clones must stay
+ * in one thread.
+ */
+static void
+entry_release(ruleset_entry_t *re)
+{
+	if (re->refs != NULL && --*re->refs > 0)
+		return;
+	free(re->refs);
+	rule_vdelete(re->captures);
+}
+
 void
 ruleset_free(ruleset_t *rs)
 {
 	int i;
 	for (i = 0; i < rs->n_rules; i++)
-		rule_vdelete(rs->rules[i].captures);
+		entry_release(rs->rules + i);
 	free(rs);
 }
 
+/*
+ * Make a copy of a ruleset whose entries share the original's captures;
+ * this costs pointer copies, not vectors.
+ */
+int
+ruleset_clone(ruleset_t *rs, ruleset_t **retruleset)
+{
+	ruleset_t *clone;
+	ruleset_entry_t *re;
+	int i;
+
+	clone = malloc(sizeof(ruleset_t) +
+	    rs->n_rules * sizeof(ruleset_entry_t));
+	if (clone == NULL)
+		return (errno);
+	clone->n_alloc = rs->n_rules;
+	clone->n_samples = rs->n_samples;
+	for (i = 0; i < rs->n_rules; i++) {
+		re = rs->rules + i;
+		if (re->refs == NULL) {
+			if ((re->refs = malloc(sizeof(int))) == NULL) {
+				clone->n_rules = i;
+				ruleset_free(clone);
+				return (ENOMEM);
+			}
+			*re->refs = 1;
+		}
+		(*re->refs)++;
+		clone->rules[i] = *re;
+	}
+	clone->n_rules = rs->n_rules;
+	*retruleset = clone;
+	return (0);
+}
+
+/*
+ * Give entry i of rs captures of its own, copying them if they are
+ * shared.
+ */
+int
+ruleset_own(ruleset_t *rs, int i)
+{
+	ruleset_entry_t *re;
+	VECTOR copy;
+	int ret;
+
+	re = rs->rules + i;
+	if (re->refs == NULL)
+		return (0);
+	if (*re->refs > 1) {
+		if ((ret = rule_vinit(rs->n_samples, &copy)) != 0)
+			return (ret);
+		rule_copy(copy, re->captures, rs->n_samples);
+		(*re->refs)--;
+#ifdef GMP
+		re->captures[0] = copy[0];
+#else
+		re->captures = copy;
+#endif
+	} else
+		free(re->refs);
+	re->refs = NULL;
+	return (0);
+}
+
 /*
  * Add the specified rule to the ruleset at position ndx (shifting
- * all rules after ndx down by one).
+ * all rules after ndx down by one).  The ruleset may have to grow, so
+ * *rsp may change.  If we fail (for want of memory), the ruleset is
+ * otherwise unchanged.
  */
 int
-ruleset_add(rule_t *rules, int nrules, ruleset_t *rs, int newrule, int ndx)
+ruleset_add(rule_t *rules,
+    int nrules, ruleset_t **rsp, int newrule, int ndx)
 {
-	int i, ret, tmp;
-	rule_t *expand;
-	VECTOR captured;
+	int i, ncaptured, ret, tmp;
+	ruleset_t *rs, *expand;
+	VECTOR captured, newcap;
 
+	rs = *rsp;
 	/* Check for space. */
 	if (rs->n_alloc < rs->n_rules + 1) {
-		expand = realloc(rs->rules, 
+		expand = realloc(rs, sizeof(ruleset_t) +
 		    (rs->n_rules + 1) * sizeof(ruleset_entry_t));
 		if (expand == NULL)
-			return (errno);			
+			return (errno);
+		rs = *rsp = expand;
 		rs->n_alloc = rs->n_rules + 1;
 	}
 
-	/* Shift later rules down by 1. */
-	if (ndx != rs->n_rules)
-		memmove(rs->rules + (ndx + 1), rs->rules + ndx,
-		    sizeof(ruleset_entry_t) * rs->n_rules - ndx);
-
 	/*
 	 * Insert new rule.
-	 * 1. Compute what is already captured by earlier rules.
-	 * 2. Add rule into ruleset.
-	 * 3. Compute new captures for all rules following the new one.
+	 * 1. Compute what is already captured by earlier rules, and from
+	 *    that the new rule's captures.
+	 * 2. Take ownership of the captures of the rules that lose some to
+	 *    it; until now, nothing has changed.
+	 * 3. Add rule into ruleset.
+	 * 4. Compute new captures for all rules following the new one.
 	 */
-	rule_vinit(rs->n_samples, &captured);
+	if ((ret = rule_vinit(rs->n_samples, &captured)) != 0)
+		return (ret);
+	if ((ret = rule_vinit(rs->n_samples, &newcap)) != 0) {
+		rule_vdelete(captured);
+		return (ret);
+	}
 	if (ndx != 0) {
 		rule_copy(captured,
 		    rules[rs->rules[0].rule_id].truthtable, rs->n_samples);
@@ -412,45 +710,117 @@ ruleset_add(rule_t *rules, int nrules, ruleset_t *rs, int newrule, int ndx)
 		}
 
 	}
-	/* Insert new rule. */
+	rule_vandnot(newcap, rules[newrule].truthtable,
+	    captured, rs->n_samples, &ncaptured);
+	rule_vdelete(captured);
+	for (i = ndx; i < rs->n_rules; i++)
+		if (rule_vandcnt(rs->rules[i].captures,
+		    newcap, rs->n_samples) != 0 &&
+		    (ret = ruleset_own(rs, i)) != 0) {
+			rule_vdelete(newcap);
+			return (ret);
+		}
+
+	/* Shift later rules down by 1 and insert the new rule. */
+	if (ndx != rs->n_rules)
+		memmove(rs->rules + (ndx + 1), rs->rules + ndx,
+		    sizeof(ruleset_entry_t) * (rs->n_rules - ndx));
 	rs->rules[ndx].rule_id = newrule;
+	rs->rules[ndx].refs = NULL;
+	rs->rules[ndx].ncaptured = ncaptured;
+#ifdef GMP
+	rs->rules[ndx].captures[0] = newcap[0];
+#else
+	rs->rules[ndx].captures = newcap;
+#endif
 	rs->n_rules++;
-	if ((ret = rule_vinit(rs->n_samples, &rs->rules[ndx].captures)) != 0)
-		return (errno);
 
-	for (i = ndx; i < rs->n_rules; i++) {
-		rule_vandnot(rs->rules[i].captures,
-		    rules[rs->rules[i].rule_id].truthtable, captured,
-		    rs->n_samples, &rs->rules[i].ncaptured);
-		rule_vor(captured,
-		    rs->rules[i].captures, captured, rs->n_samples, &tmp);
-	}	
+	/*
+	 * Each following rule loses whatever it captured that the new rule
+	 * now captures; the others are left alone (and unshared).
+	 */
+	for (i = ndx + 1; i < rs->n_rules; i++) {
+		if (rule_vandcnt(rs->rules[i].captures,
+		    rs->rules[ndx].captures, rs->n_samples) == 0)
+			continue;
+		assert(rs->rules[i].refs == NULL);
+		rule_vandnot(rs->rules[i].captures, rs->rules[i].captures,
+		    rs->rules[ndx].captures, rs->n_samples,
+		    &rs->rules[i].ncaptured);
+	}
 	return(0);
 }
 
 /*
- * Delete the rule in the ndx-th position in the given ruleset.
+ * Take ownership of the captures of the entries that ruleset_delete will
+ * give some of ndx's captures to: those after ndx whose rules capture
+ * samples that ndx captures and the entries between them do not.
+ * Owning captures changes nothing else, so if this fails the ruleset is
+ * still as it was.  tmp_vec is scratch space.
  */
-void
+static int
+delete_own(rule_t *rules, ruleset_t *rs, int ndx, VECTOR tmp_vec)
+{
+	int i, nset, nleft, ret;
+	VECTOR left;
+
+	for (i = ndx + 1; i < rs->n_rules; i++)
+		if (rs->rules[i].refs != NULL)
+			break;
+	if (i == rs->n_rules)
+		return (0);
+	if ((ret = rule_vinit(rs->n_samples, &left)) != 0)
+		return (ret);
+	rule_copy(left, rs->rules[ndx].captures, rs->n_samples);
+	nleft = rs->rules[ndx].ncaptured;
+	for (i = ndx + 1; i < rs->n_rules && nleft != 0; i++) {
+		rule_vand(tmp_vec, rules[rs->rules[i].rule_id].truthtable,
+		    left, rs->n_samples, &nset);
+		if (nset == 0)
+			continue;
+		if ((ret = ruleset_own(rs, i)) != 0)
+			break;
+		rule_vandnot(left, left, tmp_vec, rs->n_samples, &nleft);
+	}
+	rule_vdelete(left);
+	return (ret);
+}
+
+/*
+ * Delete the rule in the ndx-th position in the given ruleset.  If we
+ * fail (for want of memory to copy shared captures), the ruleset is
+ * unchanged.
+ */
+int
 ruleset_delete(rule_t *rules, int nrules, ruleset_t *rs, int ndx)
 {
-	int i, nset;
+	int i, nset, ret;
 	VECTOR tmp_vec;
 
-	if (rule_vinit(rs->n_samples, &tmp_vec) != 0)
-		return;
+	/* We whittle away at the deleted rule's captures. */
+	if ((ret = ruleset_own(rs, ndx)) != 0 ||
+	    (ret = rule_vinit(rs->n_samples, &tmp_vec)) != 0)
+		return (ret);
+	if ((ret = delete_own(rules, rs, ndx, tmp_vec)) != 0) {
+		rule_vdelete(tmp_vec);
+		return (ret);
+	}
 	/*
 	 * Compute each following entry's new captures array which is its old
 	 * old captures array or'd with anything that was captured by ndx and
-	 * is captured by its rule.
+	 * is captured by its rule.  Entries that gain nothing are untouched.
 	 */
-	for (i = ndx + 1; i < rs->n_rules; i++) {
+	for (i = ndx + 1;
+	    i < rs->n_rules && rs->rules[ndx].ncaptured != 0; i++) {
 		/*
 		 * tmp_vec is going to get all the rules that were captured
 		 * by the deleted rule that the current rule also captures.
 		 */
 		rule_vand(tmp_vec, rules[rs->rules[i].rule_id].truthtable,
 		    rs->rules[ndx].captures, rs->n_samples, &nset);
+		if (nset == 0)
+			continue;
+		assert(rs->rules[i].refs == NULL);
 		rule_vor(rs->rules[i].captures, rs->rules[i].captures,
 		    tmp_vec, rs->n_samples, &rs->rules[i].ncaptured);
 
@@ -463,15 +833,15 @@ ruleset_delete(rule_t *rules, int nrules, ruleset_t *rs, int ndx)
 	}
 
 	rule_vdelete(tmp_vec);
-	rule_vdelete(rs->rules[ndx].captures);
+	entry_release(rs->rules + ndx);
 
 	/* Shift up cells if necessary. */
 	if (ndx != rs->n_rules - 1)
 		memmove(rs->rules + ndx, rs->rules + ndx + 1,
-		    sizeof(ruleset_entry_t) * (rs->n_rules - ndx));
+		    sizeof(ruleset_entry_t) * (rs->n_rules - ndx - 1));
 
 	rs->n_rules--;
-	return;
+	return (0);
 }
 
 /* dest must exist */
@@ -479,7 +849,7 @@ void
 rule_copy(VECTOR dest, VECTOR src, int len)
 {
 #ifdef GMP
-	mpz_init_set(dest, src);
+	mpz_set(dest, src);
 #else
 	int i, nentries;
 
@@ -490,6 +860,24 @@ rule_copy(VECTOR dest, VECTOR src, int len)
 #endif
 }
 
+/*
+ * Move the rule at position from to position to, as a delete followed by
+ * an add (both of which only touch the rules after the position they
+ * change).
+ */
+int
+ruleset_move(rule_t *rules, int nrules, ruleset_t **rsp, int from, int to)
+{
+	int rule_id, ret;
+
+	if (from == to)
+		return (0);
+	rule_id = (*rsp)->rules[from].rule_id;
+	if ((ret = ruleset_delete(rules, nrules, *rsp, from)) != 0)
+		return (ret);
+	return (ruleset_add(rules, nrules, rsp, rule_id, to));
+}
+
 /*
  * Swap rules i and j such that i + 1 = j.
  * 	newlycaught = (forall k<=i  k.captures) & j.tt
@@ -507,6 +895,8 @@ ruleset_swap(ruleset_t *rs, int i, int j, rule_t *rules)
 	assert(i <= rs->n_rules);
 	assert(j <= rs->n_rules);
 	assert(i + 1 == j);
+	if ((ret = ruleset_own(rs, i)) != 0 || (ret = ruleset_own(rs, j)) != 0)
+		return (ret);
 
 	/* Compute the new J.*/
 	if (i == 0) {
@@ -564,6 +954,10 @@ rule_vand(VECTOR dest, VECTOR src1, VECTOR src2, int nsamples, int *cnt)
 	count = 0;
 	nentries = (nsamples + BITS_PER_ENTRY - 1)/BITS_PER_ENTRY;
 	assert(dest != NULL);
+	if (vkernel != NULL && vkernel->n_entries == nentries) {
+		*cnt = vkernel->vand(dest, src1, src2);
+		return;
+	}
 	for (i = 0; i < nentries; i++) {
 		dest[i] = src1[i] & src2[i];
 		count += count_ones(dest[i]);
@@ -585,6 +979,10 @@ rule_vor(VECTOR dest, VECTOR src1, VECTOR src2, int nsamples, int *cnt)
 
 	count = 0;
 	nentries = (nsamples + BITS_PER_ENTRY - 1)/BITS_PER_ENTRY;
+	if (vkernel != NULL && vkernel->n_entries == nentries) {
+		*cnt = vkernel->vor(dest, src1, src2);
+		return;
+	}
 
 	for (i = 0; i < nentries; i++) {
 		dest[i] = src1[i] | src2[i];
@@ -620,6 +1018,10 @@ rule_vandnot(VECTOR dest,
 	nentries = (nsamples + BITS_PER_ENTRY - 1)/BITS_PER_ENTRY;
 	count = 0;
 	assert(dest != NULL);
+	if (vkernel != NULL && vkernel->n_entries == nentries) {
+		*ret_cnt = vkernel->vandnot(dest, src1, src2);
+		return;
+	}
 	for (i = 0; i < nentries; i++) {
 		dest[i] = src1[i] & ~src2[i];
 		count += count_ones(dest[i]);
@@ -630,6 +1032,81 @@ rule_vandnot(VECTOR dest,
 	return;
 }
 
+/* Count the 1's in src1 & src2 without storing the result. */
+int
+rule_vandcnt(VECTOR src1, VECTOR src2, int nsamples)
+{
+	int i, count, nentries;
+
+	count = 0;
+	nentries = (nsamples + BITS_PER_ENTRY - 1)/BITS_PER_ENTRY;
+#ifndef GMP
+	if (vkernel != NULL && vkernel->n_entries == nentries)
+		return (vkernel->vandcnt(src1, src2));
+#endif
+	for (i = 0; i < nentries; i++)
+		count += count_ones(VWORD(src1, i) & VWORD(src2, i));
+	return (count);
+}
+
+/*
+ * Run the capture cascade for the list of rules ids[0..n-1] over vector
+ * entries [w0, w1) only, without materializing any captures.  For each
+ * rule i we add the number of samples it captures in that range to
+ * counts[2*i] and the number of those that are also in label to
+ * counts[2*i+1].  Summing over disjoint ranges gives the counts for the
+ * whole list.  If mask is not NULL, only the samples in it are counted:
+ * the others start out caught.  Once every sample of an entry is caught,
+ * the rest of the list captures nothing there and we move on.
+ */
+void
+rules_cascade(int *ids, int n, rule_t *rules,
+    VECTOR label, rule_t *mask, int w0, int w1, int *counts)
+{
+	int i, w;
+	v_entry caught, c, lab;
+
+	for (w = w0; w < w1; w++) {
+		caught = mask == NULL ? 0 : ~VWORD(mask->truthtable, w);
+		lab = VWORD(label, w);
+		for (i = 0; i < n && caught != ~(v_entry)0; i++) {
+			c = VWORD(rules[ids[i]].truthtable, w) & ~caught;
+			counts[2 * i] += count_ones(c);
+			counts[2 * i + 1] += count_ones(c & lab);
+			caught |= c;
+		}
+	}
+}
+
+/*
+ * For each of the nsamples samples, the position on the list ids[0..n-1]
+ * of the rule that captures it, in pos.  This is the cascade again, one
+ * entry at a time; the last rule on the list, the default, gets whatever
+ * the others leave.
+ */
+void
+cascade_positions(int *ids, int n, rule_t *rules, int nsamples, int *pos)
+{
+	int i, k, w, nentries;
+	v_entry caught, c;
+
+	nentries = (nsamples + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+	for (w = 0; w < nentries; w++) {
+		caught = 0;
+		for (i = 0; i < n - 1 && caught != ~(v_entry)0; i++) {
+			c = VWORD(rules[ids[i]].truthtable, w) & ~caught;
+			caught |= c;
+			for (; c != 0; c &= c - 1)
+				pos[BIT_SAMPLE(nsamples, w, FIRST_ONE(c))] = i;
+		}
+		for (c = ~caught; c != 0; c &= c - 1) {
+			if ((k = FIRST_ONE(c)) >= NBITS(nsamples, w))
+				break;
+			pos[BIT_SAMPLE(nsamples, w, k)] = n - 1;
+		}
+	}
+}
+
 int
 count_ones(v_entry val)
 {
@@ -643,6 +1120,16 @@ count_ones(v_entry val)
 	return (count);
 }
 
+int
+first_one(v_entry val)
+{
+	int i;
+
+	for (i = 0; (val & 1) == 0; i++)
+		val >>= 1;
+	return (i);
+}
+
 void
 ruleset_print(ruleset_t *rs, rule_t *rules)
 {
@@ -0,0 +1,1175 @@
+/*
+ * Copyright 2015 President and Fellows of Harvard College.
+ * All rights reserved.
+ */
+
+/*
+ * Python interface to rulelib, so that BRL_code.py can use the native
+ * rule and ruleset code (see brl_native.py).
+ *
+ * rulelib.Rules holds a collection of rules and the training labels,
+ * either read from makedata output or built from BRL_code.py's X (a list
+ * of sets of sample indices, one per rule).  Truth tables and captures
+ * are handed out as read-only buffers over rulelib's own vectors, without
+ * copying: numpy.frombuffer(rules.truthtable(j), dtype=numpy.uint64) is a
+ * view of rule j's bits, laid out as described in rulelib.c.  (With GMP,
+ * the buffer holds only the limbs in use.)  An object with outstanding
+ * buffers refuses to change, as a bytearray does.
+ *
+ * rulelib.Model adds the prior hyperparameters and scores lists;
+ * rulelib.Chain is a Metropolis-Hastings chain over lists (sampler.c).
+ * Lists are Python sequences of rule ids ending with the default, 0.
+ *
+ * With GMP, rulelib keeps the default rule's vector in a global, which
+ * ruleset operations use.  We point it at the right Rules before each
+ * such operation, but rulesets or chains over Rules with different
+ * numbers of samples must not run in different threads at once.
+ */
+#include <Python.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "rule.h"
+
+#ifdef GMP
+extern mpz_t mpz_hack_default_mask;
+#endif
+
+#if PY_MAJOR_VERSION >= 3
+#define PyInt_FromLong		PyLong_FromLong
+#define PyString_FromString	PyUnicode_FromString
+#endif
+
+/* Anything that lends out its vectors. */
+#define EXPORTER_HEAD	PyObject_HEAD int exports;
+
+typedef struct {
+	EXPORTER_HEAD
+} exporter_t;
+
+typedef struct {
+	EXPORTER_HEAD
+	rule_t *rules;
+	int nrules;
+	int nsamples;
+	rule_t *labels;			/* labels[1] marks class 1. */
+	int nlabels;
+	rulematrix_t matrix;		/* Built when first asked for. */
+} Rules;
+
+typedef struct {
+	EXPORTER_HEAD
+	Rules *owner;
+	ruleset_t *rs;
+} Ruleset;
+
+typedef struct {
+	PyObject_HEAD
+	Rules *owner;
+	model_t model;
+} Model;
+
+typedef struct {
+	PyObject_HEAD
+	Model *owner;
+	chain_t chain;
+} Chain;
+
+/* A buffer over one vector; holds its owner's export count up. */
+typedef struct {
+	PyObject_HEAD
+	exporter_t *owner;
+	void *buf;
+	Py_ssize_t len;			/* In bytes. */
+	Py_ssize_t nitems;		/* In entries; the buffer's shape. */
+	Py_ssize_t itemsize;		/* ... and stride. */
+} Vector;
+
+static PyTypeObject RulesType, RulesetType, ModelType, ChainType, VectorType;
+
+/* Make the global default mask that of the rules about to be used. */
+#ifdef GMP
+#define SELECT_RULES(r)	\
+	mpz_set(mpz_hack_default_mask, (r)->rules[0].truthtable)
+#else
+#define SELECT_RULES(r)
+#endif
+
+static PyObject *
+set_errno(int err)
+{
+	errno = err;
+	return (PyErr_SetFromErrno(err == EINVAL ?
+	    PyExc_ValueError : PyExc_OSError));
+}
+
+/*
+ * Convert a Python sequence of rule ids into a C array, checking that it
+ * is a list: ids in range, ending with the default.
+ */
+static int *
+ids_from_seq(PyObject *seq, int nrules, int *np)
+{
+	PyObject *fast;
+	Py_ssize_t i, n;
+	long v;
+	int *ids;
+
+	if ((fast = PySequence_Fast(seq, "list of rule ids expected")) == NULL)
+		return (NULL);
+	n = PySequence_Fast_GET_SIZE(fast);
+	if ((ids = PyMem_Malloc((n + 1) * sizeof(int))) == NULL) {
+		Py_DECREF(fast);
+		PyErr_NoMemory();
+		return (NULL);
+	}
+	for (i = 0; i < n; i++) {
+		v = PyLong_AsLong(PySequence_Fast_GET_ITEM(fast, i));
+		if (v == -1 && PyErr_Occurred())
+			goto err;
+		if (v < 0 || v >= nrules) {
+			PyErr_Format(PyExc_IndexError, "rule id %ld", v);
+			goto err;
+		}
+		ids[i] = (int)v;
+	}
+	Py_DECREF(fast);
+	if (n == 0 || ids[n - 1] != 0) {
+		PyErr_SetString(PyExc_ValueError,
+		    "list must end with the default rule, 0");
+		PyMem_Free(ids);
+		return (NULL);
+	}
+	*np = (int)n;
+	return (ids);
+
+err:	Py_DECREF(fast);
+	PyMem_Free(ids);
+	return (NULL);
+}
+
+static PyObject *
+ids_to_list(int *ids, int n)
+{
+	PyObject *list;
+	int i;
+
+	if ((list = PyList_New(n)) == NULL)
+		return (NULL);
+	for (i = 0; i < n; i++)
+		PyList_SET_ITEM(list, i, PyInt_FromLong(ids[i]));
+	return (list);
+}
+
+/*
+ * Vectors.
+ */
+static PyObject *
+vector_new(exporter_t *owner, VECTOR v, int nsamples)
+{
+	Vector *vec;
+	PyObject *view;
+
+	if ((vec = PyObject_New(Vector, &VectorType)) == NULL)
+		return (NULL);
+#ifdef GMP
+	vec->buf = (void *)mpz_limbs_read(v);
+	vec->len = mpz_size(v) * sizeof(mp_limb_t);
+#else
+	vec->buf = v;
+	vec->len = (nsamples + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY *
+	    sizeof(v_entry);
+#endif
+	vec->itemsize = sizeof(v_entry);
+	vec->nitems = vec->len / vec->itemsize;
+	vec->owner = owner;
+	Py_INCREF(owner);
+	owner->exports++;
+	view = PyMemoryView_FromObject((PyObject *)vec);
+	Py_DECREF(vec);
+	return (view);
+}
+
+static void
+vector_dealloc(Vector *vec)
+{
+	vec->owner->exports--;
+	Py_DECREF(vec->owner);
+	PyObject_Del(vec);
+}
+
+/* A read-only, one-dimensional array of v_entry. */
+static int
+vector_getbuffer(Vector *vec, Py_buffer *view, int flags)
+{
+	if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+		PyErr_SetString(PyExc_BufferError, "vectors are read-only");
+		view->obj = NULL;
+		return (-1);
+	}
+	view->obj = (PyObject *)vec;
+	Py_INCREF(vec);
+	view->buf = vec->buf;
+	view->len = vec->len;
+	view->readonly = 1;
+	view->itemsize = vec->itemsize;
+	view->format = (flags & PyBUF_FORMAT) == 0 ? NULL :
+	    sizeof(v_entry) == sizeof(unsigned long) ? "L" : "Q";
+	view->ndim = 1;
+	view->shape = (flags & PyBUF_ND) == PyBUF_ND ? &vec->nitems : NULL;
+	view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ?
+	    &vec->itemsize : NULL;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	return (0);
+}
+
+static PyBufferProcs vector_as_buffer = {
+#if PY_MAJOR_VERSION < 3
+	NULL, NULL, NULL, NULL,
+#endif
+	(getbufferproc)vector_getbuffer,
+	NULL,
+};
+
+static int
+check_exports(exporter_t *e)
+{
+	if (e->exports != 0) {
+		PyErr_SetString(PyExc_BufferError,
+		    "cannot change an object with exported vectors");
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Rules.
+ */
+static PyObject *
+rules_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	Rules *self;
+
+	if ((self = (Rules *)type->tp_alloc(type, 0)) == NULL)
+		return (NULL);
+	return ((PyObject *)self);
+}
+
+static void
+rules_dealloc(Rules *self)
+{
+	int i;
+
+	if (self->rules != NULL)
+		rules_free(self->rules, self->nrules);
+	rulematrix_free(&self->matrix);
+	if (self->labels != NULL) {
+		for (i = 0; i < self->nlabels; i++)
+			rule_vdelete(self->labels[i].truthtable);
+		free(self->labels);
+	}
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Rules(rulefile, labelfile): load makedata output and .Y labels. */
+static int
+rules_init_py(Rules *self, PyObject *args, PyObject *kwds)
+{
+	const char *rulefile, *labelfile;
+	int ret;
+
+	if (!PyArg_ParseTuple(args, "ss", &rulefile, &labelfile))
+		return (-1);
+	if (self->rules != NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "Rules already loaded");
+		return (-1);
+	}
+	if ((ret = rules_init(rulefile,
+	    &self->nrules, &self->nsamples, &self->rules)) != 0) {
+		errno = ret;
+		PyErr_SetFromErrnoWithFilename(PyExc_IOError, rulefile);
+		return (-1);
+	}
+	if ((ret = labels_init(labelfile, &self->nlabels,
+	    self->nsamples, &self->labels)) != 0 || self->nlabels != 2) {
+		PyErr_Format(PyExc_ValueError,
+		    "%s: need two classes for %d samples",
+		    labelfile, self->nsamples);
+		return (-1);
+	}
+	return (0);
+}
+
+/* Set the bits of v for the sample indices in the iterable o. */
+static int
+vector_from_iter(PyObject *o, VECTOR v, int nsamples, int *support)
+{
+	PyObject *it, *item;
+	long k;
+
+	if ((it = PyObject_GetIter(o)) == NULL)
+		return (-1);
+	*support = 0;
+	while ((item = PyIter_Next(it)) != NULL) {
+		k = PyLong_AsLong(item);
+		Py_DECREF(item);
+		if (k == -1 && PyErr_Occurred())
+			break;
+		if (k < 0 || k >= nsamples) {
+			PyErr_Format(PyExc_IndexError, "sample %ld", k);
+			break;
+		}
+		if (!rule_isset(v, nsamples, (int)k)) {
+			rule_setbit(v, nsamples, (int)k);
+			(*support)++;
+		}
+	}
+	Py_DECREF(it);
+	return (PyErr_Occurred() ? -1 : 0);
+}
+
+/*
+ * Rules.from_sets(X, ones, lhs_len[, features]): build rules the way
+ * BRL_code.py represents them.  X[j] is the set of samples that satisfy
+ * rule j (X[0], the default, has them all), ones holds the samples in
+ * class 1, and lhs_len[j] is rule j's cardinality.
+ */
+static PyObject *
+rules_from_sets(PyTypeObject *type, PyObject *args)
+{
+	PyObject *X, *ones, *lhs_len, *features, *o;
+	Rules *self;
+	Py_ssize_t n;
+	const char *f;
+	int i, nsamples, support;
+
+	features = NULL;
+	if (!PyArg_ParseTuple(args, "OOO|O", &X, &ones, &lhs_len, &features))
+		return (NULL);
+	if ((n = PySequence_Length(X)) < 1) {
+		if (n == 0)
+			PyErr_SetString(PyExc_ValueError, "no rules");
+		return (NULL);
+	}
+	if (PySequence_Length(lhs_len) != n ||
+	    (features != NULL && PySequence_Length(features) != n)) {
+		PyErr_SetString(PyExc_ValueError,
+		    "X, lhs_len and features differ in length");
+		return (NULL);
+	}
+	if ((o = PySequence_GetItem(X, 0)) == NULL)
+		return (NULL);
+	nsamples = (int)PyObject_Length(o);
+	Py_DECREF(o);
+	if (nsamples < 0)
+		return (NULL);
+
+	if ((self = (Rules *)type->tp_alloc(type, 0)) == NULL)
+		return (NULL);
+	self->nsamples = nsamples;
+	if ((self->rules = calloc(n, sizeof(rule_t))) == NULL ||
+	    (self->labels = calloc(2, sizeof(rule_t))) == NULL)
+		goto nomem;
+	for (i = 0; i < 2; i++) {
+		if (rule_vinit(nsamples, &self->labels[i].truthtable) != 0)
+			goto nomem;
+		self->labels[i].features = "label";
+		self->nlabels++;
+	}
+	if (vector_from_iter(ones, self->labels[1].truthtable,
+	    nsamples, &self->labels[1].support) != 0)
+		goto err;
+
+	for (i = 0; i < n; i++) {
+		if (rule_vinit(nsamples, &self->rules[i].truthtable) != 0)
+			goto nomem;
+		self->nrules++;
+		if ((o = PySequence_GetItem(X, i)) == NULL)
+			goto err;
+		support = vector_from_iter(o,
+		    self->rules[i].truthtable, nsamples,
+		    &self->rules[i].support);
+		Py_DECREF(o);
+		if (support != 0)
+			goto err;
+
+		if ((o = PySequence_GetItem(lhs_len, i)) == NULL)
+			goto err;
+		self->rules[i].cardinality = (int)PyLong_AsLong(o);
+		Py_DECREF(o);
+		if (PyErr_Occurred())
+			goto err;
+
+		if (i == 0) {
+			self->rules[i].features = "default";
+			continue;
+		}
+		f = "";
+		o = NULL;
+		if (features != NULL) {
+			if ((o = PySequence_GetItem(features, i)) == NULL)
+				goto err;
+#if PY_MAJOR_VERSION >= 3
+			f = PyUnicode_AsUTF8(o);
+#else
+			f = PyString_AsString(o);
+#endif
+			if (f == NULL) {
+				Py_DECREF(o);
+				goto err;
+			}
+		}
+		self->rules[i].features = strdup(f);
+		Py_XDECREF(o);
+		if (self->rules[i].features == NULL)
+			goto nomem;
+	}
+	if (self->rules[0].support != nsamples) {
+		PyErr_SetString(PyExc_ValueError,
+		    "X[0] must hold every sample");
+		goto err;
+	}
+	(void)vkernel_select(nsamples);
+	return ((PyObject *)self);
+
+nomem:	PyErr_NoMemory();
+err:	Py_DECREF(self);
+	return (NULL);
+}
+
+static Py_ssize_t
+rules_length(Rules *self)
+{
+	return (self->nrules);
+}
+
+static int
+rule_index(Rules *self, PyObject *args)
+{
+	int j;
+
+	if (!PyArg_ParseTuple(args, "i", &j))
+		return (-1);
+	if (j < 0 || j >= self->nrules) {
+		PyErr_Format(PyExc_IndexError, "rule %d", j);
+		return (-1);
+	}
+	return (j);
+}
+
+static PyObject *
+rules_truthtable(Rules *self, PyObject *args)
+{
+	int j;
+
+	if ((j = rule_index(self, args)) < 0)
+		return (NULL);
+	return (vector_new((exporter_t *)self,
+	    self->rules[j].truthtable, self->nsamples));
+}
+
+static PyObject *
+rules_labels(Rules *self, PyObject *unused)
+{
+	return (vector_new((exporter_t *)self,
+	    self->labels[1].truthtable, self->nsamples));
+}
+
+static PyObject *
+rules_features(Rules *self, PyObject *args)
+{
+	int j;
+
+	if ((j = rule_index(self, args)) < 0)
+		return (NULL);
+	return (PyString_FromString(self->rules[j].features));
+}
+
+static PyObject *
+rules_cardinality(Rules *self, PyObject *args)
+{
+	int j;
+
+	if ((j = rule_index(self, args)) < 0)
+		return (NULL);
+	return (PyInt_FromLong(self->rules[j].cardinality));
+}
+
+static PyObject *
+rules_support(Rules *self, PyObject *args)
+{
+	int j;
+
+	if ((j = rule_index(self, args)) < 0)
+		return (NULL);
+	return (PyInt_FromLong(self->rules[j].support));
+}
+
+/*
+ * compute_rule_usage(ids): for each rule on the list, the number of
+ * samples of each class it captures, as [n0, n1] pairs.
+ */
+static PyObject *
+rules_compute_rule_usage(Rules *self, PyObject *args)
+{
+	PyObject *seq, *list;
+	int i, n, nentries, *ids, *counts;
+
+	if (!PyArg_ParseTuple(args, "O", &seq))
+		return (NULL);
+	if ((ids = ids_from_seq(seq, self->nrules, &n)) == NULL)
+		return (NULL);
+	if ((counts = PyMem_Malloc(2 * n * sizeof(int))) == NULL) {
+		PyMem_Free(ids);
+		return (PyErr_NoMemory());
+	}
+	memset(counts, 0, 2 * n * sizeof(int));
+	nentries = (self->nsamples + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+	Py_BEGIN_ALLOW_THREADS
+	rules_cascade(ids, n, self->rules,
+	    self->labels[1].truthtable, NULL, 0, nentries, counts);
+	Py_END_ALLOW_THREADS
+	if ((list = PyList_New(n)) != NULL)
+		for (i = 0; i < n; i++)
+			PyList_SET_ITEM(list, i, Py_BuildValue("[ii]",
+			    counts[2 * i] - counts[2 * i + 1],
+			    counts[2 * i + 1]));
+	PyMem_Free(ids);
+	PyMem_Free(counts);
+	return (list);
+}
+
+/*
+ * positions(ids[, samples]): for each sample, or each of the sequence
+ * samples, the position on the list of the rule that captures it, as a
+ * bytearray of C ints (for numpy.frombuffer with dtype=numpy.intc).  For
+ * every sample we run the cascade; for a few, we look them up in a rule
+ * matrix (transpose.c), which we build the first time.
+ */
+static PyObject *
+rules_positions(Rules *self, PyObject *args)
+{
+	PyObject *seq, *sseq, *fast, *ret;
+	Py_ssize_t i;
+	long v, ncores;
+	int n, nq, err, *ids, *samples, *pos;
+
+	sseq = NULL;
+	if (!PyArg_ParseTuple(args, "O|O", &seq, &sseq))
+		return (NULL);
+	if ((ids = ids_from_seq(seq, self->nrules, &n)) == NULL)
+		return (NULL);
+	samples = NULL;
+	nq = self->nsamples;
+	if (sseq != NULL) {
+		if ((fast = PySequence_Fast(sseq,
+		    "list of samples expected")) == NULL) {
+			PyMem_Free(ids);
+			return (NULL);
+		}
+		nq = (int)PySequence_Fast_GET_SIZE(fast);
+		if ((samples = PyMem_Malloc((nq + 1) * sizeof(int))) == NULL) {
+			Py_DECREF(fast);
+			PyMem_Free(ids);
+			return (PyErr_NoMemory());
+		}
+		for (i = 0; i < nq; i++) {
+			v = PyLong_AsLong(PySequence_Fast_GET_ITEM(fast, i));
+			if (v == -1 && PyErr_Occurred())
+				break;
+			if (v < 0 || v >= self->nsamples) {
+				PyErr_Format(PyExc_IndexError, "sample %ld", v);
+				break;
+			}
+			samples[i] = (int)v;
+		}
+		Py_DECREF(fast);
+		if (i < nq) {
+			PyMem_Free(samples);
+			PyMem_Free(ids);
+			return (NULL);
+		}
+		if ((ncores = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+			ncores = 1;
+		if (self->matrix.bits == NULL &&
+		    (err = rulematrix_init(&self->matrix, self->rules,
+		    self->nrules, self->nsamples, RM_ROWS,
+		    (int)ncores, NULL)) != 0) {
+			PyMem_Free(samples);
+			PyMem_Free(ids);
+			return (set_errno(err));
+		}
+	}
+	if ((pos = PyMem_Malloc((nq + 1) * sizeof(int))) == NULL) {
+		PyMem_Free(samples);
+		PyMem_Free(ids);
+		return (PyErr_NoMemory());
+	}
+	Py_BEGIN_ALLOW_THREADS
+	if (samples == NULL)
+		cascade_positions(ids, n, self->rules, self->nsamples, pos);
+	else
+		(void)rulematrix_positions(&self->matrix,
+		    ids, n, samples, nq, pos);
+	Py_END_ALLOW_THREADS
+	ret = PyByteArray_FromStringAndSize((char *)pos, nq * sizeof(int));
+	PyMem_Free(ids);
+	PyMem_Free(samples);
+	PyMem_Free(pos);
+	return (ret);
+}
+
+static PyObject *
+rules_get_nsamples(Rules *self, void *closure)
+{
+	return (PyInt_FromLong(self->nsamples));
+}
+
+static PyMethodDef rules_methods[] = {
+	{"from_sets", (PyCFunction)rules_from_sets, METH_VARARGS | METH_CLASS,
+	    "from_sets(X, ones, lhs_len[, features]) -> Rules"},
+	{"truthtable", (PyCFunction)rules_truthtable, METH_VARARGS,
+	    "truthtable(j) -> buffer over rule j's truth table"},
+	{"labels", (PyCFunction)rules_labels, METH_NOARGS,
+	    "labels() -> buffer over the class 1 samples"},
+	{"features", (PyCFunction)rules_features, METH_VARARGS,
+	    "features(j) -> rule j's features"},
+	{"cardinality", (PyCFunction)rules_cardinality, METH_VARARGS,
+	    "cardinality(j) -> number of attributes in rule j"},
+	{"support", (PyCFunction)rules_support, METH_VARARGS,
+	    "support(j) -> number of samples rule j holds for"},
+	{"compute_rule_usage", (PyCFunction)rules_compute_rule_usage,
+	    METH_VARARGS, "compute_rule_usage(ids) -> [[n0, n1], ...]"},
+	{"positions", (PyCFunction)rules_positions, METH_VARARGS,
+	    "positions(ids[, samples]) -> bytearray of C ints: the position\n"
+	    "capturing each sample, or each of samples"},
+	{NULL}
+};
+
+static PyGetSetDef rules_getset[] = {
+	{"nsamples", (getter)rules_get_nsamples, NULL, "number of samples"},
+	{NULL}
+};
+
+static PySequenceMethods rules_as_sequence = {
+	(lenfunc)rules_length,
+};
+
+/*
+ * Ruleset(rules, ids): a ruleset_t, with its captures.
+ */
+static int
+ruleset_init_py(Ruleset *self, PyObject *args, PyObject *kwds)
+{
+	PyObject *seq;
+	Rules *owner;
+	int n, ret, *ids;
+
+	if (!PyArg_ParseTuple(args, "O!O", &RulesType, &owner, &seq))
+		return (-1);
+	if (self->rs != NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "Ruleset already built");
+		return (-1);
+	}
+	if ((ids = ids_from_seq(seq, owner->nrules, &n)) == NULL)
+		return (-1);
+	SELECT_RULES(owner);
+	ret = ruleset_init(n, owner->nsamples, ids, owner->rules, &self->rs);
+	PyMem_Free(ids);
+	if (ret != 0) {
+		set_errno(ret);
+		return (-1);
+	}
+	self->owner = owner;
+	Py_INCREF(owner);
+	return (0);
+}
+
+static void
+ruleset_dealloc(Ruleset *self)
+{
+	if (self->rs != NULL)
+		ruleset_free(self->rs);
+	Py_XDECREF(self->owner);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int
+ruleset_ready(Ruleset *self, int changing)
+{
+	if (self->rs == NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "Ruleset not built");
+		return (-1);
+	}
+	if (!changing)
+		return (0);
+	SELECT_RULES(self->owner);
+	return (check_exports((exporter_t *)self));
+}
+
+static PyObject *
+ruleset_ids(Ruleset *self, PyObject *unused)
+{
+	PyObject *list;
+	int i;
+
+	if (ruleset_ready(self, 0) != 0 ||
+	    (list = PyList_New(self->rs->n_rules)) == NULL)
+		return (NULL);
+	for (i = 0; i < self->rs->n_rules; i++)
+		PyList_SET_ITEM(list, i,
+		    PyInt_FromLong(self->rs->rules[i].rule_id));
+	return (list);
+}
+
+static PyObject *
+ruleset_counts(Ruleset *self, PyObject *unused)
+{
+	PyObject *list;
+	int i;
+
+	if (ruleset_ready(self, 0) != 0 ||
+	    (list = PyList_New(self->rs->n_rules)) == NULL)
+		return (NULL);
+	for (i = 0; i < self->rs->n_rules; i++)
+		PyList_SET_ITEM(list, i,
+		    PyInt_FromLong(self->rs->rules[i].ncaptured));
+	return (list);
+}
+
+static PyObject *
+ruleset_captures(Ruleset *self, PyObject *args)
+{
+	int i;
+
+	if (ruleset_ready(self, 0) != 0 || !PyArg_ParseTuple(args, "i", &i))
+		return (NULL);
+	if (i < 0 || i >= self->rs->n_rules) {
+		PyErr_Format(PyExc_IndexError, "position %d", i);
+		return (NULL);
+	}
+	return (vector_new((exporter_t *)self,
+	    self->rs->rules[i].captures, self->rs->n_samples));
+}
+
+static int
+position_ok(Ruleset *self, int i, int extra)
+{
+	if (i < 0 || i >= self->rs->n_rules + extra) {
+		PyErr_Format(PyExc_IndexError, "position %d", i);
+		return (0);
+	}
+	return (1);
+}
+
+static PyObject *
+ruleset_add_py(Ruleset *self, PyObject *args)
+{
+	int id, ndx, ret;
+
+	if (ruleset_ready(self, 1) != 0 ||
+	    !PyArg_ParseTuple(args, "ii", &id, &ndx) ||
+	    !position_ok(self, ndx, 1))
+		return (NULL);
+	if (id <= 0 || id >= self->owner->nrules)
+		return (PyErr_Format(PyExc_IndexError, "rule id %d", id));
+	if ((ret = ruleset_add(self->owner->rules,
+	    self->owner->nrules, &self->rs, id, ndx)) != 0)
+		return (set_errno(ret));
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+ruleset_delete_py(Ruleset *self, PyObject *args)
+{
+	int ndx, ret;
+
+	if (ruleset_ready(self, 1) != 0 ||
+	    !PyArg_ParseTuple(args, "i", &ndx) || !position_ok(self, ndx, 0))
+		return (NULL);
+	if ((ret = ruleset_delete(self->owner->rules,
+	    self->owner->nrules, self->rs, ndx)) != 0)
+		return (set_errno(ret));
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+ruleset_move_py(Ruleset *self, PyObject *args)
+{
+	int from, to, ret;
+
+	if (ruleset_ready(self, 1) != 0 ||
+	    !PyArg_ParseTuple(args, "ii", &from, &to) ||
+	    !position_ok(self, from, 0) || !position_ok(self, to, 0))
+		return (NULL);
+	if ((ret = ruleset_move(self->owner->rules,
+	    self->owner->nrules, &self->rs, from, to)) != 0)
+		return (set_errno(ret));
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+ruleset_swap_py(Ruleset *self, PyObject *args)
+{
+	int i, j, ret;
+
+	if (ruleset_ready(self, 1) != 0 ||
+	    !PyArg_ParseTuple(args, "ii", &i, &j) ||
+	    !position_ok(self, i, 0) || !position_ok(self, j, 0))
+		return (NULL);
+	if ((ret = ruleset_swap(self->rs, i, j, self->owner->rules)) != 0)
+		return (set_errno(ret));
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef ruleset_methods[] = {
+	{"ids", (PyCFunction)ruleset_ids, METH_NOARGS,
+	    "ids() -> the rule ids, in order"},
+	{"counts", (PyCFunction)ruleset_counts, METH_NOARGS,
+	    "counts() -> samples captured by each rule"},
+	{"captures", (PyCFunction)ruleset_captures, METH_VARARGS,
+	    "captures(i) -> buffer over the ith rule's captures"},
+	{"add", (PyCFunction)ruleset_add_py, METH_VARARGS,
+	    "add(rule_id, i): insert a rule at position i"},
+	{"delete", (PyCFunction)ruleset_delete_py, METH_VARARGS,
+	    "delete(i): remove the rule at position i"},
+	{"move", (PyCFunction)ruleset_move_py, METH_VARARGS,
+	    "move(i, j): move the rule at position i to position j"},
+	{"swap", (PyCFunction)ruleset_swap_py, METH_VARARGS,
+	    "swap(i, j): swap the rules at positions i and j"},
+	{NULL}
+};
+
+/*
+ * Model(rules, lbda, eta, alpha=(1, 1)): the prior and likelihood.
+ */
+static int
+model_init_py(Model *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"rules", "lbda", "eta", "alpha", NULL};
+	Rules *owner;
+	params_t params;
+	int ret;
+
+	params.alpha[0] = params.alpha[1] = 1;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!dd|(dd)", kwlist,
+	    &RulesType, &owner, &params.lambda, &params.eta,
+	    &params.alpha[0], &params.alpha[1]))
+		return (-1);
+	if (self->owner != NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "Model already built");
+		return (-1);
+	}
+	if ((ret = model_init(&self->model, owner->rules, owner->nrules,
+	    owner->nsamples, owner->labels[1].truthtable, NULL, &params)) != 0) {
+		set_errno(ret);
+		return (-1);
+	}
+	self->owner = owner;
+	Py_INCREF(owner);
+	return (0);
+}
+
+static void
+model_dealloc(Model *self)
+{
+	if (self->owner != NULL) {
+		model_free(&self->model);
+		Py_DECREF(self->owner);
+	}
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+typedef double (*list_fn)(model_t *, int *, int);
+
+static PyObject *
+model_score(Model *self, PyObject *args, list_fn fn)
+{
+	PyObject *seq;
+	int n, *ids;
+	double v;
+
+	if (self->owner == NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "Model not built");
+		return (NULL);
+	}
+	if (!PyArg_ParseTuple(args, "O", &seq) ||
+	    (ids = ids_from_seq(seq, self->model.nrules, &n)) == NULL)
+		return (NULL);
+	Py_BEGIN_ALLOW_THREADS
+	v = fn(&self->model, ids, n);
+	Py_END_ALLOW_THREADS
+	PyMem_Free(ids);
+	return (PyFloat_FromDouble(v));
+}
+
+static PyObject *
+model_logposterior(Model *self, PyObject *args)
+{
+	return (model_score(self, args, list_logposterior));
+}
+
+static PyObject *
+model_logprior(Model *self, PyObject *args)
+{
+	return (model_score(self, args, list_logprior));
+}
+
+static PyMethodDef model_methods[] = {
+	{"logposterior", (PyCFunction)model_logposterior, METH_VARARGS,
+	    "logposterior(ids) -> log posterior of a list"},
+	{"logprior", (PyCFunction)model_logprior, METH_VARARGS,
+	    "logprior(ids) -> log prior of a list"},
+	{NULL}
+};
+
+/*
+ * Chain(model, seed, tcrit=0, ids=None): a chain started from a list
+ * drawn from the prior, or from ids.
+ */
+static int
+chain_init_py(Chain *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"model", "seed", "tcrit", "ids", NULL};
+	PyObject *seq;
+	Model *owner;
+	unsigned int seed;
+	double tcrit;
+	int n, ret, *ids;
+
+	tcrit = 0;
+	seq = Py_None;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!I|dO", kwlist,
+	    &ModelType, &owner, &seed, &tcrit, &seq))
+		return (-1);
+	if (self->owner != NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "Chain already built");
+		return (-1);
+	}
+	if (owner->owner == NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "Model not built");
+		return (-1);
+	}
+	SELECT_RULES(owner->owner);
+	if ((ret = chain_init(&self->chain, &owner->model, tcrit, seed)) != 0) {
+		set_errno(ret);
+		return (-1);
+	}
+	self->owner = owner;
+	Py_INCREF(owner);
+	if (seq == Py_None)
+		return (0);
+	if ((ids = ids_from_seq(seq, owner->model.nrules, &n)) == NULL)
+		return (-1);
+	ret = chain_set_list(&self->chain, ids, n);
+	PyMem_Free(ids);
+	if (ret != 0) {
+		set_errno(ret);
+		return (-1);
+	}
+	return (0);
+}
+
+static void
+chain_dealloc(Chain *self)
+{
+	if (self->owner != NULL) {
+		chain_free(&self->chain);
+		Py_DECREF(self->owner);
+	}
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* step(n=1) -> number of the n steps that were accepted. */
+static PyObject *
+chain_step_py(Chain *self, PyObject *args)
+{
+	int i, n, ret, accepted;
+
+	n = 1;
+	if (self->owner == NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "Chain not built");
+		return (NULL);
+	}
+	if (!PyArg_ParseTuple(args, "|i", &n))
+		return (NULL);
+	accepted = 0;
+	ret = 0;
+	SELECT_RULES(self->owner->owner);
+	Py_BEGIN_ALLOW_THREADS
+	for (i = 0; i < n && (ret = chain_step(&self->chain)) >= 0; i++)
+		accepted += ret;
+	Py_END_ALLOW_THREADS
+	if (ret < 0)
+		return (set_errno(-ret));
+	return (PyInt_FromLong(accepted));
+}
+
+static PyObject *
+chain_get_ids(Chain *self, void *closure)
+{
+	if (self->owner == NULL)
+		return (PyList_New(0));
+	return (ids_to_list(self->chain.ids, self->chain.n_ids));
+}
+
+/* Approximate chains don't track their posterior; compute it. */
+static PyObject *
+chain_get_logpost(Chain *self, void *closure)
+{
+	chain_t *c;
+
+	c = &self->chain;
+	if (self->owner == NULL)
+		Py_RETURN_NONE;
+	return (PyFloat_FromDouble(c->tcrit == 0 ? c->logpost :
+	    list_logposterior(c->model, c->ids, c->n_ids)));
+}
+
+static PyObject *
+chain_get_stats(Chain *self, void *closure)
+{
+	chain_stats_t *s;
+
+	s = &self->chain.stats;
+	return (Py_BuildValue("{s:l,s:l,s:l,s:l}", "steps", s->nsteps,
+	    "accepted", s->naccepted, "words", s->nwords, "grow", s->ngrow));
+}
+
+static PyMethodDef chain_methods[] = {
+	{"step", (PyCFunction)chain_step_py, METH_VARARGS,
+	    "step(n=1) -> number of the n steps accepted"},
+	{NULL}
+};
+
+static PyGetSetDef chain_getset[] = {
+	{"ids", (getter)chain_get_ids, NULL, "the current list"},
+	{"logpost", (getter)chain_get_logpost, NULL,
+	    "log posterior of the current list"},
+	{"stats", (getter)chain_get_stats, NULL, "step counts"},
+	{NULL}
+};
+
+static PyTypeObject VectorType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"rulelib.Vector",
+	sizeof(Vector),
+};
+
+static PyTypeObject RulesType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"rulelib.Rules",
+	sizeof(Rules),
+};
+
+static PyTypeObject RulesetType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"rulelib.Ruleset",
+	sizeof(Ruleset),
+};
+
+static PyTypeObject ModelType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"rulelib.Model",
+	sizeof(Model),
+};
+
+static PyTypeObject ChainType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"rulelib.Chain",
+	sizeof(Chain),
+};
+
+/*
+ * Fill in the type objects here rather than with positional initializers,
+ * whose layout differs between Python versions.
+ */
+static int
+types_ready(void)
+{
+	VectorType.tp_dealloc = (destructor)vector_dealloc;
+	VectorType.tp_as_buffer = &vector_as_buffer;
+	VectorType.tp_flags = Py_TPFLAGS_DEFAULT;
+#if PY_MAJOR_VERSION < 3
+	VectorType.tp_flags |= Py_TPFLAGS_HAVE_NEWBUFFER;
+#endif
+	VectorType.tp_doc = "A rulelib bit vector";
+
+	RulesType.tp_new = rules_new;
+	RulesType.tp_init = (initproc)rules_init_py;
+	RulesType.tp_dealloc = (destructor)rules_dealloc;
+	RulesType.tp_methods = rules_methods;
+	RulesType.tp_getset = rules_getset;
+	RulesType.tp_as_sequence = &rules_as_sequence;
+	RulesType.tp_flags = Py_TPFLAGS_DEFAULT;
+	RulesType.tp_doc = "Rules(rulefile, labelfile)";
+
+	RulesetType.tp_new = PyType_GenericNew;
+	RulesetType.tp_init = (initproc)ruleset_init_py;
+	RulesetType.tp_dealloc = (destructor)ruleset_dealloc;
+	RulesetType.tp_methods = ruleset_methods;
+	RulesetType.tp_flags = Py_TPFLAGS_DEFAULT;
+	RulesetType.tp_doc = "Ruleset(rules, ids)";
+
+	ModelType.tp_new = PyType_GenericNew;
+	ModelType.tp_init = (initproc)model_init_py;
+	ModelType.tp_dealloc = (destructor)model_dealloc;
+	ModelType.tp_methods = model_methods;
+	ModelType.tp_flags = Py_TPFLAGS_DEFAULT;
+	ModelType.tp_doc = "Model(rules, lbda, eta, alpha=(1, 1))";
+
+	ChainType.tp_new = PyType_GenericNew;
+	ChainType.tp_init = (initproc)chain_init_py;
+	ChainType.tp_dealloc = (destructor)chain_dealloc;
+	ChainType.tp_methods = chain_methods;
+	ChainType.tp_getset = chain_getset;
+	ChainType.tp_flags = Py_TPFLAGS_DEFAULT;
+	ChainType.tp_doc = "Chain(model, seed, tcrit=0, ids=None)";
+
+	return (PyType_Ready(&VectorType) < 0 ||
+	    PyType_Ready(&RulesType) < 0 || PyType_Ready(&RulesetType) < 0 ||
+	    PyType_Ready(&ModelType) < 0 || PyType_Ready(&ChainType) < 0 ?
+	    -1 : 0);
+}
+
+static PyObject *
+module_add_types(PyObject *m)
+{
+	if (m == NULL)
+		return (NULL);
+	Py_INCREF(&RulesType);
+	PyModule_AddObject(m, "Rules", (PyObject *)&RulesType);
+	Py_INCREF(&RulesetType);
+	PyModule_AddObject(m, "Ruleset", (PyObject *)&RulesetType);
+	Py_INCREF(&ModelType);
+	PyModule_AddObject(m, "Model", (PyObject *)&ModelType);
+	Py_INCREF(&ChainType);
+	PyModule_AddObject(m, "Chain", (PyObject *)&ChainType);
+	PyModule_AddIntConstant(m, "BITS_PER_ENTRY", BITS_PER_ENTRY);
+	return (m);
+}
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef rulelib_module = {
+	PyModuleDef_HEAD_INIT, "rulelib", "Native rule lists.", -1, NULL,
+};
+
+PyMODINIT_FUNC
+PyInit_rulelib(void)
+{
+	if (types_ready() != 0)
+		return (NULL);
+	return (module_add_types(PyModule_Create(&rulelib_module)));
+}
+#else
+PyMODINIT_FUNC
+initrulelib(void)
+{
+	if (types_ready() != 0)
+		return;
+	(void)module_add_types(Py_InitModule3("rulelib",
+	    NULL, "Native rule lists."));
+}
+#endif
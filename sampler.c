@@ -0,0 +1,977 @@
+/*
+ * Copyright 2015 President and Fellows of Harvard College.
+ * All rights reserved.
+ */
+
+/*
+ * Metropolis-Hastings sampling of Bayesian rule lists.
+ *
+ * This is the sampler from BRL_code.py (bayesdl_mcmc) on top of rulelib:
+ * the same prior on list length and rule cardinality, the same
+ * Dirichlet-multinomial likelihood and the same move/add/cut proposals.
+ * The prior differs from fn_logprior in one detail (see list_logprior):
+ * once every rule of a cardinality is on the list, we take that
+ * cardinality's probability out of beta_z, where fn_logprior takes out
+ * its log.  Lists that do this are rare, but their posteriors differ.
+ * A list is an ordered set of rules followed by the default rule (rule 0).
+ *
+ * A chain runs in one of two modes.
+ *
+ * Exact: the chain keeps a ruleset_t, applies each proposal to it with
+ * ruleset_add/ruleset_delete/ruleset_move, scores it from the captures,
+ * and undoes the change if the proposal is rejected.
+ *
+ * Approximate: the chain keeps only the list of rule ids and decides each
+ * proposal from a random subset of the samples, in the style of the
+ * sequential test of Korattikara et al.  The samples are split into
+ * blocks of BLOCK_WORDS vector entries.  We run the capture cascade for
+ * both lists over a few blocks (rules_cascade works on ranges of entries),
+ * estimate the change in log likelihood by scaling the counts up to the
+ * full data set and, if that estimate is not clearly on one side of the
+ * acceptance threshold given the spread of the per-block estimates,
+ * double the number of blocks and try again.  Once every block has been
+ * seen the decision is exact.  The likelihood is not a sum over samples,
+ * so the scaled estimate is biased; tcrit trades accuracy for speed.
+ *
+ * Either kind of chain can be tempered: with beta < 1 it samples from the
+ * posterior raised to beta, which is flatter and easier to move around.
+ * Parallel tempering (tempering.c) runs tempered chains side by side and
+ * exchanges their states with chain_swap_state.
+ *
+ * A model can be restricted to some of the samples (m->train, e.g. the
+ * training part of a cross-validation fold); the others are left out of
+ * every count, so the chain never learns from them, but the rulesets
+ * still capture them and so show where they fall.
+ *
+ * An exact chain can also hand its ruleset over to worker processes that
+ * each hold a shard of the samples (chain_shard, see shard.c).  Each
+ * proposal is then sent to the workers as a ruleset operation, they send
+ * back their counts, and a rejected proposal is undone by sending the
+ * inverse operation.  The counts are the same, so the chain is too.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rule.h"
+
+#define BLOCK_WORDS	8		/* Vector entries per block. */
+#define INIT_BLOCKS	4		/* Blocks in the first subset. */
+
+/* Proposal types. */
+#define OP_MOVE		0
+#define OP_ADD		1
+#define OP_CUT		2
+
+typedef struct proposal {
+	int op;
+	int from;			/* Position moved or cut. */
+	int to;				/* Position moved or added to. */
+	int rule_id;			/* Rule added. */
+	double logj;			/* log of the proposal ratio. */
+} proposal_t;
+
+static double
+log_poisson(int k, double mean)
+{
+	return (k * log(mean) - mean - lgamma(k + 1.0));
+}
+
+#define MULT(m, c, k)	((m)->mult[(c) * ((m)->maxcard + 1) + (k)])
+
+/*
+ * Set up the model: the rules, which samples are in class 1, the
+ * hyperparameters, and the constants the prior needs.  If the rules are
+ * equivalence classes from rules_dedup, dd describes them; the prior is
+ * then over the original rules (see list_logprior).
+ */
+int
+model_init(model_t *m, rule_t *rules, int nrules,
+    int nsamples, VECTOR label, dedup_t *dd, params_t *params)
+{
+	double *w, top;
+	int i, k, ret;
+
+	if (nrules < 3 || (dd != NULL && dd->n_classes != nrules))
+		return (EINVAL);
+	memset(m, 0, sizeof(model_t));
+	m->rules = rules;
+	m->nrules = nrules;
+	m->nsamples = nsamples;
+	VECTOR_ASSIGN(m->label, label);
+	m->params = *params;
+
+	if (dd != NULL)
+		m->maxcard = dd->maxcard;
+	else
+		for (i = 1; i < nrules; i++)
+			if (rules[i].cardinality > m->maxcard)
+				m->maxcard = rules[i].cardinality;
+	m->ncard = calloc(m->maxcard + 1, sizeof(int));
+	m->mult = calloc(nrules * (m->maxcard + 1), sizeof(int));
+	m->logalpha = malloc(nrules * sizeof(double));
+	m->logbeta = malloc((m->maxcard + 1) * sizeof(double));
+	if (m->ncard == NULL || m->mult == NULL ||
+	    m->logalpha == NULL || m->logbeta == NULL) {
+		model_free(m);
+		return (ENOMEM);
+	}
+	for (i = 1; i < nrules; i++)
+		if (dd != NULL)
+			for (k = 1; k <= m->maxcard; k++) {
+				MULT(m, i, k) = DEDUP_MULT(dd, i, k);
+				m->ncard[k] += MULT(m, i, k);
+			}
+		else {
+			MULT(m, i, rules[i].cardinality) = 1;
+			m->ncard[rules[i].cardinality]++;
+		}
+
+	/* A list holds between 0 and nrules-1 rules besides the default. */
+	for (i = 0; i < nrules; i++)
+		m->logalpha[i] = log_poisson(i, params->lambda);
+
+	/* Cardinality is Poisson(eta), truncated to 1..maxcard. */
+	m->beta_z = 0;
+	m->logbeta[0] = -INFINITY;
+	for (i = 1; i <= m->maxcard; i++) {
+		m->logbeta[i] = log_poisson(i, params->eta);
+		m->beta_z += exp(m->logbeta[i]);
+	}
+
+	/*
+	 * Tables for drawing lists from the prior, weighted relative to the
+	 * likeliest length and cardinality so that they cannot all be 0.
+	 */
+	if ((w = malloc(nrules * sizeof(double))) == NULL) {
+		model_free(m);
+		return (ENOMEM);
+	}
+	top = m->logalpha[0];
+	for (i = 1; i < nrules; i++)
+		if (m->logalpha[i] > top)
+			top = m->logalpha[i];
+	for (i = 0; i < nrules; i++)
+		w[i] = exp(m->logalpha[i] - top);
+	if ((ret = alias_init(&m->lens, w, nrules, 0)) == 0) {
+		top = m->logbeta[1];
+		for (i = 2; i <= m->maxcard; i++)
+			if (m->logbeta[i] > top)
+				top = m->logbeta[i];
+		for (i = 1; i <= m->maxcard; i++)
+			w[i - 1] = exp(m->logbeta[i] - top);
+		ret = alias_init(&m->cards, w, m->maxcard, 1);
+	}
+	free(w);
+	if (ret != 0)
+		model_free(m);
+	return (ret);
+}
+
+void
+model_free(model_t *m)
+{
+	free(m->ncard);
+	free(m->mult);
+	free(m->logalpha);
+	free(m->logbeta);
+	alias_free(&m->lens);
+	alias_free(&m->cards);
+#ifdef GMP
+	mpz_clear(m->label);
+#endif
+}
+
+/*
+ * Log prior of a list (ids[0..n-1], the last of which is the default).
+ * As in fn_logprior, once every rule of some cardinality is on the list,
+ * that cardinality is no longer available and the cardinality
+ * distribution is renormalized over the remaining ones.  Unlike
+ * fn_logprior, which subtracts logbeta_pmf of the used-up cardinalities
+ * from beta_Z, we subtract their probabilities, which is what
+ * renormalizing calls for.
+ *
+ * A class of equivalent rules is as likely as drawing any one of its
+ * members, and drawing it uses up all of them.  For classes of one rule
+ * this is exactly fn_logprior.
+ */
+double
+list_logprior(model_t *m, int *ids, int n)
+{
+	int i, k, nlens[m->maxcard + 1];
+	double lp, p, exhausted;
+
+	memset(nlens, 0, sizeof(nlens));
+	lp = m->logalpha[n - 1];
+	exhausted = 0;
+	for (i = 0; i < n - 1; i++) {
+		lp -= log(m->beta_z - exhausted);
+		p = 0;
+		for (k = 1; k <= m->maxcard; k++)
+			if (MULT(m, ids[i], k) != 0)
+				p += MULT(m, ids[i], k) * exp(m->logbeta[k]) /
+				    (m->ncard[k] - nlens[k]);
+		lp += log(p);
+		for (k = 1; k <= m->maxcard; k++)
+			if (MULT(m, ids[i], k) != 0 &&
+			    (nlens[k] += MULT(m, ids[i], k)) == m->ncard[k])
+				exhausted += exp(m->logbeta[k]);
+	}
+	return (lp);
+}
+
+/*
+ * Log likelihood given, for each of the n rules on a list, the number of
+ * samples it captures (counts[2*i]) and how many of those are in class 1
+ * (counts[2*i+1]), all multiplied by scale.  Like fn_logliklihood, we drop
+ * the terms that do not depend on the counts.
+ */
+double
+list_loglik(model_t *m, int *counts, int n, double scale)
+{
+	double a0, a1, n0, n1, ll;
+	int i;
+
+	a0 = m->params.alpha[0];
+	a1 = m->params.alpha[1];
+	ll = 0;
+	for (i = 0; i < n; i++) {
+		n1 = scale * counts[2 * i + 1];
+		n0 = scale * counts[2 * i] - n1;
+		ll += lgamma(n0 + a0) + lgamma(n1 + a1) -
+		    lgamma(n0 + n1 + a0 + a1);
+	}
+	return (ll);
+}
+
+/* Log posterior of a list, computed from scratch over all the samples. */
+double
+list_logposterior(model_t *m, int *ids, int n)
+{
+	int *counts, nentries;
+	double lp;
+
+	if ((counts = calloc(2 * n, sizeof(int))) == NULL)
+		return (-INFINITY);
+	nentries = (m->nsamples + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+	rules_cascade(ids, n,
+	    m->rules, m->label, m->train, 0, nentries, counts);
+	lp = list_logprior(m, ids, n) + list_loglik(m, counts, n, 1.0);
+	free(counts);
+	return (lp);
+}
+
+/* Log posterior of the list in a ruleset, using its captures. */
+static double
+ruleset_logposterior(model_t *m, ruleset_t *rs, int *ids, int *counts)
+{
+	int i;
+
+	for (i = 0; i < rs->n_rules; i++) {
+		counts[2 * i] = m->train == NULL ? rs->rules[i].ncaptured :
+		    rule_vandcnt(rs->rules[i].captures,
+		    m->train->truthtable, rs->n_samples);
+		counts[2 * i + 1] = rule_vandcnt(rs->rules[i].captures,
+		    m->label, rs->n_samples);
+	}
+	return (list_logprior(m, ids, rs->n_rules) +
+	    list_loglik(m, counts, rs->n_rules, 1.0));
+}
+
+static double
+rnd(chain_t *c)
+{
+	return (rng_uniform(&c->rng));
+}
+
+/* A uniform integer in [0, n). */
+static int
+rnd_int(chain_t *c, int n)
+{
+	return (rng_int(&c->rng, n));
+}
+
+/*
+ * Draw a starting list from the prior, as initialize_d does: a length,
+ * then for each position a cardinality that still has unused rules and a
+ * rule of that cardinality, chosen uniformly among the unused ones (a
+ * class of equivalent rules counts once per member, and uses them all
+ * up).  None of this depends on the number of rules.  Should every
+ * cardinality the prior can produce run out, the list stops short.
+ */
+static void
+chain_draw_list(chain_t *c)
+{
+	model_t *m;
+	double top;
+	int i, j, k, len, card, nleft;
+
+	m = c->model;
+	ruleindex_reset(c->unused);
+	/* Cardinalities m->cards can still produce (as model_init weighs). */
+	top = m->logbeta[1];
+	for (k = 2; k <= m->maxcard; k++)
+		if (m->logbeta[k] > top)
+			top = m->logbeta[k];
+	nleft = 0;
+	for (k = 1; k <= m->maxcard; k++)
+		if (m->ncard[k] != 0 && exp(m->logbeta[k] - top) > 0)
+			nleft++;
+	len = alias_draw(&m->lens, &c->rng);
+	for (i = 0; i < len && nleft > 0; i++) {
+		do {
+			card = alias_draw(&m->cards, &c->rng);
+		} while (c->unused->n_card[card] == 0);
+		j = ruleindex_pick_card(c->unused, card, &c->rng);
+		c->ids[i] = j;
+		ruleindex_take(c->unused, j);
+		for (k = 1; k <= m->maxcard; k++)
+			if (MULT(m, j, k) != 0 && c->unused->n_card[k] == 0 &&
+			    exp(m->logbeta[k] - top) > 0)
+				nleft--;
+	}
+	c->ids[i] = 0;
+	c->n_ids = i + 1;
+}
+
+/* Set up everything but the chain's list. */
+static int
+chain_alloc(chain_t *c, model_t *m, double tcrit, unsigned seed)
+{
+	int nentries;
+
+	memset(c, 0, sizeof(chain_t));
+	c->model = m;
+	c->tcrit = tcrit;
+	c->beta = 1;
+	rng_seed(&c->rng, seed);
+
+	c->ids = malloc(m->nrules * sizeof(int));
+	c->pids = malloc(m->nrules * sizeof(int));
+	c->unused = malloc(sizeof(ruleindex_t));
+	c->counts = malloc(2 * m->nrules * sizeof(int));
+	c->pcounts = malloc(2 * m->nrules * sizeof(int));
+	if (c->ids == NULL || c->pids == NULL || c->unused == NULL ||
+	    c->counts == NULL || c->pcounts == NULL)
+		return (ENOMEM);
+	if (ruleindex_init(c->unused, m->nrules, m->maxcard, m->mult) != 0) {
+		free(c->unused);
+		c->unused = NULL;
+		return (ENOMEM);
+	}
+	if (tcrit != 0) {
+		nentries = (m->nsamples + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+		c->nblocks = (nentries + BLOCK_WORDS - 1) / BLOCK_WORDS;
+		c->blocks = malloc(c->nblocks * sizeof(int));
+		c->bcounts = malloc(4 * m->nrules * sizeof(int));
+		if (c->blocks == NULL || c->bcounts == NULL)
+			return (ENOMEM);
+	}
+	return (0);
+}
+
+/*
+ * Set up a chain.  With tcrit == 0 the chain is exact; otherwise it makes
+ * approximate decisions, growing its subset of the samples until the
+ * estimated log likelihood difference is tcrit standard errors from the
+ * acceptance threshold.
+ */
+int
+chain_init(chain_t *c, model_t *m, double tcrit, unsigned seed)
+{
+	int i, j, t;
+
+	if (chain_alloc(c, m, tcrit, seed) != 0)
+		goto err;
+
+	chain_draw_list(c);
+
+	if (tcrit == 0) {
+		if (ruleset_init(c->n_ids,
+		    m->nsamples, c->ids, m->rules, &c->rs) != 0)
+			goto err;
+		c->logpost = ruleset_logposterior(m, c->rs, c->ids, c->counts);
+	} else {
+		/* Visit the blocks in a random order. */
+		for (i = 0; i < c->nblocks; i++)
+			c->blocks[i] = i;
+		for (i = c->nblocks - 1; i > 0; i--) {
+			j = rnd_int(c, i + 1);
+			t = c->blocks[i];
+			c->blocks[i] = c->blocks[j];
+			c->blocks[j] = t;
+		}
+		/* We never compute the posterior in full. */
+		c->logpost = NAN;
+	}
+	return (0);
+
+err:
+	chain_free(c);
+	return (ENOMEM);
+}
+
+/*
+ * Start chain c where chain from is now, with its own random numbers from
+ * seed.  The two share their captures (see ruleset_clone) until either
+ * changes them, so forking costs no more than copying the list.
+ */
+int
+chain_fork(chain_t *c, chain_t *from, unsigned seed)
+{
+	model_t *m;
+
+	m = from->model;
+	if (from->shards != NULL)
+		return (EINVAL);
+	if (chain_alloc(c, m, from->tcrit, seed) != 0)
+		goto err;
+	if (from->rs != NULL && ruleset_clone(from->rs, &c->rs) != 0)
+		goto err;
+	c->beta = from->beta;
+	c->verify = from->verify;
+	c->logpost = from->logpost;
+	c->n_ids = from->n_ids;
+	memcpy(c->ids, from->ids, from->n_ids * sizeof(int));
+	ruleindex_copy(c->unused, from->unused);
+	memcpy(c->counts, from->counts, 2 * from->n_ids * sizeof(int));
+	if (c->blocks != NULL)
+		memcpy(c->blocks, from->blocks, c->nblocks * sizeof(int));
+	return (0);
+
+err:
+	chain_free(c);
+	return (ENOMEM);
+}
+
+/*
+ * Bring the chain's workers to its list, from just the default rule, and
+ * score the list from their counts.
+ */
+static int
+shards_sync(chain_t *c)
+{
+	model_t *m;
+	int i, n, ret;
+
+	m = c->model;
+	if ((ret = shards_send(c->shards, SHARD_RESET, 0, 0)) != 0)
+		return (ret);
+	for (i = 0; i < c->n_ids - 1; i++)
+		if ((ret = shards_send(c->shards,
+		    SHARD_ADD, c->ids[i], i)) != 0)
+			return (ret);
+	if ((ret = shards_send(c->shards,
+	    SHARD_COUNTS | SHARD_REPLY, 0, 0)) != 0 ||
+	    (ret = shards_recv(c->shards, c->counts, &n)) != 0)
+		return (ret);
+	if (n != c->n_ids)
+		return (EINVAL);
+	c->logpost = list_logprior(m, c->ids, c->n_ids) +
+	    list_loglik(m, c->counts, c->n_ids, 1.0);
+	return (0);
+}
+
+/*
+ * Move an exact chain's ruleset to the workers of sh, which must hold the
+ * model's rules and label; the chain keeps only its list.  The model must
+ * count every sample.  The workers' rulesets are reset to the chain's
+ * list, so a set of workers can serve one chain after another, but only
+ * one at a time.
+ */
+int
+chain_shard(chain_t *c, shards_t *sh)
+{
+	model_t *m;
+	int ret;
+
+	m = c->model;
+	if (c->tcrit != 0 || m->train != NULL ||
+	    sh->n_rules != m->nrules || sh->n_samples != m->nsamples)
+		return (EINVAL);
+	c->shards = sh;
+	if ((ret = shards_sync(c)) != 0) {
+		c->shards = NULL;
+		return (ret);
+	}
+	if (c->rs != NULL) {
+		ruleset_free(c->rs);
+		c->rs = NULL;
+	}
+	return (0);
+}
+
+/*
+ * Start a chain from a given list instead of one drawn from the prior.
+ * The list must end with the default rule and not repeat any rule.  If
+ * we fail, the chain is left on its old list.
+ */
+int
+chain_set_list(chain_t *c, int *ids, int n)
+{
+	model_t *m;
+	ruleset_t *rs;
+	int i, ret;
+
+	m = c->model;
+	if (n < 1 || n > m->nrules || ids[n - 1] != 0)
+		return (EINVAL);
+	ruleindex_reset(c->unused);
+	for (i = 0; i < n - 1; i++) {
+		if (ids[i] <= 0 || ids[i] >= m->nrules ||
+		    !RULE_UNUSED(c->unused, ids[i])) {
+			ret = EINVAL;
+			goto restore;
+		}
+		ruleindex_take(c->unused, ids[i]);
+	}
+	/* Build the new ruleset before giving up the old list. */
+	rs = NULL;
+	if (c->tcrit == 0 && c->shards == NULL &&
+	    (ret = ruleset_init(n, m->nsamples, ids, m->rules, &rs)) != 0)
+		goto restore;
+	memcpy(c->ids, ids, n * sizeof(int));
+	c->n_ids = n;
+	if (c->shards != NULL)
+		return (shards_sync(c));
+	if (rs != NULL) {
+		ruleset_free(c->rs);
+		c->rs = rs;
+		c->logpost = ruleset_logposterior(m, c->rs, c->ids, c->counts);
+	}
+	return (0);
+
+restore:
+	ruleindex_reset(c->unused);
+	for (i = 0; i < c->n_ids - 1; i++)
+		ruleindex_take(c->unused, c->ids[i]);
+	return (ret);
+}
+
+void
+chain_free(chain_t *c)
+{
+	if (c->rs != NULL)
+		ruleset_free(c->rs);
+	free(c->ids);
+	free(c->pids);
+	if (c->unused != NULL) {
+		ruleindex_free(c->unused);
+		free(c->unused);
+	}
+	free(c->counts);
+	free(c->pcounts);
+	free(c->blocks);
+	free(c->bcounts);
+	memset(c, 0, sizeof(chain_t));
+}
+
+/*
+ * Exchange the states (lists, rulesets, counts and log posteriors) of two
+ * chains over the same model, leaving each its own temperature, generator and
+ * statistics.  Only pointers move.
+ */
+void
+chain_swap_state(chain_t *a, chain_t *b)
+{
+	chain_t t;
+
+	t.ids = a->ids;
+	t.n_ids = a->n_ids;
+	t.unused = a->unused;
+	t.rs = a->rs;
+	t.shards = a->shards;
+	t.logpost = a->logpost;
+	t.counts = a->counts;
+	a->ids = b->ids;
+	a->n_ids = b->n_ids;
+	a->unused = b->unused;
+	a->rs = b->rs;
+	a->shards = b->shards;
+	a->logpost = b->logpost;
+	a->counts = b->counts;
+	b->ids = t.ids;
+	b->n_ids = t.n_ids;
+	b->unused = t.unused;
+	b->rs = t.rs;
+	b->shards = t.shards;
+	b->logpost = t.logpost;
+	b->counts = t.counts;
+}
+
+/*
+ * Choose a move, add or cut, as proposal() does, including its
+ * corrections to the proposal ratio at the ends of the range of lengths.
+ */
+static void
+propose(chain_t *c, proposal_t *p)
+{
+	double prob[3], jr[3], u;
+	int r, n;
+
+	memset(p, 0, sizeof(proposal_t));
+	r = c->n_ids - 1;		/* Rules on the list. */
+	n = c->model->nrules - 1;	/* Rules available. */
+	prob[0] = prob[1] = prob[2] = 1.0 / 3;
+
+	if (r == 0) {
+		prob[0] = prob[2] = 0;
+		prob[1] = 1;
+		jr[0] = jr[2] = 0;
+		jr[1] = (1.0 / 3) / (2.0 / 3);
+	} else if (r == 1) {
+		prob[0] = 0;
+		prob[1] = prob[2] = 0.5;
+		jr[0] = 0;
+		jr[1] = (1.0 / 3) / 0.5;
+		jr[2] = 1 / 0.5;
+	} else if (r == n) {
+		prob[1] = 0;
+		prob[0] = prob[2] = 0.5;
+		jr[0] = 1;
+		jr[1] = 0;
+		jr[2] = (1.0 / 3) / 0.5;
+	} else if (r == n - 1) {
+		jr[0] = 1;
+		jr[1] = (1.0 / 3) / (2.0 / 3) / (1.0 / 3);
+		jr[2] = 1;
+	} else {
+		jr[0] = jr[1] = jr[2] = 1;
+	}
+
+	u = rnd(c);
+	if (u < prob[0]) {
+		p->op = OP_MOVE;
+		p->from = rnd_int(c, r);
+		p->to = rnd_int(c, r - 1);
+		if (p->to >= p->from)
+			p->to++;
+		p->logj = log(jr[0]);
+	} else if (u < prob[0] + prob[1]) {
+		p->op = OP_ADD;
+		p->rule_id = ruleindex_pick(c->unused, &c->rng);
+		p->to = rnd_int(c, r + 1);
+		p->logj = log(jr[1] * (n - r));
+	} else {
+		p->op = OP_CUT;
+		p->from = rnd_int(c, r);
+		p->logj = log(jr[2] / (n - r + 1));
+	}
+}
+
+/* Build the proposed list in c->pids. */
+static void
+apply_list(chain_t *c, proposal_t *p)
+{
+	int i, *src, *dst, n, moved;
+
+	src = c->ids;
+	dst = c->pids;
+	n = c->n_ids;
+	switch (p->op) {
+	case OP_MOVE:
+		moved = src[p->from];
+		memcpy(dst, src, n * sizeof(int));
+		if (p->from < p->to)
+			memmove(dst + p->from, dst + p->from + 1,
+			    (p->to - p->from) * sizeof(int));
+		else
+			memmove(dst + p->to + 1, dst + p->to,
+			    (p->from - p->to) * sizeof(int));
+		dst[p->to] = moved;
+		c->n_pids = n;
+		break;
+	case OP_ADD:
+		for (i = 0; i < p->to; i++)
+			dst[i] = src[i];
+		dst[p->to] = p->rule_id;
+		for (i = p->to; i < n; i++)
+			dst[i + 1] = src[i];
+		c->n_pids = n + 1;
+		break;
+	case OP_CUT:
+		for (i = 0; i < p->from; i++)
+			dst[i] = src[i];
+		for (i = p->from + 1; i < n; i++)
+			dst[i - 1] = src[i];
+		c->n_pids = n - 1;
+		break;
+	}
+}
+
+/* Make the proposed list current. */
+static void
+accept_list(chain_t *c, proposal_t *p)
+{
+	int *t;
+
+	if (p->op == OP_ADD)
+		ruleindex_take(c->unused, p->rule_id);
+	else if (p->op == OP_CUT)
+		ruleindex_put(c->unused, c->ids[p->from]);
+	t = c->ids;
+	c->ids = c->pids;
+	c->pids = t;
+	c->n_ids = c->n_pids;
+}
+
+/* Apply a proposal to the chain's ruleset (exact mode). */
+static int
+apply_ruleset(chain_t *c, proposal_t *p)
+{
+	model_t *m;
+
+	m = c->model;
+	switch (p->op) {
+	case OP_MOVE:
+		return (ruleset_move(m->rules,
+		    m->nrules, &c->rs, p->from, p->to));
+	case OP_ADD:
+		return (ruleset_add(m->rules,
+		    m->nrules, &c->rs, p->rule_id, p->to));
+	case OP_CUT:
+		return (ruleset_delete(m->rules, m->nrules, c->rs, p->from));
+	}
+	return (EINVAL);
+}
+
+/* Undo apply_ruleset. */
+static int
+undo_ruleset(chain_t *c, proposal_t *p)
+{
+	model_t *m;
+
+	m = c->model;
+	switch (p->op) {
+	case OP_MOVE:
+		return (ruleset_move(m->rules,
+		    m->nrules, &c->rs, p->to, p->from));
+	case OP_ADD:
+		return (ruleset_delete(m->rules, m->nrules, c->rs, p->to));
+	case OP_CUT:
+		return (ruleset_add(m->rules,
+		    m->nrules, &c->rs, c->ids[p->from], p->from));
+	}
+	return (EINVAL);
+}
+
+/* Send a proposal to the chain's workers, asking for their counts. */
+static int
+apply_shards(chain_t *c, proposal_t *p)
+{
+	shards_t *sh;
+
+	sh = c->shards;
+	switch (p->op) {
+	case OP_MOVE:
+		return (shards_send(sh,
+		    SHARD_MOVE | SHARD_REPLY, p->from, p->to));
+	case OP_ADD:
+		return (shards_send(sh,
+		    SHARD_ADD | SHARD_REPLY, p->rule_id, p->to));
+	case OP_CUT:
+		return (shards_send(sh,
+		    SHARD_DELETE | SHARD_REPLY, p->from, 0));
+	}
+	return (EINVAL);
+}
+
+/* Undo apply_shards; the workers queue this behind the next proposal. */
+static int
+undo_shards(chain_t *c, proposal_t *p)
+{
+	shards_t *sh;
+
+	sh = c->shards;
+	switch (p->op) {
+	case OP_MOVE:
+		return (shards_send(sh, SHARD_MOVE, p->to, p->from));
+	case OP_ADD:
+		return (shards_send(sh, SHARD_DELETE, p->to, 0));
+	case OP_CUT:
+		return (shards_send(sh, SHARD_ADD, c->ids[p->from], p->from));
+	}
+	return (EINVAL);
+}
+
+/* Does the ruleset share any captures with a clone? */
+static int
+ruleset_shared(ruleset_t *rs)
+{
+	int i;
+
+	for (i = 0; i < rs->n_rules; i++)
+		if (rs->rules[i].refs != NULL)
+			return (1);
+	return (0);
+}
+
+/* Number of samples in block b. */
+static int
+block_samples(model_t *m, int b)
+{
+	int lo, hi;
+
+	lo = b * BLOCK_WORDS * BITS_PER_ENTRY;
+	hi = lo + BLOCK_WORDS * BITS_PER_ENTRY;
+	return ((hi < m->nsamples ? hi : m->nsamples) - lo);
+}
+
+/*
+ * Decide, from as few blocks as we can, whether the log likelihood of the
+ * proposed list (c->pids) exceeds that of the current one by more than
+ * tau.
+ */
+static int
+approx_decide(chain_t *c, double tau)
+{
+	model_t *m;
+	int i, b, k, target, start, nentries, w0, w1, seen, *bc, *bpc;
+	double d, sum, sumsq, est, se, var;
+
+	m = c->model;
+	nentries = (m->nsamples + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+	memset(c->counts, 0, 2 * c->n_ids * sizeof(int));
+	memset(c->pcounts, 0, 2 * c->n_pids * sizeof(int));
+	bc = c->bcounts;
+	bpc = c->bcounts + 2 * m->nrules;
+
+	start = rnd_int(c, c->nblocks);
+	target = INIT_BLOCKS < c->nblocks ? INIT_BLOCKS : c->nblocks;
+	sum = sumsq = 0;
+	seen = 0;
+	for (k = 0;;) {
+		for (; k < target; k++) {
+			b = c->blocks[(start + k) % c->nblocks];
+			w0 = b * BLOCK_WORDS;
+			w1 = w0 + BLOCK_WORDS < nentries ?
+			    w0 + BLOCK_WORDS : nentries;
+			memset(bc, 0, 2 * c->n_ids * sizeof(int));
+			memset(bpc, 0, 2 * c->n_pids * sizeof(int));
+			rules_cascade(c->ids, c->n_ids,
+			    m->rules, m->label, m->train, w0, w1, bc);
+			rules_cascade(c->pids, c->n_pids,
+			    m->rules, m->label, m->train, w0, w1, bpc);
+			c->stats.nwords += w1 - w0;
+
+			/* This block's own estimate, for the spread. */
+			d = (double)m->nsamples / block_samples(m, b);
+			d = list_loglik(m, bpc, c->n_pids, d) -
+			    list_loglik(m, bc, c->n_ids, d);
+			sum += d;
+			sumsq += d * d;
+
+			for (i = 0; i < 2 * c->n_ids; i++)
+				c->counts[i] += bc[i];
+			for (i = 0; i < 2 * c->n_pids; i++)
+				c->pcounts[i] += bpc[i];
+			seen += block_samples(m, b);
+		}
+
+		d = (double)m->nsamples / seen;
+		est = list_loglik(m, c->pcounts, c->n_pids, d) -
+		    list_loglik(m, c->counts, c->n_ids, d);
+		if (k == c->nblocks)
+			return (est > tau);
+		if (k >= 2) {
+			var = (sumsq - sum * sum / k) / (k - 1);
+			se = sqrt((var > 0 ? var : 0) / k *
+			    (c->nblocks - k) / (c->nblocks - 1));
+			if (fabs(est - tau) > c->tcrit * se)
+				return (est > tau);
+		}
+		target = 2 * k < c->nblocks ? 2 * k : c->nblocks;
+		c->stats.ngrow++;
+	}
+}
+
+/*
+ * Take one Metropolis-Hastings step.  Returns 1 if the proposal was
+ * accepted, 0 if it was rejected, and minus an errno value on error.
+ */
+int
+chain_step(chain_t *c)
+{
+	model_t *m;
+	ruleset_t *saved;
+	proposal_t p;
+	double u, lp, tau, exact;
+	int n, accept, ret, *t;
+
+	m = c->model;
+	propose(c, &p);
+	apply_list(c, &p);
+	u = log(rnd(c));
+	c->stats.nsteps++;
+
+	if (c->tcrit == 0 && c->shards != NULL) {
+		if ((ret = apply_shards(c, &p)) != 0 ||
+		    (ret = shards_recv(c->shards, c->pcounts, &n)) != 0)
+			return (-ret);
+		if (n != c->n_pids)
+			return (-EIO);
+		lp = list_logprior(m, c->pids, c->n_pids) +
+		    list_loglik(m, c->pcounts, c->n_pids, 1.0);
+		accept = u < c->beta * (lp - c->logpost) + p.logj;
+		if (!accept && (ret = undo_shards(c, &p)) != 0)
+			return (-ret);
+		if (accept) {
+			c->logpost = lp;
+			t = c->counts;
+			c->counts = c->pcounts;
+			c->pcounts = t;
+		}
+	} else if (c->tcrit == 0) {
+		/*
+		 * Undoing a proposal on a ruleset that shares its captures
+		 * (see ruleset_clone) would leave it copies of what it
+		 * shared; we go back to a clone of it instead.
+		 */
+		saved = NULL;
+		if (ruleset_shared(c->rs) &&
+		    (ret = ruleset_clone(c->rs, &saved)) != 0)
+			return (-ret);
+		if ((ret = apply_ruleset(c, &p)) != 0) {
+			if (saved != NULL)
+				ruleset_free(saved);
+			return (-ret);
+		}
+		lp = ruleset_logposterior(m, c->rs, c->pids, c->pcounts);
+		accept = u < c->beta * (lp - c->logpost) + p.logj;
+		if (saved != NULL) {
+			if (!accept) {
+				ruleset_free(c->rs);
+				c->rs = saved;
+			} else
+				ruleset_free(saved);
+		} else if (!accept && (ret = undo_ruleset(c, &p)) != 0)
+			return (-ret);
+		if (accept) {
+			c->logpost = lp;
+			t = c->counts;
+			c->counts = c->pcounts;
+			c->pcounts = t;
+		}
+	} else {
+		tau = (u - p.logj) / c->beta -
+		    (list_logprior(m, c->pids, c->n_pids) -
+		    list_logprior(m, c->ids, c->n_ids));
+		accept = approx_decide(c, tau);
+		if (c->verify) {
+			exact = c->beta * (list_logposterior(m,
+			    c->pids, c->n_pids) - list_logposterior(m,
+			    c->ids, c->n_ids)) + p.logj;
+			c->stats.nverified++;
+			if (accept != (u < exact))
+				c->stats.nerrors++;
+		}
+	}
+
+	if (accept) {
+		accept_list(c, &p);
+		c->stats.naccepted++;
+	}
+	return (accept);
+}
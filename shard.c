@@ -0,0 +1,609 @@
+/*
+ * Copyright 2015 President and Fellows of Harvard College.
+ * All rights reserved.
+ */
+
+/*
+ * Sample-sharded worker processes.
+ *
+ * On a machine with several memory nodes, threads of one process that
+ * share the truth tables rules_init built spend much of their time on
+ * remote memory.  Instead, a coordinator can split the samples into
+ * shards and start a worker process per shard, each bound (optionally)
+ * to its own node.  A worker holds the rules' truth tables over its
+ * samples only, in memory it allocated itself after binding, so that the
+ * memory is local, and keeps a ruleset over them.
+ *
+ * The rules come to the workers as a rules image, a binary file the
+ * coordinator writes once (rules_image_write): a header, then the label
+ * vector and every rule's truth table as vector entries, in the layout
+ * of the snapshot format (checkpoint.c).  Each worker maps the image and
+ * copies out its range of entries.  Shards are ranges of whole entries,
+ * so a shard is simply a shorter vector and the rulelib ruleset routines
+ * work on it unchanged.
+ *
+ * The coordinator broadcasts ruleset operations (add, delete, swap and
+ * move, by rule id and position) to every worker through a command ring
+ * in shared memory, one per worker.  An operation marked SHARD_REPLY
+ * makes each worker send back, through its reply ring, the number of its
+ * samples each position of its ruleset captures and how many of those
+ * are in class 1; the coordinator adds these up.  Operations without a
+ * reply (undoing a rejected proposal, say) are queued behind each other
+ * and cost no round trip.  The rings are single-producer, single-consumer
+ * and lock-free: the producer fills a slot and then advances the head,
+ * the consumer reads it and then advances the tail.
+ */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE			/* For sched_setaffinity. */
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "rule.h"
+
+#ifdef GMP
+extern mpz_t mpz_hack_default_mask;
+#endif
+
+#define IMAGE_MAGIC	0x52494d47	/* "RIMG" */
+#define IMAGE_VERSION	1
+
+#define CACHE_LINE	64
+#define CMD_SLOTS	64		/* Commands queued per worker. */
+#define RPL_SLOTS	4		/* Replies queued per worker. */
+#define SHARD_QUIT	0
+
+typedef struct image_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_rules;
+	uint32_t n_samples;
+	uint32_t word_size;		/* sizeof(v_entry) of the writer. */
+	uint32_t n_words;		/* Entries per vector. */
+	uint64_t pad;
+} image_header_t;
+
+typedef struct shard_cmd {
+	int op;
+	int a;
+	int b;
+} shard_cmd_t;
+
+/* Indices into a ring; the two ends are written by different processes. */
+struct ring {
+	uint32_t head __attribute__((aligned(CACHE_LINE)));
+	uint32_t tail __attribute__((aligned(CACHE_LINE)));
+};
+
+/*
+ * A worker's part of the shared region: this, then RPL_SLOTS replies of
+ * (2 + 2 * n_rules) ints (status, positions, then counts).
+ */
+typedef struct shard_ctl {
+	int state;			/* 0 starting, 1 ready, or -errno. */
+	int w0;				/* First entry of the shard. */
+	int w1;				/* ... and one past the last. */
+	struct ring cmd;
+	struct ring rpl;
+	shard_cmd_t cmds[CMD_SLOTS];
+} shard_ctl_t;
+
+#define CTL(sh, k)	((shard_ctl_t *)((sh)->region + (k) * (sh)->ctl_size))
+#define RPL_INTS(sh)	(2 + 2 * (sh)->n_rules)
+#define RPL(sh, ctl, i)	((int *)((ctl) + 1) + ((i) % RPL_SLOTS) * RPL_INTS(sh))
+
+/*
+ * Write the n rules and the label as a rules image, atomically (see
+ * snapshot_write).
+ */
+int
+rules_image_write(const char *file,
+    rule_t *rules, int nrules, int nsamples, VECTOR label)
+{
+	image_header_t *hdr;
+	v_entry *p;
+	size_t len;
+	int i, nentries, ret;
+	char *buf;
+
+	nentries = (nsamples + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+	len = sizeof(image_header_t) +
+	    (size_t)(nrules + 1) * nentries * sizeof(v_entry);
+	if ((buf = calloc(1, len)) == NULL)
+		return (errno);
+	hdr = (image_header_t *)buf;
+	hdr->magic = IMAGE_MAGIC;
+	hdr->version = IMAGE_VERSION;
+	hdr->n_rules = nrules;
+	hdr->n_samples = nsamples;
+	hdr->word_size = sizeof(v_entry);
+	hdr->n_words = nentries;
+	p = (v_entry *)(hdr + 1);
+	for (i = -1; i < nrules; i++, p += nentries) {
+#ifdef GMP
+		/* Low-order word first; the tail stays zero from calloc. */
+		mpz_export(p, NULL, -1, sizeof(v_entry), 0, 0,
+		    i < 0 ? label : rules[i].truthtable);
+#else
+		memcpy(p, i < 0 ? label : rules[i].truthtable,
+		    nentries * sizeof(v_entry));
+#endif
+	}
+	ret = snapshot_write(file, buf, len);
+	free(buf);
+	return (ret);
+}
+
+/* Check an image's header; returns 0 or EINVAL. */
+static int
+image_check(image_header_t *hdr, size_t len)
+{
+	if (len < sizeof(image_header_t) || hdr->magic != IMAGE_MAGIC ||
+	    hdr->version != IMAGE_VERSION ||
+	    hdr->word_size != sizeof(v_entry) || hdr->n_rules < 1 ||
+	    hdr->n_words != (hdr->n_samples + BITS_PER_ENTRY - 1) /
+	    BITS_PER_ENTRY || len != sizeof(image_header_t) +
+	    (size_t)(hdr->n_rules + 1) * hdr->n_words * sizeof(v_entry))
+		return (EINVAL);
+	return (0);
+}
+
+/* Make a shard vector from entries [w0, w1) of an image vector. */
+static int
+shard_vector(v_entry *src, int w0, int w1, int nsamples, VECTOR *v)
+{
+	int ret;
+
+	if ((ret = rule_vinit(nsamples, v)) != 0)
+		return (ret);
+#ifdef GMP
+	mpz_import(*v, w1 - w0, -1, sizeof(v_entry), 0, 0, src + w0);
+#else
+	memcpy(*v, src + w0, (w1 - w0) * sizeof(v_entry));
+#endif
+	return (0);
+}
+
+/*
+ * Back off while waiting: spin a little, then yield the processor, then
+ * sleep, so an idle waiter does not hold a core.
+ */
+static void
+backoff(int *spins)
+{
+	if (++*spins < 64)
+		return;
+	if (*spins < 1024)
+		sched_yield();
+	else
+		usleep(50);
+}
+
+#ifdef __linux__
+/* The number of NUMA nodes, or 0 if we cannot tell. */
+static int
+node_count(void)
+{
+	char path[64];
+	int n;
+
+	for (n = 0;; n++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d",
+		    n);
+		if (access(path, F_OK) != 0)
+			return (n);
+	}
+}
+
+/* Run this process on the processors of a node only. */
+static int
+bind_node(int node)
+{
+	FILE *fp;
+	cpu_set_t set;
+	char path[80];
+	int lo, hi, c, n;
+
+	snprintf(path, sizeof(path),
+	    "/sys/devices/system/node/node%d/cpulist", node);
+	if ((fp = fopen(path, "r")) == NULL)
+		return (errno);
+	/* A list of ranges, e.g. 0-7,16-23. */
+	CPU_ZERO(&set);
+	n = 0;
+	while (fscanf(fp, "%d", &lo) == 1) {
+		hi = lo;
+		if ((c = fgetc(fp)) == '-') {
+			if (fscanf(fp, "%d", &hi) != 1)
+				break;
+			c = fgetc(fp);
+		}
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++, n++)
+			CPU_SET(lo, &set);
+		if (c != ',')
+			break;
+	}
+	fclose(fp);
+	if (n == 0)
+		return (EINVAL);
+	return (sched_setaffinity(0, sizeof(set), &set) == 0 ? 0 : errno);
+}
+#endif
+
+/* Load worker k's shard of the image. */
+static int
+shard_load(shards_t *sh, int k, const char *file,
+    rule_t **rulesp, VECTOR *label, int *nsamples)
+{
+	shard_ctl_t *ctl;
+	image_header_t *hdr;
+	struct stat st;
+	rule_t *rules;
+	v_entry *p;
+	int i, w, fd, ret;
+
+	ctl = CTL(sh, k);
+	if ((fd = open(file, O_RDONLY)) < 0)
+		return (errno);
+	if (fstat(fd, &st) != 0 || (hdr = mmap(NULL, st.st_size,
+	    PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		ret = errno;
+		close(fd);
+		return (ret);
+	}
+	close(fd);
+	ret = image_check(hdr, st.st_size);
+	if (ret == 0 && ((int)hdr->n_rules != sh->n_rules ||
+	    (int)hdr->n_samples != sh->n_samples))
+		ret = EINVAL;
+	if (ret == 0 && (rules = calloc(sh->n_rules, sizeof(rule_t))) == NULL)
+		ret = ENOMEM;
+	if (ret != 0) {
+		munmap(hdr, st.st_size);
+		return (ret);
+	}
+
+	/* Every shard but the last is whole entries. */
+	*nsamples = ctl->w1 < (int)hdr->n_words ?
+	    (ctl->w1 - ctl->w0) * BITS_PER_ENTRY :
+	    sh->n_samples - ctl->w0 * BITS_PER_ENTRY;
+	p = (v_entry *)(hdr + 1);
+	if ((ret = shard_vector(p, ctl->w0, ctl->w1, *nsamples, label)) != 0)
+		goto done;
+	for (i = 0; i < sh->n_rules; i++) {
+		p += hdr->n_words;
+		if ((ret = shard_vector(p, ctl->w0, ctl->w1,
+		    *nsamples, &rules[i].truthtable)) != 0)
+			goto done;
+		for (w = ctl->w0; w < ctl->w1; w++)
+			rules[i].support += count_ones(p[w]);
+	}
+#ifdef GMP
+	/* rule_vandnot complements against the default rule's bits. */
+	mpz_init_set(mpz_hack_default_mask, rules[0].truthtable);
+#endif
+	(void)vkernel_select(*nsamples);
+	*rulesp = rules;
+done:
+	munmap(hdr, st.st_size);
+	return (ret);
+}
+
+/* Apply a command to a worker's ruleset; returns 0 or an errno value. */
+static int
+shard_apply(rule_t *rules, int nrules, ruleset_t **rsp, shard_cmd_t *cmd)
+{
+	ruleset_t *rs;
+	int n, zero;
+
+	rs = *rsp;
+	n = rs->n_rules;
+	switch (cmd->op & ~SHARD_REPLY) {
+	case SHARD_ADD:
+		if (cmd->a < 1 || cmd->a >= nrules ||
+		    cmd->b < 0 || cmd->b >= n)
+			return (EINVAL);
+		return (ruleset_add(rules, nrules, rsp, cmd->a, cmd->b));
+	case SHARD_DELETE:
+		if (cmd->a < 0 || cmd->a >= n - 1)
+			return (EINVAL);
+		return (ruleset_delete(rules, nrules, rs, cmd->a));
+	case SHARD_SWAP:
+		if (cmd->a < 0 || cmd->a >= n - 2)
+			return (EINVAL);
+		return (ruleset_swap(rs, cmd->a, cmd->a + 1, rules));
+	case SHARD_MOVE:
+		if (cmd->a < 0 || cmd->a >= n - 1 ||
+		    cmd->b < 0 || cmd->b >= n - 1)
+			return (EINVAL);
+		return (ruleset_move(rules, nrules, rsp, cmd->a, cmd->b));
+	case SHARD_RESET:
+		zero = 0;
+		n = rs->n_samples;
+		ruleset_free(rs);
+		*rsp = NULL;
+		return (ruleset_init(1, n, &zero, rules, rsp));
+	case SHARD_COUNTS:
+		return (0);
+	}
+	return (EINVAL);
+}
+
+/*
+ * The worker process: load the shard, then serve commands until told to
+ * quit.  Once a command fails, the ruleset no longer matches the
+ * coordinator's, so every reply carries the error until a reset.
+ */
+static void
+shard_serve(shards_t *sh, int k, const char *file, pid_t parent)
+{
+	shard_ctl_t *ctl;
+	shard_cmd_t cmd;
+	rule_t *rules;
+	ruleset_t *rs;
+	VECTOR label;
+	uint32_t t, h;
+	int i, error, spins, nsamples, zero, *rpl;
+
+	ctl = CTL(sh, k);
+	rules = NULL;
+	nsamples = 0;
+#ifdef __linux__
+	/* Bind before we allocate anything, so the shard is local. */
+	if (sh->n_nodes > 0)
+		(void)bind_node(k % sh->n_nodes);
+#endif
+	zero = 0;
+	if ((error = shard_load(sh, k, file, &rules, &label, &nsamples)) != 0 ||
+	    (error = ruleset_init(1, nsamples, &zero, rules, &rs)) != 0) {
+		__atomic_store_n(&ctl->state, -error, __ATOMIC_RELEASE);
+		_exit(1);
+	}
+	__atomic_store_n(&ctl->state, 1, __ATOMIC_RELEASE);
+
+	for (t = ctl->cmd.tail;; t++) {
+		spins = 0;
+		while (__atomic_load_n(&ctl->cmd.head, __ATOMIC_ACQUIRE) == t) {
+			backoff(&spins);
+			/* Don't outlive a coordinator that died. */
+			if (spins % 1024 == 0 && getppid() != parent)
+				_exit(1);
+		}
+		cmd = ctl->cmds[t % CMD_SLOTS];
+		__atomic_store_n(&ctl->cmd.tail, t + 1, __ATOMIC_RELEASE);
+		if (cmd.op == SHARD_QUIT)
+			_exit(0);
+		if ((cmd.op & ~SHARD_REPLY) == SHARD_RESET)
+			error = 0;
+		if ((i = shard_apply(rules, sh->n_rules, &rs, &cmd)) != 0)
+			error = i;
+		if (rs == NULL)
+			_exit(1);
+		if (!(cmd.op & SHARD_REPLY))
+			continue;
+
+		/* The coordinator takes each reply before the next. */
+		h = ctl->rpl.head;
+		spins = 0;
+		while (h - __atomic_load_n(&ctl->rpl.tail,
+		    __ATOMIC_ACQUIRE) == RPL_SLOTS)
+			backoff(&spins);
+		rpl = RPL(sh, ctl, h);
+		rpl[0] = error;
+		rpl[1] = rs->n_rules;
+		for (i = 0; i < rs->n_rules; i++) {
+			rpl[2 + 2 * i] = rs->rules[i].ncaptured;
+			rpl[3 + 2 * i] = rule_vandcnt(rs->rules[i].captures,
+			    label, nsamples);
+		}
+		__atomic_store_n(&ctl->rpl.head, h + 1, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Wait for worker k; returns EIO if it has died.  We look only every so
+ * often, since waitpid is a system call.
+ */
+static int
+shard_wait(shards_t *sh, int k, int *spins)
+{
+	backoff(spins);
+	if (*spins % 1024 == 0 && sh->pids[k] > 0 &&
+	    waitpid(sh->pids[k], NULL, WNOHANG) == sh->pids[k]) {
+		sh->pids[k] = 0;
+		return (EIO);
+	}
+	return (0);
+}
+
+/*
+ * Start nworkers workers (fewer if there are fewer vector entries) over
+ * the rules image in file, each with a ruleset holding only the default
+ * rule.  With bind, worker k runs on NUMA node k modulo the number of
+ * nodes (Linux only; elsewhere bind is ignored).
+ */
+int
+shards_start(const char *file, int nworkers, int bind, shards_t **shp)
+{
+	image_header_t hdr;
+	shards_t *sh;
+	shard_ctl_t *ctl;
+	pid_t parent;
+	size_t page;
+	int k, fd, spins, ret;
+
+	if (nworkers < 1)
+		return (EINVAL);
+	if ((fd = open(file, O_RDONLY)) < 0)
+		return (errno);
+	memset(&hdr, 0, sizeof(hdr));
+	ret = read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) ? 0 : EINVAL;
+	close(fd);
+	if (ret != 0 || hdr.magic != IMAGE_MAGIC ||
+	    hdr.version != IMAGE_VERSION || hdr.word_size != sizeof(v_entry) ||
+	    hdr.n_words == 0)
+		return (EINVAL);
+	if (nworkers > (int)hdr.n_words)
+		nworkers = hdr.n_words;
+
+	if ((sh = calloc(1, sizeof(shards_t))) == NULL ||
+	    (sh->pids = calloc(nworkers, sizeof(int))) == NULL) {
+		free(sh);
+		return (ENOMEM);
+	}
+	sh->n_rules = hdr.n_rules;
+	sh->n_samples = hdr.n_samples;
+#ifdef __linux__
+	if (bind)
+		sh->n_nodes = node_count();
+#endif
+	/* Each worker's part on pages of its own. */
+	page = sysconf(_SC_PAGESIZE);
+	sh->ctl_size = sizeof(shard_ctl_t) +
+	    RPL_SLOTS * RPL_INTS(sh) * sizeof(int);
+	sh->ctl_size = (sh->ctl_size + page - 1) / page * page;
+	sh->region_size = nworkers * sh->ctl_size;
+	sh->region = mmap(NULL, sh->region_size,
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	if (sh->region == MAP_FAILED) {
+		ret = errno;
+		free(sh->pids);
+		free(sh);
+		return (ret);
+	}
+
+	parent = getpid();
+	for (k = 0; k < nworkers; k++) {
+		ctl = CTL(sh, k);
+		ctl->w0 = (long)hdr.n_words * k / nworkers;
+		ctl->w1 = (long)hdr.n_words * (k + 1) / nworkers;
+		if ((sh->pids[k] = fork()) < 0) {
+			ret = errno;
+			sh->pids[k] = 0;
+			break;
+		}
+		if (sh->pids[k] == 0)
+			shard_serve(sh, k, file, parent);
+		sh->n_workers++;
+	}
+	for (k = 0; ret == 0 && k < sh->n_workers; k++) {
+		ctl = CTL(sh, k);
+		spins = 0;
+		while (__atomic_load_n(&ctl->state, __ATOMIC_ACQUIRE) == 0 &&
+		    (ret = shard_wait(sh, k, &spins)) == 0)
+			;
+		if (ret == 0 && ctl->state < 0)
+			ret = -ctl->state;
+	}
+	if (ret != 0) {
+		shards_stop(sh);
+		return (ret);
+	}
+	*shp = sh;
+	return (0);
+}
+
+/* Queue a command for worker k. */
+static int
+shard_send(shards_t *sh, int k, int op, int a, int b)
+{
+	shard_ctl_t *ctl;
+	uint32_t h;
+	int spins, ret;
+
+	ctl = CTL(sh, k);
+	h = ctl->cmd.head;
+	spins = 0;
+	while (h - __atomic_load_n(&ctl->cmd.tail,
+	    __ATOMIC_ACQUIRE) == CMD_SLOTS)
+		if ((ret = shard_wait(sh, k, &spins)) != 0)
+			return (ret);
+	ctl->cmds[h % CMD_SLOTS].op = op;
+	ctl->cmds[h % CMD_SLOTS].a = a;
+	ctl->cmds[h % CMD_SLOTS].b = b;
+	__atomic_store_n(&ctl->cmd.head, h + 1, __ATOMIC_RELEASE);
+	return (0);
+}
+
+/*
+ * Send every worker an operation (SHARD_ADD etc., or'd with SHARD_REPLY
+ * to have each worker reply, which shards_recv then collects).
+ */
+int
+shards_send(shards_t *sh, int op, int a, int b)
+{
+	int k, ret;
+
+	for (k = 0; k < sh->n_workers; k++)
+		if ((ret = shard_send(sh, k, op, a, b)) != 0)
+			return (ret);
+	return (0);
+}
+
+/*
+ * Collect one reply from every worker and add them up: the n positions
+ * of the ruleset (*n) and, for each, the samples it captures
+ * (counts[2*i]) and those of them in class 1 (counts[2*i+1]).  counts
+ * must have room for every rule.
+ */
+int
+shards_recv(shards_t *sh, int *counts, int *n)
+{
+	shard_ctl_t *ctl;
+	uint32_t t;
+	int i, k, spins, ret, *rpl;
+
+	ret = 0;
+	*n = -1;
+	for (k = 0; k < sh->n_workers; k++) {
+		ctl = CTL(sh, k);
+		t = ctl->rpl.tail;
+		spins = 0;
+		while (__atomic_load_n(&ctl->rpl.head, __ATOMIC_ACQUIRE) == t)
+			if ((ret = shard_wait(sh, k, &spins)) != 0)
+				return (ret);
+		/* Take every reply, even after an error, to stay in step. */
+		rpl = RPL(sh, ctl, t);
+		if (ret == 0 && rpl[0] != 0)
+			ret = rpl[0];
+		else if (ret == 0 && k > 0 && rpl[1] != *n)
+			ret = EINVAL;
+		else if (ret == 0) {
+			if (k == 0) {
+				*n = rpl[1];
+				memset(counts, 0, 2 * *n * sizeof(int));
+			}
+			for (i = 0; i < 2 * *n; i++)
+				counts[i] += rpl[2 + i];
+		}
+		__atomic_store_n(&ctl->rpl.tail, t + 1, __ATOMIC_RELEASE);
+	}
+	return (ret);
+}
+
+/* Stop the workers and free everything. */
+void
+shards_stop(shards_t *sh)
+{
+	int k;
+
+	for (k = 0; k < sh->n_workers; k++)
+		if (sh->pids[k] > 0 &&
+		    shard_send(sh, k, SHARD_QUIT, 0, 0) != 0)
+			kill(sh->pids[k], SIGKILL);
+	for (k = 0; k < sh->n_workers; k++)
+		if (sh->pids[k] > 0)
+			(void)waitpid(sh->pids[k], NULL, 0);
+	munmap(sh->region, sh->region_size);
+	free(sh->pids);
+	free(sh);
+}
@@ -0,0 +1,283 @@
+/*
+ * Copyright 2015 President and Fellows of Harvard College.
+ * All rights reserved.
+ */
+
+/*
+ * Parallel tempering (replica exchange) for the rule list sampler.
+ *
+ * We run n_replicas exact chains (sampler.c) at once, one thread each.
+ * Replica k samples the posterior raised to betas[k]; betas[0] is 1 and
+ * the rest fall geometrically to 1/tmax, so the hotter replicas see a
+ * flatter posterior and move between modes more easily.  Every interval
+ * steps the replicas meet and we propose exchanging the states of
+ * neighbours k and k+1 (even pairs one round, odd pairs the next).  The
+ * exchange is accepted with probability
+ *
+ *	min(1, exp((betas[k] - betas[k+1]) * (L[k+1] - L[k])))
+ *
+ * where L is the untempered log posterior of each state.  An exchange
+ * swaps the two chains' list and ruleset pointers (chain_swap_state); no
+ * vectors are copied.  Only replica 0 samples the posterior.
+ *
+ * The replicas meet at a spinning barrier built from atomic operations,
+ * with no locks: each replica counts itself in, and the last to arrive
+ * makes the exchanges for the round and releases the others by flipping
+ * the barrier's sense.  With tmax = 1 every replica samples the
+ * posterior and no exchanges are proposed: the replicas are then just
+ * independent chains run in parallel, for comparison.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rule.h"
+
+struct replica {
+	tempering_t *pt;
+	int k;
+	int iters;
+	int burnin;
+	pthread_t thread;
+};
+
+/*
+ * Set up n replicas over model m, the hottest at temperature tmax,
+ * meeting every interval steps.  Replica k's chain is seeded with
+ * seed + k.  Whether or not we succeed, pt can be given to
+ * tempering_free.
+ */
+int
+tempering_init(tempering_t *pt, model_t *m,
+    int n, double tmax, int interval, unsigned seed)
+{
+	int k, ret;
+
+	memset(pt, 0, sizeof(tempering_t));
+	if (n < 1 || tmax < 1 || interval < 1)
+		return (EINVAL);
+	pt->interval = interval;
+	rng_seed(&pt->rng, seed);
+	pt->chains = calloc(n, sizeof(chain_t));
+	pt->betas = malloc(n * sizeof(double));
+	pt->ntried = calloc(n, sizeof(long));
+	pt->nswapped = calloc(n, sizeof(long));
+	pt->best = malloc(n * sizeof(double));
+	pt->best_ids = malloc(n * m->nrules * sizeof(int));
+	pt->n_best = calloc(n, sizeof(int));
+	if (pt->chains == NULL || pt->betas == NULL || pt->ntried == NULL ||
+	    pt->nswapped == NULL || pt->best == NULL ||
+	    pt->best_ids == NULL || pt->n_best == NULL) {
+		tempering_free(pt);
+		return (ENOMEM);
+	}
+	for (k = 0; k < n; k++) {
+		if ((ret = chain_init(pt->chains + k, m, 0, seed + k)) != 0) {
+			tempering_free(pt);
+			return (ret);
+		}
+		pt->n_replicas++;
+		pt->betas[k] = n == 1 ? 1 : pow(tmax, -(double)k / (n - 1));
+		pt->chains[k].beta = pt->betas[k];
+		pt->best[k] = -INFINITY;
+	}
+	return (0);
+}
+
+void
+tempering_free(tempering_t *pt)
+{
+	int k;
+
+	for (k = 0; k < pt->n_replicas; k++)
+		chain_free(pt->chains + k);
+	free(pt->chains);
+	free(pt->betas);
+	free(pt->ntried);
+	free(pt->nswapped);
+	free(pt->trace);
+	free(pt->best);
+	free(pt->best_ids);
+	free(pt->n_best);
+	memset(pt, 0, sizeof(tempering_t));
+}
+
+/* Propose this round's exchanges; the other replicas are all waiting. */
+static void
+exchange(tempering_t *pt)
+{
+	chain_t *a, *b;
+	double logr;
+	int k;
+
+	for (k = pt->round % 2; k + 1 < pt->n_replicas; k += 2) {
+		if (pt->betas[k] == pt->betas[k + 1])
+			continue;
+		a = pt->chains + k;
+		b = pt->chains + k + 1;
+		logr = (pt->betas[k] - pt->betas[k + 1]) *
+		    (b->logpost - a->logpost);
+		pt->ntried[k]++;
+		if (log(rng_uniform(&pt->rng)) < logr) {
+			chain_swap_state(a, b);
+			pt->nswapped[k]++;
+		}
+	}
+	pt->round++;
+}
+
+/*
+ * Wait for every replica to get here; the last one in makes the
+ * exchanges.  Returns the error flag as the last one in found it: a
+ * replica released early may set pt->error before a slower one reads
+ * it, so every replica returns the round's copy instead, and all of
+ * them leave the loop together or not at all.
+ */
+static int
+meet(tempering_t *pt, int *sense)
+{
+	*sense = !*sense;
+	if (__atomic_add_fetch(&pt->arrived, 1, __ATOMIC_ACQ_REL) ==
+	    pt->n_replicas) {
+		pt->arrived = 0;
+		pt->round_error =
+		    __atomic_load_n(&pt->error, __ATOMIC_RELAXED);
+		if (pt->round_error == 0)
+			exchange(pt);
+		__atomic_store_n(&pt->sense, *sense, __ATOMIC_RELEASE);
+	} else
+		while (__atomic_load_n(&pt->sense, __ATOMIC_ACQUIRE) != *sense)
+			sched_yield();
+	return (pt->round_error);
+}
+
+static void *
+replica_run(void *arg)
+{
+	struct replica *r;
+	tempering_t *pt;
+	chain_t *c;
+	double *trace;
+	int j, sense, nrules, start, failed, ret;
+
+	r = arg;
+	pt = r->pt;
+	c = pt->chains + r->k;
+	nrules = c->model->nrules;
+	trace = pt->trace + r->k * pt->n_trace;
+	while ((start = __atomic_load_n(&pt->start, __ATOMIC_ACQUIRE)) == 0)
+		sched_yield();
+	if (start < 0)
+		return (NULL);
+
+	sense = failed = 0;
+	for (j = 0; j < r->iters; j++) {
+		/* After a failure we only keep the others company. */
+		if (!failed && (ret = chain_step(c)) < 0) {
+			failed = 1;
+			__atomic_store_n(&pt->error, -ret, __ATOMIC_RELAXED);
+		}
+		if (j >= r->burnin) {
+			trace[j - r->burnin] = c->logpost;
+			if (pt->betas[r->k] == 1 &&
+			    c->logpost > pt->best[r->k]) {
+				pt->best[r->k] = c->logpost;
+				memcpy(pt->best_ids + r->k * nrules,
+				    c->ids, c->n_ids * sizeof(int));
+				pt->n_best[r->k] = c->n_ids;
+			}
+		}
+		if ((j + 1) % pt->interval == 0 && meet(pt, &sense) != 0)
+			break;
+	}
+	return (NULL);
+}
+
+/*
+ * Run every replica for iters steps, tracing the log posterior of each
+ * after each step past burnin (into trace, n_trace entries per replica).
+ * The calling thread runs replica 0.
+ */
+int
+tempering_run(tempering_t *pt, int iters, int burnin)
+{
+	struct replica *r;
+	double *trace;
+	int k, n, ret;
+
+	if (burnin < 0 || burnin >= iters)
+		return (EINVAL);
+	n = pt->n_replicas;
+	if ((trace = realloc(pt->trace,
+	    n * (iters - burnin) * sizeof(double))) == NULL)
+		return (ENOMEM);
+	pt->trace = trace;
+	pt->n_trace = iters - burnin;
+	if ((r = calloc(n, sizeof(struct replica))) == NULL)
+		return (ENOMEM);
+	pt->start = pt->arrived = pt->sense = 0;
+	pt->error = pt->round_error = 0;
+
+	ret = 0;
+	for (k = 0; k < n; k++) {
+		r[k].pt = pt;
+		r[k].k = k;
+		r[k].iters = iters;
+		r[k].burnin = burnin;
+		if (k > 0 && (ret = pthread_create(&r[k].thread,
+		    NULL, replica_run, r + k)) != 0)
+			break;
+	}
+	/* Every thread waits at the start until we know all are there. */
+	__atomic_store_n(&pt->start, k == n ? 1 : -1, __ATOMIC_RELEASE);
+	if (k == n)
+		replica_run(r);
+	while (--k > 0)
+		pthread_join(r[k].thread, NULL);
+	free(r);
+	return (ret != 0 ? ret : pt->error);
+}
+
+/*
+ * Effective sample size of a trace of n values, from its autocorrelations
+ * summed in pairs until a pair's sum is no longer positive (Geyer's
+ * initial positive sequence estimator).
+ */
+double
+trace_ess(double *x, int n)
+{
+	double mean, c0, sum, pair;
+	int i, t;
+
+	if (n < 2)
+		return (n);
+	mean = 0;
+	for (i = 0; i < n; i++)
+		mean += x[i];
+	mean /= n;
+	c0 = 0;
+	for (i = 0; i < n; i++)
+		c0 += (x[i] - mean) * (x[i] - mean);
+	/* A chain that never moved has one sample's worth. */
+	if (c0 == 0)
+		return (1);
+
+	sum = 0;
+	for (t = 0; 2 * t + 1 < n; t++) {
+		pair = 0;
+		for (i = 0; i + 2 * t < n; i++)
+			pair += (x[i] - mean) * (x[i + 2 * t] - mean);
+		for (i = 0; i + 2 * t + 1 < n; i++)
+			pair += (x[i] - mean) * (x[i + 2 * t + 1] - mean);
+		pair /= c0;
+		if (pair <= 0)
+			break;
+		sum += pair;
+	}
+	sum = 2 * sum - 1;
+	return (sum < 1 ? n : n / sum);
+}
@@ -0,0 +1,554 @@
+/*
+ * Copyright 2015 President and Fellows of Harvard College.
+ * All rights reserved.
+ */
+
+/*
+ * Traces of the states a sampler keeps.
+ *
+ * bayesdl_mcmc keeps every sample, as a string, in a list in memory,
+ * which long runs outgrow.  Here each chain pushes the states it keeps
+ * into a queue of its own, and a writer thread drains the queues into a
+ * file, so the sampling thread never waits on the disk.
+ *
+ * A queue is a ring of words with one producer (the chain) and one
+ * consumer (the writer), which share only two counters: the chain
+ * publishes a record by advancing tail and the writer frees its space by
+ * advancing head, each a release store that the other side reads with
+ * acquire, so there are no locks.  If a queue is full the chain does not
+ * wait; the state is dropped and counted.  The writer sleeps briefly
+ * when it finds every queue empty.
+ *
+ * Successive states of a chain differ by at most one proposal (a rule
+ * added, cut or moved), so the writer encodes each list against the
+ * chain's previous one: how many rules at the front and at the back are
+ * unchanged, and the new rules in between; most proposals are rejected,
+ * leaving the list and its log posterior as they were, and then the log
+ * posterior is not written again.  Every number is a varint (7 bits a
+ * byte, low bits first), so an unchanged state takes 5 bytes.
+ *
+ * A file starts with a header (magic, version, number of chains and of
+ * rules) and the features of rules 1 .. n_rules - 1, so a trace can be
+ * read without the rules it came from.  Each record is then the chain;
+ * the step as the increase over the chain's previous record, times 2,
+ * plus 1 if the log posterior is the previous record's; if not, the log
+ * posterior (8 bytes, little-endian); the number of rules kept at the
+ * front and at the back; and the number of new ones and their ids.  A
+ * reader streams the records back with the lists decoded.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "rule.h"
+
+#define TRACE_MAGIC	0x52545243	/* "RTRC" */
+#define TRACE_VERSION	1
+
+#define REC_WORDS	5		/* n, step and log posterior. */
+#define MAX_VARINT	10		/* Bytes in a 64-bit varint. */
+
+struct trace_queue {
+	uint64_t head __attribute__((aligned(64)));	/* Words consumed. */
+	uint64_t tail __attribute__((aligned(64)));	/* Words published. */
+	uint32_t *ring;
+	uint64_t size;			/* Words in ring, a power of 2. */
+	long last_step;			/* The chain's last step pushed. */
+	long nkept;
+	long ndropped;
+	int *prev;			/* The writer's copy of the list. */
+	int n_prev;
+	long prev_step;
+	double prev_logpost;
+};
+
+struct tracer {
+	int n_chains;
+	int n_rules;
+	struct trace_queue *queues;
+	FILE *fp;
+	unsigned char *buf;		/* One encoded record. */
+	int *ids;			/* One popped list. */
+	long nbytes;
+	int stop;
+	int error;
+	pthread_t thread;
+};
+
+struct trace_reader {
+	FILE *fp;
+	int n_chains;
+	int n_rules;
+	char **features;
+	int **prev;			/* Each chain's last list ... */
+	int *n_prev;
+	long *prev_step;		/* ... step ... */
+	double *prev_logpost;		/* ... and log posterior. */
+	int *ids;
+};
+
+static unsigned char *
+put_varint(unsigned char *p, uint64_t x)
+{
+	while (x >= 0x80) {
+		*p++ = (unsigned char)(x | 0x80);
+		x >>= 7;
+	}
+	*p++ = (unsigned char)x;
+	return (p);
+}
+
+static unsigned char *
+put_double(unsigned char *p, double d)
+{
+	uint64_t x;
+	int i;
+
+	memcpy(&x, &d, sizeof(x));
+	for (i = 0; i < 8; i++, x >>= 8)
+		*p++ = (unsigned char)x;
+	return (p);
+}
+
+/* Read a varint; returns 0, or EINVAL at the end of the file. */
+static int
+get_varint(FILE *fp, uint64_t *xp)
+{
+	uint64_t x;
+	int c, shift;
+
+	x = 0;
+	for (shift = 0; shift < 64; shift += 7) {
+		if ((c = getc(fp)) == EOF)
+			return (EINVAL);
+		x |= (uint64_t)(c & 0x7f) << shift;
+		if ((c & 0x80) == 0) {
+			*xp = x;
+			return (0);
+		}
+	}
+	return (EINVAL);
+}
+
+static int
+get_double(FILE *fp, double *dp)
+{
+	unsigned char b[8];
+	uint64_t x;
+	int i;
+
+	if (fread(b, 1, 8, fp) != 8)
+		return (EINVAL);
+	x = 0;
+	for (i = 7; i >= 0; i--)
+		x = x << 8 | b[i];
+	memcpy(dp, &x, sizeof(x));
+	return (0);
+}
+
+/* Take the oldest record from q; returns its length, or 0 if q is empty. */
+static int
+queue_pop(struct trace_queue *q, int *ids, long *step, double *logpost)
+{
+	uint64_t head, tail, x, mask;
+	int i, n;
+
+	tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	head = q->head;
+	if (head == tail)
+		return (0);
+	mask = q->size - 1;
+	n = (int)q->ring[head & mask];
+	*step = (long)((uint64_t)q->ring[(head + 1) & mask] |
+	    (uint64_t)q->ring[(head + 2) & mask] << 32);
+	x = (uint64_t)q->ring[(head + 3) & mask] |
+	    (uint64_t)q->ring[(head + 4) & mask] << 32;
+	memcpy(logpost, &x, sizeof(x));
+	for (i = 0; i < n; i++)
+		ids[i] = (int)q->ring[(head + REC_WORDS + i) & mask];
+	__atomic_store_n(&q->head, head + REC_WORDS + n, __ATOMIC_RELEASE);
+	return (n);
+}
+
+/* Encode a list against the chain's last one and append it to the file. */
+static int
+trace_write(tracer_t *t, int k, int *ids, int n, long step, double logpost)
+{
+	struct trace_queue *q;
+	unsigned char *p;
+	int i, front, back, same;
+
+	q = t->queues + k;
+	for (front = 0; front < n && front < q->n_prev &&
+	    ids[front] == q->prev[front]; front++)
+		;
+	for (back = 0; front + back < n && front + back < q->n_prev &&
+	    ids[n - 1 - back] == q->prev[q->n_prev - 1 - back]; back++)
+		;
+	same = q->n_prev > 0 &&
+	    memcmp(&logpost, &q->prev_logpost, sizeof(double)) == 0;
+	p = put_varint(t->buf, k);
+	p = put_varint(p, (uint64_t)(step - q->prev_step) << 1 | same);
+	if (!same)
+		p = put_double(p, logpost);
+	p = put_varint(p, front);
+	p = put_varint(p, back);
+	p = put_varint(p, n - front - back);
+	for (i = front; i < n - back; i++)
+		p = put_varint(p, ids[i]);
+	memcpy(q->prev, ids, n * sizeof(int));
+	q->n_prev = n;
+	q->prev_step = step;
+	q->prev_logpost = logpost;
+
+	if (fwrite(t->buf, 1, p - t->buf, t->fp) != (size_t)(p - t->buf))
+		return (errno != 0 ? errno : EIO);
+	t->nbytes += p - t->buf;
+	return (0);
+}
+
+static void *
+tracer_thread(void *arg)
+{
+	tracer_t *t;
+	long step;
+	double logpost;
+	int k, n, stop, busy, ret;
+
+	t = arg;
+	for (;;) {
+		/* Whatever was pushed before stop was set, we drain now. */
+		stop = __atomic_load_n(&t->stop, __ATOMIC_ACQUIRE);
+		busy = 0;
+		for (k = 0; k < t->n_chains; k++)
+			while ((n = queue_pop(t->queues + k,
+			    t->ids, &step, &logpost)) != 0) {
+				busy = 1;
+				if (t->error == 0 && (ret = trace_write(t,
+				    k, t->ids, n, step, logpost)) != 0)
+					t->error = ret;
+			}
+		if (busy)
+			continue;
+		if (stop)
+			break;
+		usleep(1000);
+	}
+	return (NULL);
+}
+
+static void
+tracer_free(tracer_t *t)
+{
+	int k;
+
+	if (t->queues != NULL)
+		for (k = 0; k < t->n_chains; k++) {
+			free(t->queues[k].ring);
+			free(t->queues[k].prev);
+		}
+	free(t->queues);
+	free(t->buf);
+	free(t->ids);
+	free(t);
+}
+
+/*
+ * Start a trace of nchains chains over rules[0 .. nrules-1] in file, each
+ * chain with a queue of at least qwords words (a state of n rules takes
+ * n + 5).
+ */
+int
+tracer_start(const char *file, int nchains,
+    rule_t *rules, int nrules, int qwords, tracer_t **tp)
+{
+	tracer_t *t;
+	struct trace_queue *q;
+	unsigned char *p;
+	uint64_t size;
+	size_t len;
+	int i, k, ret;
+
+	if (nchains < 1 || nrules < 1 || qwords < REC_WORDS + nrules)
+		return (EINVAL);
+	if ((t = calloc(1, sizeof(tracer_t))) == NULL)
+		return (ENOMEM);
+	t->n_chains = nchains;
+	t->n_rules = nrules;
+	for (size = 1; size < (uint64_t)qwords; size <<= 1)
+		;
+	/* Room for a record, and for a header or a rule's features. */
+	len = (size_t)MAX_VARINT * (nrules + 6) + 8;
+	for (i = 1; i < nrules; i++)
+		if (strlen(rules[i].features) + MAX_VARINT > len)
+			len = strlen(rules[i].features) + MAX_VARINT;
+	t->queues = calloc(nchains, sizeof(struct trace_queue));
+	t->buf = malloc(len);
+	t->ids = malloc(nrules * sizeof(int));
+	if (t->queues == NULL || t->buf == NULL || t->ids == NULL) {
+		tracer_free(t);
+		return (ENOMEM);
+	}
+	for (k = 0; k < nchains; k++) {
+		q = t->queues + k;
+		q->size = size;
+		q->last_step = -1;
+		q->ring = malloc(size * sizeof(uint32_t));
+		q->prev = malloc(nrules * sizeof(int));
+		if (q->ring == NULL || q->prev == NULL) {
+			tracer_free(t);
+			return (ENOMEM);
+		}
+	}
+
+	if ((t->fp = fopen(file, "w")) == NULL) {
+		ret = errno;
+		tracer_free(t);
+		return (ret);
+	}
+	p = put_varint(t->buf, TRACE_MAGIC);
+	p = put_varint(p, TRACE_VERSION);
+	p = put_varint(p, nchains);
+	p = put_varint(p, nrules);
+	ret = fwrite(t->buf, 1, p - t->buf, t->fp) == (size_t)(p - t->buf) ?
+	    0 : EIO;
+	for (i = 1; i < nrules && ret == 0; i++) {
+		len = strlen(rules[i].features);
+		p = put_varint(t->buf, len);
+		memcpy(p, rules[i].features, len);
+		p += len;
+		if (fwrite(t->buf, 1, p - t->buf, t->fp) !=
+		    (size_t)(p - t->buf))
+			ret = EIO;
+	}
+	if (ret == 0)
+		ret = pthread_create(&t->thread, NULL, tracer_thread, t);
+	if (ret != 0) {
+		(void)fclose(t->fp);
+		tracer_free(t);
+		return (ret);
+	}
+	*tp = t;
+	return (0);
+}
+
+/*
+ * Queue chain k's state at step (steps must increase): its list
+ * ids[0 .. n-1] and log posterior.  This never waits: if the chain's
+ * queue is full, the state is dropped and we return EAGAIN.
+ */
+int
+tracer_push(tracer_t *t, int k, long step, double logpost, int *ids, int n)
+{
+	struct trace_queue *q;
+	uint64_t head, tail, x, mask;
+	int i;
+
+	if (k < 0 || k >= t->n_chains || n < 1 || n > t->n_rules)
+		return (EINVAL);
+	q = t->queues + k;
+	if (step <= q->last_step)
+		return (EINVAL);
+	head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	tail = q->tail;
+	if (tail + REC_WORDS + n - head > q->size) {
+		q->ndropped++;
+		return (EAGAIN);
+	}
+	mask = q->size - 1;
+	q->ring[tail & mask] = (uint32_t)n;
+	q->ring[(tail + 1) & mask] = (uint32_t)step;
+	q->ring[(tail + 2) & mask] = (uint32_t)((uint64_t)step >> 32);
+	memcpy(&x, &logpost, sizeof(x));
+	q->ring[(tail + 3) & mask] = (uint32_t)x;
+	q->ring[(tail + 4) & mask] = (uint32_t)(x >> 32);
+	for (i = 0; i < n; i++)
+		q->ring[(tail + REC_WORDS + i) & mask] = (uint32_t)ids[i];
+	__atomic_store_n(&q->tail, tail + REC_WORDS + n, __ATOMIC_RELEASE);
+	q->last_step = step;
+	q->nkept++;
+	return (0);
+}
+
+/*
+ * Write out everything queued, close the file and fill in stats (if not
+ * NULL).  Returns the first error writing the file, or 0.  Every chain
+ * must be done pushing.
+ */
+int
+tracer_stop(tracer_t *t, trace_stats_t *stats)
+{
+	int k, ret;
+
+	__atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(t->thread, NULL);
+	ret = t->error;
+	if (fclose(t->fp) != 0 && ret == 0)
+		ret = errno;
+	if (stats != NULL) {
+		memset(stats, 0, sizeof(trace_stats_t));
+		for (k = 0; k < t->n_chains; k++) {
+			stats->n_kept += t->queues[k].nkept;
+			stats->n_dropped += t->queues[k].ndropped;
+		}
+		stats->n_bytes = t->nbytes;
+	}
+	tracer_free(t);
+	return (ret);
+}
+
+/* Open a trace for reading; gives its numbers of chains and rules. */
+int
+trace_open(const char *file,
+    trace_reader_t **trp, int *nchainsp, int *nrulesp)
+{
+	trace_reader_t *tr;
+	uint64_t magic, version, nchains, nrules, len;
+	int i, ret;
+
+	if ((tr = calloc(1, sizeof(trace_reader_t))) == NULL)
+		return (ENOMEM);
+	if ((tr->fp = fopen(file, "r")) == NULL) {
+		ret = errno;
+		free(tr);
+		return (ret);
+	}
+	if ((ret = get_varint(tr->fp, &magic)) != 0 ||
+	    (ret = get_varint(tr->fp, &version)) != 0 ||
+	    (ret = get_varint(tr->fp, &nchains)) != 0 ||
+	    (ret = get_varint(tr->fp, &nrules)) != 0)
+		goto err;
+	ret = EINVAL;
+	if (magic != TRACE_MAGIC || version != TRACE_VERSION ||
+	    nchains < 1 || nchains > INT32_MAX ||
+	    nrules < 1 || nrules > INT32_MAX)
+		goto err;
+	tr->n_chains = (int)nchains;
+	tr->n_rules = (int)nrules;
+	ret = ENOMEM;
+	tr->features = calloc(nrules, sizeof(char *));
+	tr->prev = calloc(nchains, sizeof(int *));
+	tr->n_prev = calloc(nchains, sizeof(int));
+	tr->prev_step = calloc(nchains, sizeof(long));
+	tr->prev_logpost = calloc(nchains, sizeof(double));
+	tr->ids = malloc(nrules * sizeof(int));
+	if (tr->features == NULL || tr->prev == NULL || tr->n_prev == NULL ||
+	    tr->prev_step == NULL || tr->prev_logpost == NULL ||
+	    tr->ids == NULL)
+		goto err;
+	for (i = 0; i < tr->n_chains; i++)
+		if ((tr->prev[i] = malloc(nrules * sizeof(int))) == NULL)
+			goto err;
+	if ((tr->features[0] = strdup("default")) == NULL)
+		goto err;
+	for (i = 1; i < tr->n_rules; i++) {
+		if ((ret = get_varint(tr->fp, &len)) != 0)
+			goto err;
+		ret = ENOMEM;
+		if (len > 1 << 20 ||
+		    (tr->features[i] = malloc(len + 1)) == NULL)
+			goto err;
+		ret = EINVAL;
+		if (fread(tr->features[i], 1, len, tr->fp) != len)
+			goto err;
+		tr->features[i][len] = '\0';
+	}
+	*trp = tr;
+	*nchainsp = tr->n_chains;
+	*nrulesp = tr->n_rules;
+	return (0);
+
+err:
+	trace_close(tr);
+	return (ret);
+}
+
+/*
+ * Read the next state into st; its ids stay valid until the next call.
+ * At the end of the trace we return 0 with st->n_ids 0.  A trace cut
+ * short (say, by a crash) ends with EINVAL after its last whole state.
+ */
+int
+trace_next(trace_reader_t *tr, trace_state_t *st)
+{
+	uint64_t k, dstep, front, back, nnew, id;
+	int *prev, i, c, ret;
+
+	memset(st, 0, sizeof(trace_state_t));
+	if ((c = getc(tr->fp)) == EOF)
+		return (ferror(tr->fp) ? EIO : 0);
+	ungetc(c, tr->fp);
+	if ((ret = get_varint(tr->fp, &k)) != 0 ||
+	    (ret = get_varint(tr->fp, &dstep)) != 0)
+		return (ret);
+	if (k >= (uint64_t)tr->n_chains ||
+	    ((dstep & 1) != 0 && tr->n_prev[k] == 0))
+		return (EINVAL);
+	if ((dstep & 1) != 0)
+		st->logpost = tr->prev_logpost[k];
+	else if ((ret = get_double(tr->fp, &st->logpost)) != 0)
+		return (ret);
+	if ((ret = get_varint(tr->fp, &front)) != 0 ||
+	    (ret = get_varint(tr->fp, &back)) != 0 ||
+	    (ret = get_varint(tr->fp, &nnew)) != 0)
+		return (ret);
+	if (front + back > (uint64_t)tr->n_prev[k] ||
+	    nnew > (uint64_t)tr->n_rules ||
+	    front + back + nnew > (uint64_t)tr->n_rules ||
+	    front + back + nnew == 0)
+		return (EINVAL);
+
+	prev = tr->prev[k];
+	memcpy(tr->ids, prev, front * sizeof(int));
+	for (i = 0; i < (int)nnew; i++) {
+		if ((ret = get_varint(tr->fp, &id)) != 0)
+			return (ret);
+		if (id >= (uint64_t)tr->n_rules)
+			return (EINVAL);
+		tr->ids[front + i] = (int)id;
+	}
+	memcpy(tr->ids + front + nnew,
+	    prev + tr->n_prev[k] - back, back * sizeof(int));
+	tr->n_prev[k] = (int)(front + back + nnew);
+	memcpy(prev, tr->ids, tr->n_prev[k] * sizeof(int));
+	tr->prev_step[k] += (long)(dstep >> 1);
+	tr->prev_logpost[k] = st->logpost;
+
+	st->chain = (int)k;
+	st->step = tr->prev_step[k];
+	st->ids = tr->ids;
+	st->n_ids = tr->n_prev[k];
+	return (0);
+}
+
+/* The features of rule id in the trace's numbering. */
+const char *
+trace_features(trace_reader_t *tr, int id)
+{
+	return (id >= 0 && id < tr->n_rules ? tr->features[id] : NULL);
+}
+
+void
+trace_close(trace_reader_t *tr)
+{
+	int i;
+
+	if (tr->fp != NULL)
+		(void)fclose(tr->fp);
+	if (tr->features != NULL)
+		for (i = 0; i < tr->n_rules; i++)
+			free(tr->features[i]);
+	if (tr->prev != NULL)
+		for (i = 0; i < tr->n_chains; i++)
+			free(tr->prev[i]);
+	free(tr->features);
+	free(tr->prev);
+	free(tr->n_prev);
+	free(tr->prev_step);
+	free(tr->prev_logpost);
+	free(tr->ids);
+	free(tr);
+}
@@ -0,0 +1,270 @@
+/*
+ * Copyright 2015 President and Fellows of Harvard College.
+ * All rights reserved.
+ */
+
+/*
+ * The truth tables transposed, for per-sample queries.
+ *
+ * Finding the rule of a list that first captures a sample (to explain a
+ * prediction, say) from the rule-major truth tables means reading a word
+ * from the truth table of each rule of the list until one has the
+ * sample's bit, each word in a different place.  A rule matrix keeps the
+ * same bits sample-major: each sample has a bitmap of the rules it
+ * satisfies, a few words together, and the list's rules are tested
+ * against it in order.
+ *
+ * For every sample at once, the capture cascade (cascade_positions) is
+ * faster than either: each word it reads settles a whole entry of
+ * samples.  So the matrix is for when only some samples are asked about.
+ *
+ * The samples are kept in blocks, block b holding the samples of entry b
+ * of a truth table.  A block is the unit of building: each entry's worth
+ * of rules makes a square of BITS_PER_ENTRY rules by BITS_PER_ENTRY
+ * samples, read as entry b of each rule's truth table and transposed in
+ * place.  Blocks are independent, so they are built as jobs on a
+ * work-stealing pool (pool.c).
+ *
+ * Within a block, RM_ROWS keeps each sample's bitmap together.  RM_BLOCKED
+ * is bit-sliced instead: entry w of every sample's bitmap is together, so
+ * the squares are transposed where they lie.  A sample's hits are then its
+ * bitmap and'ed with a bitmap of the list's rules, and its rule is the hit
+ * of lowest position, taken by find-first-set; for every sample, the and
+ * runs over contiguous words.  analyze -M times both.  RM_ROWS is faster
+ * except for every sample when all the rules fit in one entry: bit-sliced,
+ * a sample costs a step for each rule of the list it satisfies, not for
+ * each rule ahead of the one that captures it, and samples satisfy many
+ * rules, more the longer the list; and the list's bitmap is built for
+ * each query.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rule.h"
+
+#define BLOCK		((int)BITS_PER_ENTRY)	/* Samples per block. */
+
+/* The bitmap of sample j of block b. */
+#define ROW(rm, b, j) \
+	((rm)->bits + ((size_t)(b) * BLOCK + (j)) * (rm)->n_words)
+
+/* Entry w of the bitmaps of block b (RM_BLOCKED). */
+#define SLICE(rm, b, w) \
+	((rm)->bits + ((size_t)(b) * (rm)->n_words + (w)) * BLOCK)
+
+struct build {
+	rulematrix_t *rm;
+	rule_t *rules;
+};
+
+/*
+ * Transpose a square of bits in place: bit j of a[i] and bit i of a[j]
+ * trade places.  The pass for each j, from half the side down to 1, swaps
+ * the off-diagonal quarters of every square of side 2j on the diagonal.
+ */
+static void
+transpose(v_entry *a)
+{
+	v_entry m, t;
+	int j, k;
+
+	m = ~(v_entry)0 >> (BLOCK / 2);
+	for (j = BLOCK / 2; j != 0; j >>= 1, m ^= m << j)
+		for (k = 0; k < BLOCK; k = ((k | j) + 1) & ~j) {
+			t = ((a[k] >> j) ^ a[k | j]) & m;
+			a[k] ^= t << j;
+			a[k | j] ^= t;
+		}
+}
+
+/* Build block b. */
+static int
+build_block(void *arg, int b)
+{
+	struct build *bd;
+	rulematrix_t *rm;
+	v_entry row[BLOCK], *a;
+	int i, r, w;
+
+	bd = arg;
+	rm = bd->rm;
+	for (w = 0; w < rm->n_words; w++) {
+		a = rm->layout == RM_BLOCKED ? SLICE(rm, b, w) : row;
+		for (i = 0; i < BLOCK; i++) {
+			r = w * BITS_PER_ENTRY + i;
+			a[i] = r < rm->n_rules ?
+			    VWORD(bd->rules[r].truthtable, b) : 0;
+		}
+		transpose(a);
+		for (i = 0; rm->layout == RM_ROWS && i < BLOCK; i++)
+			ROW(rm, b, i)[w] = a[i];
+	}
+	return (0);
+}
+
+/*
+ * Build the matrix of rules[0 .. nrules-1] over nsamples samples in
+ * layout (RM_ROWS or RM_BLOCKED) on nthreads threads, filling in stats if
+ * it is not NULL.
+ */
+int
+rulematrix_init(rulematrix_t *rm, rule_t *rules, int nrules,
+    int nsamples, int layout, int nthreads, pool_stats_t *stats)
+{
+	struct build bd;
+	int nblocks, ret;
+
+	memset(rm, 0, sizeof(rulematrix_t));
+	if (nrules < 1 || nsamples < 1 ||
+	    (layout != RM_ROWS && layout != RM_BLOCKED))
+		return (EINVAL);
+	rm->layout = layout;
+	nblocks = (nsamples + BLOCK - 1) / BLOCK;
+	rm->n_rules = nrules;
+	rm->n_samples = nsamples;
+	rm->n_words = (nrules + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+	if ((rm->bits = malloc((size_t)nblocks *
+	    rm->n_words * BLOCK * sizeof(v_entry))) == NULL)
+		return (ENOMEM);
+	bd.rm = rm;
+	bd.rules = rules;
+	if ((ret = pool_run(nthreads,
+	    nblocks, build_block, &bd, stats)) != 0)
+		rulematrix_free(rm);
+	return (ret);
+}
+
+/* The position on the list ids[0..n-1] capturing sample j of block b. */
+static int
+sample_position(rulematrix_t *rm, int *ids, int n, int b, int j)
+{
+	v_entry *row;
+	int i;
+
+	row = ROW(rm, b, j);
+	for (i = 0; i < n - 1; i++)
+		if ((row[ids[i] / BITS_PER_ENTRY] >>
+		    (ids[i] % BITS_PER_ENTRY) & 1) != 0)
+			break;
+	return (i);
+}
+
+/*
+ * The same for RM_BLOCKED: the lowest of the positions (where) of the
+ * rules in the list's bitmap (mask) that sample j of block b satisfies.
+ */
+static int
+slice_position(rulematrix_t *rm,
+    v_entry *mask, int *where, int n, int b, int j)
+{
+	v_entry h;
+	int best, i, w;
+
+	best = n - 1;
+	for (w = 0; w < rm->n_words; w++)
+		for (h = SLICE(rm, b, w)[j] & mask[w]; h != 0; h &= h - 1) {
+			i = where[w * BLOCK + FIRST_ONE(h)];
+			if (i < best)
+				best = i;
+		}
+	return (best);
+}
+
+/* rulematrix_positions for RM_BLOCKED. */
+static int
+slice_positions(rulematrix_t *rm,
+    int *ids, int n, int *samples, int nq, int *pos)
+{
+	v_entry hits[BLOCK], *a, *mask, h;
+	int best[BLOCK], *where, b, i, j, nb, q, s, w;
+
+	mask = calloc(rm->n_words, sizeof(v_entry));
+	where = malloc(rm->n_rules * sizeof(int));
+	if (mask == NULL || where == NULL) {
+		free(mask);
+		free(where);
+		return (ENOMEM);
+	}
+	/* Only the list's rules are looked up; the first of repeats wins. */
+	for (i = n - 2; i >= 0; i--) {
+		where[ids[i]] = i;
+		mask[ids[i] / BLOCK] |= (v_entry)1 << (ids[i] % BLOCK);
+	}
+	for (q = 0; samples != NULL && q < nq; q++) {
+		s = samples[q];
+#ifdef GMP
+		b = (rm->n_samples - 1 - s) / BLOCK;
+#else
+		b = s / BLOCK;
+#endif
+		j = BIT_SAMPLE(rm->n_samples, b, 0) - s;
+		pos[q] = slice_position(rm, mask, where, n, b, j);
+	}
+	for (b = 0; samples == NULL && b * BLOCK < rm->n_samples; b++) {
+		nb = NBITS(rm->n_samples, b) < BLOCK ?
+		    NBITS(rm->n_samples, b) : BLOCK;
+		for (j = 0; j < nb; j++)
+			best[j] = n - 1;
+		for (w = 0; w < rm->n_words; w++) {
+			if (mask[w] == 0)
+				continue;
+			a = SLICE(rm, b, w);
+			for (j = 0; j < BLOCK; j++)
+				hits[j] = a[j] & mask[w];
+			for (j = 0; j < nb; j++)
+				for (h = hits[j]; h != 0; h &= h - 1) {
+					i = where[w * BLOCK + FIRST_ONE(h)];
+					if (i < best[j])
+						best[j] = i;
+				}
+		}
+		for (j = 0; j < nb; j++)
+			pos[BIT_SAMPLE(rm->n_samples, b, j)] = best[j];
+	}
+	free(mask);
+	free(where);
+	return (0);
+}
+
+/*
+ * The position on the list ids[0..n-1] of the rule that first captures
+ * each of the nq samples in samples, in pos, or with samples NULL, that
+ * of every sample, in order, as cascade_positions gives them.  The last
+ * rule, the default, gets whatever the others leave.
+ */
+int
+rulematrix_positions(rulematrix_t *rm,
+    int *ids, int n, int *samples, int nq, int *pos)
+{
+	int b, j, q, s, nb;
+
+	if (n < 1)
+		return (EINVAL);
+	if (rm->layout == RM_BLOCKED)
+		return (slice_positions(rm, ids, n, samples, nq, pos));
+	for (q = 0; samples != NULL && q < nq; q++) {
+		s = samples[q];
+#ifdef GMP
+		b = (rm->n_samples - 1 - s) / BLOCK;
+#else
+		b = s / BLOCK;
+#endif
+		j = BIT_SAMPLE(rm->n_samples, b, 0) - s;
+		pos[q] = sample_position(rm, ids, n, b, j);
+	}
+	for (b = 0; samples == NULL && b * BLOCK < rm->n_samples; b++) {
+		nb = NBITS(rm->n_samples, b) < BLOCK ?
+		    NBITS(rm->n_samples, b) : BLOCK;
+		for (j = 0; j < nb; j++)
+			pos[BIT_SAMPLE(rm->n_samples, b, j)] =
+			    sample_position(rm, ids, n, b, j);
+	}
+	return (0);
+}
+
+void
+rulematrix_free(rulematrix_t *rm)
+{
+	free(rm->bits);
+	memset(rm, 0, sizeof(rulematrix_t));
+}